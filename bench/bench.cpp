@@ -0,0 +1,353 @@
+#define GLM_ENABLE_EXPERIMENTAL
+#include "tracer/tracer.hpp"
+
+// Microbenchmarks of the per sample kernels. Inputs are generated from a
+// fixed seed before timing. Each benchmark is warmed up, then timed over
+// many repetitions of a batch of calls sized to take about repetitionTime;
+// the median and the median absolute deviation of the per call time are
+// printed and written as JSON for comparing builds.
+//
+// The mesh benchmarks run EmbreeMesh::Hit and BVHMesh::Hit on the same mesh
+// for each of bvhConfigs, whose build times are reported next to their
+// trace times; BVHList::Hit and HittableList::Hit compare a grouped and a
+// plain list of spheres. MeshHit/loaded and MeshHit/reordered shade hits
+// (with smooth normals) of camera rays in scanline order on the mesh in
+// load order and after Mesh::Reorder; the synthetic mesh is shuffled
+// first, as scans come in arbitrary order.
+//
+// Usage: bench [output.json] [name filter] [mesh.stl|obj|ply]
+
+const uint32_t seed = 1;
+const int numInputs = 4096;
+const int repetitions = 31;
+const double warmupTime = 0.05;
+const double repetitionTime = 0.01;
+
+const int numSpheres = 1024;
+
+// "quality[,compact][,robust]" as in BVHOptions::Name; "medium" names the
+// plain benchmark, the others are suffixed with /config
+const char *bvhConfigs[] = {
+    "medium", "low", "high", "medium,compact", "high,compact", "medium,robust"};
+
+BVHOptions BVHConfig(const std::string &name) {
+    BVHOptions options;
+    options.Quality = ParseBVHQuality(name.substr(0, name.find(',')));
+    options.Compact = name.find(",compact") != std::string::npos;
+    options.Robust = name.find(",robust") != std::string::npos;
+    return options;
+}
+
+// keeps the compiler from discarding a benchmarked result
+template <typename T>
+inline void Consume(const T &value) {
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+struct BenchmarkResult {
+    std::string Name;
+    int BatchSize;
+    double Median;
+    double MAD;
+    double Min;
+};
+
+double Median(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    const int n = values.size();
+    return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+// f(i) performs call i; times are in nanoseconds per call
+template <typename F>
+BenchmarkResult Measure(const std::string &name, F f) {
+    using clock = std::chrono::steady_clock;
+    const auto seconds = [](const clock::time_point &start) {
+        return std::chrono::duration<double>(clock::now() - start).count();
+    };
+
+    // warm up while finding a batch size that fills repetitionTime
+    int batchSize = 1;
+    int i = 0;
+    const auto warmupStart = clock::now();
+    while (true) {
+        const auto start = clock::now();
+        for (int j = 0; j < batchSize; j++) {
+            f(i++);
+        }
+        const double elapsed = seconds(start);
+        if (elapsed < repetitionTime / 2) {
+            batchSize *= 2;
+        } else if (seconds(warmupStart) >= warmupTime) {
+            break;
+        }
+    }
+
+    std::vector<double> times;
+    for (int r = 0; r < repetitions; r++) {
+        const auto start = clock::now();
+        for (int j = 0; j < batchSize; j++) {
+            f(i++);
+        }
+        times.push_back(seconds(start) * 1e9 / batchSize);
+    }
+
+    const double median = Median(times);
+    std::vector<double> deviations;
+    for (const double t : times) {
+        deviations.push_back(std::abs(t - median));
+    }
+    const double min = *std::min_element(times.begin(), times.end());
+    return BenchmarkResult{name, batchSize, median, Median(deviations), min};
+}
+
+std::vector<vec3> RandomDirections(const int n) {
+    std::vector<vec3> result;
+    for (int i = 0; i < n; i++) {
+        result.push_back(glm::normalize(RandomInUnitSphere()));
+    }
+    return result;
+}
+
+std::vector<vec3> RandomHemisphere(const int n) {
+    std::vector<vec3> result;
+    for (int i = 0; i < n; i++) {
+        result.push_back(CosineSampleHemisphere());
+    }
+    return result;
+}
+
+// rays from a shell of radius 3 aimed near the origin, so roughly half
+// of them hit a unit sized object there
+std::vector<Ray> RandomRays(const int n) {
+    std::vector<Ray> result;
+    for (int i = 0; i < n; i++) {
+        const vec3 origin = glm::normalize(RandomInUnitSphere()) * real(3);
+        const vec3 target = RandomInUnitSphere();
+        result.emplace_back(origin, glm::normalize(target - origin));
+    }
+    return result;
+}
+
+// unit sphere tessellated into 2 * n * n triangles
+P_Mesh SphereMesh(const int n) {
+    const auto point = [n](const int i, const int j) {
+        const real theta = PI * i / n;
+        const real phi = 2 * PI * j / n;
+        return vec3(
+            std::sin(theta) * std::cos(phi),
+            std::sin(theta) * std::sin(phi),
+            std::cos(theta));
+    };
+    std::vector<vec3> data;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            const vec3 p00 = point(i, j);
+            const vec3 p01 = point(i, j + 1);
+            const vec3 p10 = point(i + 1, j);
+            const vec3 p11 = point(i + 1, j + 1);
+            data.insert(data.end(), {p00, p10, p11, p00, p11, p01});
+        }
+    }
+    return std::make_shared<Mesh>(data);
+}
+
+// the triangles of mesh in random order
+P_Mesh ShuffledMesh(const Mesh &mesh) {
+    std::vector<int> order(mesh.Triangles().size());
+    for (int i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937(seed));
+    std::vector<vec3> data;
+    for (const int i : order) {
+        const auto &t = mesh.Triangles()[i];
+        data.insert(data.end(), {
+            mesh.Positions()[t.x], mesh.Positions()[t.y], mesh.Positions()[t.z]});
+    }
+    return std::make_shared<Mesh>(data);
+}
+
+int main(int argc, char **argv) {
+    const std::string outputPath = argc > 1 ? argv[1] : "bench.json";
+    const std::string filter = argc > 2 ? argv[2] : "";
+    const std::string meshPath = argc > 3 ? argv[3] : "";
+
+    SeedRandom(seed);
+
+    const std::vector<Ray> rays = RandomRays(numInputs);
+    const std::vector<vec3> directions = RandomDirections(numInputs);
+    const std::vector<vec3> wos = RandomHemisphere(numInputs);
+    const std::vector<vec3> wis = RandomHemisphere(numInputs);
+    std::vector<vec3> colors;
+    std::vector<real> uvs;
+    for (int i = 0; i < numInputs; i++) {
+        colors.push_back(vec3(Random(), Random(), Random()));
+        uvs.push_back(Random());
+    }
+    const int mask = numInputs - 1;
+
+    const auto material = std::make_shared<Lambertian>(
+        std::make_shared<SolidTexture>(vec3(0.5)));
+    DisneyParameters params = {};
+    params.baseColor = HexColor(0x777880);
+    params.subsurface = 0.1;
+    params.specular = 0.5;
+    params.roughness = 0.2;
+    params.clearcoat = 0.1;
+    const Disney disney(params);
+    const Camera camera(
+        vec3(3, 0, 1), vec3(0), vec3(0, 0, 1), 25, 1, 0.01, 3);
+    const Sphere sphere(vec3(0), 1, material);
+    const Cube cube(vec3(-0.5), vec3(0.5), material);
+    Image image(256, 256);
+
+    P_Mesh mesh = meshPath.empty() ? SphereMesh(256) : LoadMesh(meshPath);
+    mesh->FitInUnitCube();
+#ifndef TRACER_NO_EMBREE
+    RTCDevice device = rtcNewDevice(NULL);
+#endif
+
+    std::vector<P_Hittable> spheres;
+    HittableList sphereList;
+    for (int i = 0; i < numSpheres; i++) {
+        spheres.push_back(std::make_shared<Sphere>(
+            RandomInUnitSphere(), 0.02 + 0.03 * Random(), material));
+        sphereList.Add(spheres.back());
+    }
+    const BVHList sphereGroup(spheres);
+
+    std::vector<BenchmarkResult> results;
+    const auto wanted = [&](const std::string &name) {
+        return name.find(filter) != std::string::npos;
+    };
+    const auto run = [&](const std::string &name, auto f) {
+        if (!wanted(name)) {
+            return;
+        }
+        const BenchmarkResult r = Measure(name, f);
+        printf("%-20s %10.2f ns  +/- %7.2f  (min %.2f, batch %d)\n",
+            r.Name.c_str(), r.Median, r.MAD, r.Min, r.BatchSize);
+        results.push_back(r);
+    };
+
+    run("Random", [&](const int i) {
+        Consume(Random());
+    });
+    run("Camera::MakeRay", [&](const int i) {
+        Consume(camera.MakeRay(uvs[i & mask], uvs[(i + 1) & mask]));
+    });
+    run("Sphere::Hit", [&](const int i) {
+        HitInfo hit;
+        Consume(sphere.Hit(rays[i & mask], EPS, INF, hit));
+        Consume(hit.T);
+    });
+    run("Cube::Hit", [&](const int i) {
+        HitInfo hit;
+        Consume(cube.Hit(rays[i & mask], EPS, INF, hit));
+        Consume(hit.T);
+    });
+    run("HittableList::Hit", [&](const int i) {
+        HitInfo hit;
+        Consume(sphereList.Hit(rays[i & mask], EPS, INF, hit));
+        Consume(hit.T);
+    });
+    run("BVHList::Hit", [&](const int i) {
+        HitInfo hit;
+        Consume(sphereGroup.Hit(rays[i & mask], EPS, INF, hit));
+        Consume(hit.T);
+    });
+
+    // builds only the meshes whose benchmark passes the filter
+    json builds;
+    const auto runMesh = [&](
+        const std::string &backend, const std::string &name,
+        const char *config, const auto &build)
+    {
+        if (!wanted(name)) {
+            return;
+        }
+        const auto m = build(BVHConfig(config));
+        printf("%-20s %10.3f ms build\n", name.c_str(), m->BuildSeconds() * 1e3);
+        builds[backend][config] = m->BuildSeconds();
+        run(name, [&](const int i) {
+            HitInfo hit;
+            Consume(m->Hit(rays[i & mask], EPS, INF, hit));
+            Consume(hit.T);
+        });
+    };
+
+    if (wanted("MeshHit/loaded") || wanted("MeshHit/reordered")) {
+        const P_Mesh loaded = meshPath.empty() ? ShuffledMesh(*mesh) :
+            std::make_shared<Mesh>(*mesh);
+        loaded->SmoothNormals();
+        const P_Mesh reordered = std::make_shared<Mesh>(*loaded);
+        reordered->Reorder();
+#ifdef TRACER_NO_EMBREE
+        const GeometryDevice device = NewGeometryDevice();
+#endif
+        const auto before = MakeMesh(device, loaded, material);
+        const auto after = MakeMesh(device, reordered, material);
+        // a 64 x 64 image of the mesh
+        std::vector<Ray> primary;
+        for (int i = 0; i < numInputs; i++) {
+            primary.push_back(camera.MakeRay(
+                (i % 64 + 0.5) / 64, (i / 64 + 0.5) / 64));
+        }
+        run("MeshHit/loaded", [&](const int i) {
+            HitInfo hit;
+            Consume(before->Hit(primary[i & mask], EPS, INF, hit));
+            Consume(hit.Normal);
+        });
+        run("MeshHit/reordered", [&](const int i) {
+            HitInfo hit;
+            Consume(after->Hit(primary[i & mask], EPS, INF, hit));
+            Consume(hit.Normal);
+        });
+    }
+
+    for (const char *config : bvhConfigs) {
+        const std::string suffix =
+            std::string(config) == "medium" ? "" : std::string("/") + config;
+#ifndef TRACER_NO_EMBREE
+        runMesh("embree", "EmbreeMesh::Hit" + suffix, config,
+            [&](const BVHOptions &options) {
+                return std::make_shared<EmbreeMesh>(device, mesh, material, options);
+            });
+#endif
+        runMesh("bvh", "BVHMesh::Hit" + suffix, config,
+            [&](const BVHOptions &options) {
+                return std::make_shared<BVHMesh>(mesh, material, options);
+            });
+    }
+    run("Disney::f", [&](const int i) {
+        Consume(disney.f(vec3(0), wos[i & mask], wis[i & mask]));
+    });
+    run("ONB", [&](const int i) {
+        const ONB onb(directions[i & mask]);
+        Consume(onb);
+    });
+    run("Image::AddSample", [&](const int i) {
+        image.AddSample(i & 255, (i >> 8) & 255, colors[i & mask]);
+    });
+
+    json output;
+    output["seed"] = seed;
+    output["repetitions"] = repetitions;
+    output["triangles"] = mesh->Triangles().size();
+    output["buildSeconds"] = builds;
+#ifdef VERSION_HASH
+    output["version"] = VERSION_HASH;
+#endif
+    for (const BenchmarkResult &r : results) {
+        output["benchmarks"].push_back({
+            {"name", r.Name},
+            {"batchSize", r.BatchSize},
+            {"medianNs", r.Median},
+            {"madNs", r.MAD},
+            {"minNs", r.Min}});
+    }
+    std::ofstream(outputPath) << output.dump(2) << std::endl;
+    std::cout << outputPath << std::endl;
+    return 0;
+}
@@ -0,0 +1,169 @@
+#define GLM_ENABLE_EXPERIMENTAL
+#include "tracer/tracer.hpp"
+
+// End to end performance and convergence check. Each reference scene in
+// bench/scenes is rendered one sample per pixel at a time; after every
+// pass the error against the scene's high sample count reference image is
+// measured, giving RMSE as a function of render time. The state at each
+// time budget (doubling up to maxSeconds) is printed, and the full curves
+// are written as JSON; rays/s is included when built with make STATS=1.
+// Run from the repository root.
+//
+// Usage: regress [output.json] [max seconds]
+//        regress --reference samples
+//
+// The second form renders the reference images (bench/scenes/<name>.pfm)
+// themselves (make regress-reference); regenerate them whenever the
+// expected result changes. The first form stops if any are missing.
+
+const char *scenePath = "bench/scenes/";
+const std::vector<std::string> sceneNames = {
+    "mesh", "spheres", "glass", "volume", "cloud", "lights"};
+const double firstBudget = 0.25;
+const double defaultMaxSeconds = 8;
+const int numThreads = -1;
+
+struct Scene {
+    std::string Name;
+    json Description;
+    P_HittableList World;
+    std::unique_ptr<Camera> View;
+    int Width;
+    int Height;
+};
+
+Scene LoadScene(const std::string &name, AssetCache &assets) {
+    const std::string path = scenePath + name + ".json";
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    Scene scene;
+    scene.Name = name;
+    scene.Description = json::parse(in);
+    const json &j = scene.Description;
+    scene.Width = j.value("width", 256);
+    scene.Height = j.value("height", 256);
+    scene.World = ParseWorld(
+        j.at("objects"), assets,
+        ParseBVHOptions(j.value("bvh", json::object())));
+    scene.View.reset(new Camera(ParseCamera(
+        j.at("camera"), real(scene.Width) / scene.Height)));
+    return scene;
+}
+
+void RenderReference(const Scene &scene, const int numSamples) {
+    Sampler sampler(scene.World);
+    ImageLayout layout;
+    layout.Variance = false;
+    Image image(scene.Width, scene.Height, layout);
+    const auto start = std::chrono::steady_clock::now();
+    for (int s = 0; s < numSamples; s += 16) {
+        Render(image, sampler, *scene.View,
+            std::min(16, numSamples - s), numThreads);
+    }
+    const double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    const std::string path = scenePath + scene.Name + ".pfm";
+    image.SavePFM(path);
+    printf("%-10s %d spp in %.1fs -> %s\n",
+        scene.Name.c_str(), numSamples, seconds, path.c_str());
+}
+
+json Converge(const Scene &scene, const double maxSeconds) {
+    const std::string referencePath = scenePath + scene.Name + ".pfm";
+    const Image reference = LoadPFM(referencePath);
+    if (reference.Width() != scene.Width ||
+        reference.Height() != scene.Height)
+    {
+        throw std::runtime_error("reference size mismatch: " + referencePath);
+    }
+
+    Sampler sampler(scene.World);
+    ImageLayout layout;
+    layout.Variance = false;
+    Image image(scene.Width, scene.Height, layout);
+    const double pixels = double(scene.Width) * scene.Height;
+
+    json curve = json::array();
+    json budgets = json::array();
+    double seconds = 0;
+    double budget = firstBudget;
+    STATS(const RenderStats statsBefore = TotalStats());
+    for (int spp = 1; budget <= maxSeconds; spp++) {
+        const auto start = std::chrono::steady_clock::now();
+        Render(image, sampler, *scene.View, 1, numThreads);
+        seconds += std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+        const double rmse = RMSE(image, reference);
+        json point = {
+            {"seconds", seconds},
+            {"samplesPerPixel", spp},
+            {"samplesPerSecond", pixels * spp / seconds},
+            {"rmse", rmse}};
+        STATS(point["raysPerSecond"] = (TotalStats() - statsBefore).Rays() / seconds);
+        curve.push_back(point);
+        while (seconds >= budget && budget <= maxSeconds) {
+            printf("%-10s %6.2fs %6d spp %10.3g samples/s  rmse %.5f\n",
+                scene.Name.c_str(), budget, spp,
+                pixels * spp / seconds, rmse);
+            json row = point;
+            row["budget"] = budget;
+            budgets.push_back(row);
+            budget *= 2;
+        }
+    }
+
+    return json{
+        {"name", scene.Name},
+        {"width", scene.Width},
+        {"height", scene.Height},
+        {"budgets", budgets},
+        {"curve", curve}};
+}
+
+int main(int argc, char **argv) {
+    const bool referenceMode =
+        argc > 1 && std::string(argv[1]) == "--reference";
+    if (referenceMode && argc != 3) {
+        std::cout << "Usage: regress --reference samples" << std::endl;
+        return 1;
+    }
+
+    ProgressBar::SetEnabled(false);
+    AssetCache assets(NewGeometryDevice(), sceneNames.size());
+
+    if (referenceMode) {
+        const int numSamples = std::stoi(argv[2]);
+        for (const std::string &name : sceneNames) {
+            RenderReference(LoadScene(name, assets), numSamples);
+        }
+        return 0;
+    }
+
+    for (const std::string &name : sceneNames) {
+        const std::string path = scenePath + name + ".pfm";
+        if (!std::ifstream(path)) {
+            std::cout << "missing reference image " << path << std::endl;
+            std::cout << "render the references first: " <<
+                "make regress-reference (regress --reference samples)" << std::endl;
+            return 1;
+        }
+    }
+
+    const std::string outputPath = argc > 1 ? argv[1] : "regress.json";
+    const double maxSeconds = argc > 2 ? std::stod(argv[2]) : defaultMaxSeconds;
+
+    json output;
+    output["threads"] = NumWorkers(numThreads);
+#ifdef VERSION_HASH
+    output["version"] = VERSION_HASH;
+#endif
+    for (const std::string &name : sceneNames) {
+        output["scenes"].push_back(Converge(LoadScene(name, assets), maxSeconds));
+    }
+    std::ofstream(outputPath) << output.dump(2) << std::endl;
+    std::cout << outputPath << std::endl;
+    return 0;
+}
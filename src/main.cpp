@@ -8,6 +8,39 @@ const int samplesPerFrame = 16;
 const int numFrames = -1;
 const int numThreads = -1;
 
+// when > 0, cache primary hits at cacheStrata^2 subpixel positions per
+// pixel and reuse them in later frames (pinhole cameras only)
+const int cacheStrata = 0;
+
+// when > 0, render a turntable of this many frames, rotating the model
+// about the up axis instead of rendering progressive frames
+const int turntableFrames = 0;
+
+// when set, write a Chrome trace (chrome://tracing, ui.perfetto.dev) of
+// loading, rendering and saving to this path
+const char *tracePath = "";
+
+// when set, append JSON lines progress records to this path (for example
+// a fifo read by a render farm scheduler)
+const char *progressPath = "";
+
+// when > 0, fail at load time, or fall back to compact storage, rather
+// than use more than this many MB for meshes, BVHs, images and volumes
+const int memoryBudgetMB = 0;
+
+// when set, sort the model's triangles and vertices along a Morton curve
+// after loading, for memory locality on large scans
+const bool reorderMesh = false;
+
+// number of meshes kept loaded by the render daemon (--daemon)
+const int daemonCacheSize = 8;
+
+// when > 0, render the frame in bands of this many rows and stream them
+// to streamPath (png, tif or pfm) instead of rendering progressive frames
+const int bandHeight = 0;
+const int streamSamples = 256;
+const char *streamPath = "out.png";
+
 const vec3 eye(3, 0, 1);
 const vec3 center(0, 0, -0.075);
 const vec3 up(0, 0, 1);
@@ -17,21 +50,46 @@ const real aperture = 0.01;
 const real focalDistance = 3;
 
 int main(int argc, char **argv) {
+    if (tracePath[0]) {
+        Tracer::Shared().Start(tracePath);
+    }
+    MemoryTracker::Shared().SetBudget(int64_t(memoryBudgetMB) << 20);
+    if (progressPath[0]) {
+        ProgressBar::SetJSONStream(progressPath);
+    }
+
+    if (argc == 3 && std::string(argv[1]) == "--daemon") {
+        RenderDaemon daemon(argv[2], daemonCacheSize, numThreads);
+        daemon.Serve();
+        return 0;
+    }
+
+    if (argc == 3 && std::string(argv[1]) == "--batch") {
+        RunBatch(argv[2], numThreads);
+        return 0;
+    }
+
     if (argc != 2) {
-        std::cout << "Usage: tracer input.stl" << std::endl;
+        std::cout << "Usage: tracer mesh.stl|obj|ply" << std::endl;
+        std::cout << "       tracer --batch jobs.json" << std::endl;
+        std::cout << "       tracer --daemon socket" << std::endl;
         return 1;
     }
 
-    RTCDevice device = rtcNewDevice(NULL);
+    GeometryDevice device = NewGeometryDevice();
 
     auto world = std::make_shared<HittableList>();
 
-    auto mesh = LoadBinarySTL(argv[1]);
+    auto mesh = LoadMesh(argv[1]);
     // mesh->SmoothNormals();
     mesh->FitInUnitCube();
     mesh->Rotate(glm::radians(60.f), up);
+    if (reorderMesh) {
+        mesh->Reorder();
+    }
 
     // model
+    P_Instance model;
     {
         const DisneyParameters params = {
             HexColor(0x777880), // BaseColor
@@ -47,7 +105,13 @@ int main(int argc, char **argv) {
             0, // ClearcoatGloss
         };
         const auto material = std::make_shared<Disney>(params);
-        world->Add(std::make_shared<EmbreeMesh>(device, mesh, material));
+        const auto object = MakeMesh(device, mesh, material);
+        if (turntableFrames > 0) {
+            model = std::make_shared<Instance>(object);
+            world->Add(model);
+        } else {
+            world->Add(object);
+        }
     }
 
     // floor
@@ -85,9 +149,43 @@ int main(int argc, char **argv) {
 
     Camera camera(eye, center, up, fovy, aspect, aperture, focalDistance);
     Sampler sampler(world);
+
+    if (bandHeight > 0) {
+        RunStreaming(
+            width, height, bandHeight, sampler, camera,
+            streamSamples, numThreads, streamPath);
+        Tracer::Shared().Flush();
+        return 0;
+    }
+
     Image image(width, height);
 
-    Run(image, sampler, camera, numFrames, samplesPerFrame, numThreads);
+    if (turntableFrames > 0) {
+        const Animation animation = Turntable(eye, center, up, fovy, up);
+        RunAnimation(
+            image, sampler, animation, {model}, aspect, aperture,
+            focalDistance, turntableFrames, samplesPerFrame, numThreads);
+        return 0;
+    }
+
+    // auxiliary outputs written next to each frame
+    AOVOptions aovs;
+    // aovs.Albedo = true;
+    // aovs.Normal = true;
+    // aovs.Depth = true;
+    // aovs.MaterialID = true;
+    // aovs.SampleCount = true;
+    // aovs.Cost = true;
+
+    // optional denoising post-pass; set Reference to a high sample count
+    // PFM to print the error before and after
+    DenoiseOptions denoise;
+    // denoise.Enabled = true;
+    // denoise.Reference = "reference.pfm";
+
+    Run(
+        image, sampler, camera, numFrames, samplesPerFrame, numThreads,
+        aovs, denoise, cacheStrata);
 
     return 0;
 }
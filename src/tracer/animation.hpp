@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <vector>
+
+#include "config.hpp"
+
+// Camera and object state at one point in time. The object transform is a
+// uniform scale, then a rotation of Angle radians about Axis, then a
+// translation.
+struct Keyframe {
+    real Time;
+    vec3 Eye;
+    vec3 Center;
+    vec3 Up;
+    real Fovy;
+    vec3 Axis;
+    real Angle;
+    real Scale;
+    vec3 Translation;
+
+    mat4 Transform() const {
+        mat4 m = glm::translate(mat4(1), Translation);
+        m = glm::rotate(m, Angle, Axis);
+        return glm::scale(m, vec3(Scale));
+    }
+};
+
+// Keyframes ordered by time, linearly interpolated. Angles are interpolated
+// as numbers, so a single segment can turn more than half a revolution.
+class Animation {
+public:
+    void Add(const Keyframe &keyframe) {
+        const auto it = std::upper_bound(
+            m_Keyframes.begin(), m_Keyframes.end(), keyframe,
+            [](const Keyframe &a, const Keyframe &b) {
+                return a.Time < b.Time;
+            });
+        m_Keyframes.insert(it, keyframe);
+    }
+
+    bool Empty() const {
+        return m_Keyframes.empty();
+    }
+
+    real Start() const {
+        return m_Keyframes.front().Time;
+    }
+
+    real End() const {
+        return m_Keyframes.back().Time;
+    }
+
+    Keyframe At(const real time) const {
+        if (time <= Start()) {
+            return m_Keyframes.front();
+        }
+        if (time >= End()) {
+            return m_Keyframes.back();
+        }
+        int i = 1;
+        while (m_Keyframes[i].Time < time) {
+            i++;
+        }
+        const Keyframe &a = m_Keyframes[i - 1];
+        const Keyframe &b = m_Keyframes[i];
+        const real t = (time - a.Time) / (b.Time - a.Time);
+        Keyframe k;
+        k.Time = time;
+        k.Eye = glm::mix(a.Eye, b.Eye, t);
+        k.Center = glm::mix(a.Center, b.Center, t);
+        k.Up = glm::normalize(glm::mix(a.Up, b.Up, t));
+        k.Fovy = glm::mix(a.Fovy, b.Fovy, t);
+        k.Axis = glm::normalize(glm::mix(a.Axis, b.Axis, t));
+        k.Angle = glm::mix(a.Angle, b.Angle, t);
+        k.Scale = glm::mix(a.Scale, b.Scale, t);
+        k.Translation = glm::mix(a.Translation, b.Translation, t);
+        return k;
+    }
+
+private:
+    std::vector<Keyframe> m_Keyframes;
+};
+
+// One full revolution of the object about axis (through the origin) over
+// time 0 to 1, seen from a fixed camera.
+Animation Turntable(
+    const vec3 &eye, const vec3 &center, const vec3 &up, const real fovy,
+    const vec3 &axis)
+{
+    Animation animation;
+    Keyframe k = {0, eye, center, up, fovy, axis, 0, 1, vec3(0)};
+    animation.Add(k);
+    k.Time = 1;
+    k.Angle = 2 * PI;
+    animation.Add(k);
+    return animation;
+}
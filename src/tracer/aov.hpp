@@ -0,0 +1,172 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "colormap.hpp"
+#include "config.hpp"
+#include "image.hpp"
+#include "stats.hpp"
+
+// Auxiliary values for one sample, taken at the first non-specular vertex
+// of the path (or where it escapes or hits a light). Albedo includes the
+// tint of any specular bounces before that vertex.
+struct SampleAOV {
+    vec3 Albedo = vec3(0);
+    vec3 Normal = vec3(0);
+    real Depth = 0;
+    int MaterialID = -1;
+};
+
+// Which auxiliary outputs to collect next to the beauty pass.
+struct AOVOptions {
+    bool Albedo = false;
+    bool Normal = false;
+    bool Depth = false;
+    bool MaterialID = false;
+    bool SampleCount = false;
+    // per sample render time (CycleCount ticks) and, with TRACER_STATS,
+    // rays traced
+    bool Cost = false;
+
+    bool Any() const {
+        return Albedo || Normal || Depth || MaterialID || SampleCount || Cost;
+    }
+};
+
+// Per-pixel AOV planes held in an Image. Only the requested planes are
+// allocated. Albedo, normal, depth and cost are averaged over samples;
+// material ID keeps the first sample's value. Cost planes are always full
+// precision floats, as tick counts overflow half floats.
+class AOVBuffers {
+public:
+    AOVBuffers(Image &image, const AOVOptions &options) :
+        m_Image(image),
+        m_Albedo(options.Albedo ? image.AddPlane("albedo", 3) : -1),
+        m_Normal(options.Normal ? image.AddPlane("normal", 3) : -1),
+        m_Depth(options.Depth ? image.AddPlane("depth", 1) : -1),
+        m_MaterialID(options.MaterialID ? image.AddPlane("id", 1) : -1),
+        m_SampleCount(options.SampleCount ? image.AddPlane("samples", 1) : -1),
+        m_Cost(options.Cost ? image.AddPlane("cost", 1, false) : -1),
+        m_Rays(options.Cost && StatsEnabled ?
+            image.AddPlane("rays", 1, false) : -1)
+    {}
+
+    bool RecordsCost() const {
+        return m_Cost >= 0;
+    }
+
+    // call after the matching Image::AddSample
+    void Add(const int x, const int y, const SampleAOV &aov) {
+        const int i = y * m_Image.Width() + x;
+        const int n = m_Image.NumSamples(x, y);
+        if (m_Albedo >= 0) {
+            Accumulate(m_Albedo, i, n, &aov.Albedo[0], 3);
+        }
+        if (m_Normal >= 0) {
+            Accumulate(m_Normal, i, n, &aov.Normal[0], 3);
+        }
+        if (m_Depth >= 0) {
+            Accumulate(m_Depth, i, n, &aov.Depth, 1);
+        }
+        if (m_MaterialID >= 0 && n == 1) {
+            m_Image.GetPlane(m_MaterialID).Set(i, 0, aov.MaterialID);
+        }
+        if (m_SampleCount >= 0) {
+            m_Image.GetPlane(m_SampleCount).Set(i, 0, n);
+        }
+    }
+
+    // adds the ticks and rays spent on the last numSamples samples of a
+    // pixel; call after their Image::AddSample
+    void AddCost(
+        const int x, const int y, const int numSamples,
+        const uint64_t ticks, const uint64_t rays)
+    {
+        const int i = y * m_Image.Width() + x;
+        const int n = m_Image.NumSamples(x, y);
+        AccumulateTotal(m_Cost, i, n, numSamples, ticks);
+        if (m_Rays >= 0) {
+            AccumulateTotal(m_Rays, i, n, numSamples, rays);
+        }
+    }
+
+    // writes the cost planes as false color images <prefix>.cost.png
+    // (Inferno) and <prefix>.rays.png (Viridis), scaled so that the 99th
+    // percentile maps to the top of the palette
+    void SaveHeatmaps(const std::string &prefix) const {
+        if (m_Cost >= 0) {
+            SaveHeatmap(m_Cost, Inferno, prefix + ".cost.png");
+        }
+        if (m_Rays >= 0) {
+            SaveHeatmap(m_Rays, Viridis, prefix + ".rays.png");
+        }
+    }
+
+    // writes each plane to <prefix>.<name>.pfm
+    void SavePFM(const std::string &prefix) const {
+        for (int i = 0; i < m_Image.NumPlanes(); i++) {
+            const Plane &plane = m_Image.GetPlane(i);
+            m_Image.SavePlanePFM(i, prefix + "." + plane.Name() + ".pfm");
+        }
+    }
+
+private:
+    void Accumulate(
+        const int index, const int i, const int n,
+        const real *values, const int channels)
+    {
+        Plane &plane = m_Image.GetPlane(index);
+        for (int c = 0; c < channels; c++) {
+            const real m = plane.Get(i, c);
+            plane.Set(i, c, m + (values[c] - m) / n);
+        }
+    }
+
+    // running mean per sample of a total over k more samples, n in all
+    void AccumulateTotal(
+        const int index, const int i, const int n, const int k,
+        const uint64_t total)
+    {
+        Plane &plane = m_Image.GetPlane(index);
+        const double m = plane.Get(i, 0);
+        plane.Set(i, 0, m + (double(total) - m * k) / n);
+    }
+
+    void SaveHeatmap(
+        const int index, const Colormap &colormap,
+        const std::string &path) const
+    {
+        const Plane &plane = m_Image.GetPlane(index);
+        const int n = m_Image.Width() * m_Image.Height();
+        std::vector<float> values(n);
+        for (int i = 0; i < n; i++) {
+            values[i] = plane.Get(i, 0);
+        }
+        std::vector<float> sorted(values);
+        const auto p99 = sorted.begin() + (n - 1) * 99 / 100;
+        std::nth_element(sorted.begin(), p99, sorted.end());
+        const float scale = *p99 > 0 ? 1 / *p99 : 0;
+        std::vector<uint8_t> data(size_t(n) * 3);
+        for (int i = 0; i < n; i++) {
+            const vec3 c = colormap.At(values[i] * scale);
+            for (int k = 0; k < 3; k++) {
+                data[i * 3 + k] = std::min(std::max(c[k] * 255, real(0)), real(255));
+            }
+        }
+        stbi_write_png(
+            path.c_str(), m_Image.Width(), m_Image.Height(), 3, data.data(),
+            m_Image.Width() * 3);
+    }
+
+    Image &m_Image;
+    int m_Albedo;
+    int m_Normal;
+    int m_Depth;
+    int m_MaterialID;
+    int m_SampleCount;
+    int m_Cost;
+    int m_Rays;
+};
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "backend.hpp"
+#include "bvh.hpp"
+#include "material.hpp"
+#include "mesh.hpp"
+#include "meshio.hpp"
+#include "texture.hpp"
+
+// Least recently used cache of loaded, welded and committed meshes keyed by
+// asset, so repeated renders of the same asset skip loading and the BVH
+// build. Cached geometry is shared with a render's own material through
+// the mesh geometry's sharing constructor. Evicted entries stay alive for
+// as long as a render still uses them. Not thread safe.
+class AssetCache {
+public:
+    AssetCache(GeometryDevice device, const int capacity) :
+        m_Device(device),
+        m_Capacity(capacity),
+        m_Hits(0),
+        m_Misses(0),
+        m_Placeholder(std::make_shared<Lambertian>(
+            std::make_shared<SolidTexture>(vec3(0.5))))
+    {}
+
+    // geometry of the mesh at path, optionally fit in the unit cube, given
+    // smooth normals with creases at creaseAngle radians when it is not
+    // negative (see Mesh::SmoothNormals) and reordered for locality (see
+    // Mesh::Reorder), with a BVH built per options
+    std::shared_ptr<MeshGeometry> Geometry(
+        const std::string &path, const bool fit,
+        const BVHOptions &options = BVHOptions(), const bool reorder = false,
+        const real creaseAngle = -1)
+    {
+        const std::string key = path + (fit ? "|fit" : "") +
+            (creaseAngle >= 0 ? "|crease" + std::to_string(creaseAngle) : "") +
+            (reorder ? "|reorder" : "") + "|" + options.Name();
+        const auto it = m_Index.find(key);
+        if (it != m_Index.end()) {
+            m_Hits++;
+            m_Entries.splice(m_Entries.begin(), m_Entries, it->second);
+            return it->second->second;
+        }
+
+        m_Misses++;
+        P_Mesh mesh = LoadMesh(path);
+        if (fit) {
+            mesh->FitInUnitCube();
+        }
+        if (creaseAngle >= 0) {
+            mesh->SmoothNormals(creaseAngle);
+        }
+        if (reorder) {
+            mesh->Reorder();
+        }
+        const auto geometry = MakeMesh(m_Device, mesh, m_Placeholder, options);
+        printf("  %s: %d triangles, %s bvh built in %.3fs\n",
+            path.c_str(), int(mesh->Triangles().size()),
+            options.Name().c_str(), geometry->BuildSeconds());
+
+        m_Entries.emplace_front(key, geometry);
+        m_Index[key] = m_Entries.begin();
+        while (m_Entries.size() > m_Capacity) {
+            m_Index.erase(m_Entries.back().first);
+            m_Entries.pop_back();
+        }
+        return geometry;
+    }
+
+    // geometry of the mesh at path with material
+    P_Hittable Mesh(
+        const std::string &path, const bool fit, const P_Material &material,
+        const BVHOptions &options = BVHOptions(), const bool reorder = false,
+        const real creaseAngle = -1)
+    {
+        return std::make_shared<MeshGeometry>(
+            *Geometry(path, fit, options, reorder, creaseAngle), material);
+    }
+
+    GeometryDevice Device() const {
+        return m_Device;
+    }
+
+    int Size() const {
+        return m_Entries.size();
+    }
+
+    int Hits() const {
+        return m_Hits;
+    }
+
+    int Misses() const {
+        return m_Misses;
+    }
+
+private:
+    typedef std::pair<std::string, std::shared_ptr<MeshGeometry>> Entry;
+
+    GeometryDevice m_Device;
+    int m_Capacity;
+    int m_Hits;
+    int m_Misses;
+    P_Material m_Placeholder;
+    std::list<Entry> m_Entries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> m_Index;
+};
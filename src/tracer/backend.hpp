@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "bvh.hpp"
+#include "bvhlist.hpp"
+#include "bvhmesh.hpp"
+#include "config.hpp"
+#include "hit.hpp"
+#include "material.hpp"
+#include "mesh.hpp"
+#include "sphere.hpp"
+#ifndef TRACER_NO_EMBREE
+#include "embreemesh.hpp"
+#include "embreescene.hpp"
+#include "embreespheres.hpp"
+#endif
+
+// The backend that traces meshes and sphere sets: Embree, or BVH4 in
+// builds without it (make EMBREE=0, which defines TRACER_NO_EMBREE).
+// Everything else creates geometry through these functions and types.
+#ifdef TRACER_NO_EMBREE
+
+// the layout Embree takes sphere points in
+typedef struct {
+    float x;
+    float y;
+    float z;
+    float r;
+} EmbreeSphere;
+
+typedef std::function<void(EmbreeSphere *spheres, uint16_t *materials)> SphereFill;
+
+typedef void *GeometryDevice;
+typedef BVHMesh MeshGeometry;
+
+inline GeometryDevice NewGeometryDevice() {
+    return nullptr;
+}
+
+inline std::shared_ptr<MeshGeometry> MakeMesh(
+    GeometryDevice device, const P_Mesh &mesh, const P_Material &material,
+    const BVHOptions &options = BVHOptions())
+{
+    return std::make_shared<BVHMesh>(mesh, material, options);
+}
+
+// Materials are assigned as EmbreeSpheres does, but each sphere becomes a
+// Sphere object, far larger than Embree's 16 bytes.
+inline P_Hittable MakeSpheres(
+    GeometryDevice device, const int count, const SphereFill &fill,
+    const bool indexed, const std::vector<P_Material> &materials,
+    const BVHOptions &options = BVHOptions())
+{
+    std::vector<EmbreeSphere> spheres(count);
+    std::vector<uint16_t> indices(indexed ? count : 0);
+    fill(spheres.data(), indexed ? indices.data() : nullptr);
+    std::vector<P_Hittable> items;
+    items.reserve(count);
+    for (int i = 0; i < count; i++) {
+        const EmbreeSphere &s = spheres[i];
+        const int m = indexed ? indices[i] : materials.size() * (real)i / count;
+        items.push_back(std::make_shared<Sphere>(
+            vec3(s.x, s.y, s.z), s.r, materials[m]));
+    }
+    return std::make_shared<BVHList>(items, options);
+}
+
+inline P_Hittable MakeSpheres(
+    GeometryDevice device, const std::vector<EmbreeSphere> &spheres,
+    const std::vector<P_Material> &materials,
+    const BVHOptions &options = BVHOptions())
+{
+    return MakeSpheres(device, spheres.size(),
+        [&](EmbreeSphere *buf, uint16_t *) {
+            memcpy(buf, spheres.data(), sizeof(EmbreeSphere) * spheres.size());
+        }, false, materials, options);
+}
+
+#else
+
+typedef RTCDevice GeometryDevice;
+typedef EmbreeMesh MeshGeometry;
+
+inline GeometryDevice NewGeometryDevice() {
+    RTCDevice device = rtcNewDevice(NULL);
+    MonitorDeviceMemory(device);
+    return device;
+}
+
+inline std::shared_ptr<MeshGeometry> MakeMesh(
+    GeometryDevice device, const P_Mesh &mesh, const P_Material &material,
+    const BVHOptions &options = BVHOptions())
+{
+    return std::make_shared<EmbreeMesh>(device, mesh, material, options);
+}
+
+inline P_Hittable MakeSpheres(
+    GeometryDevice device, const int count, const SphereFill &fill,
+    const bool indexed, const std::vector<P_Material> &materials,
+    const BVHOptions &options = BVHOptions())
+{
+    return std::make_shared<EmbreeSpheres>(
+        device, count, fill, indexed, materials, options);
+}
+
+inline P_Hittable MakeSpheres(
+    GeometryDevice device, const std::vector<EmbreeSphere> &spheres,
+    const std::vector<P_Material> &materials,
+    const BVHOptions &options = BVHOptions())
+{
+    return std::make_shared<EmbreeSpheres>(device, spheres, materials, options);
+}
+
+#endif
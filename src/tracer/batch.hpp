@@ -0,0 +1,159 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "aov.hpp"
+#include "assets.hpp"
+#include "backend.hpp"
+#include "camera.hpp"
+#include "config.hpp"
+#include "denoise.hpp"
+#include "image.hpp"
+#include "memory.hpp"
+#include "render.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+#include "tonemap.hpp"
+#include "trace.hpp"
+
+// Batch job files: a scene (see scene.hpp) plus a list of shots, all
+// rendered by one process. Every key of a shot overrides the job's key of
+// the same name, so a shot can change the camera, size, sample count or
+// even the object list. "materials" maps object names to replacement
+// materials, and "output" picks the file and its format (png, ppm, pfm or
+// exr). "denoise": true runs the denoiser before saving.
+//
+//   {
+//     "width": 800, "height": 800, "samples": 64,
+//     "camera": {"eye": [3, 0, 1], "center": [0, 0, 0]},
+//     "objects": [
+//       {"name": "model", "type": "mesh", "path": "model.stl", "fit": true},
+//       ...
+//     ],
+//     "shots": [
+//       {"output": "front.png"},
+//       {"output": "side.png", "camera": {"eye": [0, 3, 1], "center": [0, 0, 0]}},
+//       {"output": "gold.exr", "samples": 256, "denoise": true,
+//        "materials": {"model": {"type": "metal", "albedo": "#d4af37"}}}
+//     ]
+//   }
+//
+// Meshes are loaded and their BVHs built once, on first use, and shared by
+// every later shot through an AssetCache large enough to never evict
+// during the batch.
+
+namespace {
+
+json ShotObjects(const json &shot) {
+    json objects = shot.at("objects");
+    if (!shot.count("materials")) {
+        return objects;
+    }
+    const json &materials = shot["materials"];
+    for (json &object : objects) {
+        const auto it = materials.find(object.value("name", ""));
+        if (it != materials.end()) {
+            object["material"] = *it;
+        }
+    }
+    return objects;
+}
+
+int CountMeshes(const json &job) {
+    int count = 0;
+    const auto add = [&count](const json &objects) {
+        for (const json &object : objects) {
+            if (object.value("type", "") == "mesh") {
+                count++;
+            }
+        }
+    };
+    add(job.value("objects", json::array()));
+    for (const json &shot : job.at("shots")) {
+        add(shot.value("objects", json::array()));
+    }
+    return count;
+}
+
+}
+
+void RunBatch(const std::string &path, const int numThreads) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    const json job = json::parse(in);
+
+    const auto elapsed = [](const std::chrono::steady_clock::time_point &t) {
+        return std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - t).count();
+    };
+    const auto batchStart = std::chrono::steady_clock::now();
+
+    AssetCache assets(NewGeometryDevice(), std::max(1, CountMeshes(job)));
+
+    const json &shots = job.at("shots");
+    for (int i = 0; i < shots.size(); i++) {
+        json shot = job;
+        shot.erase("shots");
+        shot.update(shots[i]);
+
+        const std::string output = shot.at("output").get<std::string>();
+        const int width = shot.value("width", 512);
+        const int height = shot.value("height", 512);
+        const int samples = shot.value("samples", 16);
+        if (width <= 0 || height <= 0 || samples <= 0) {
+            throw std::runtime_error("invalid size or sample count: " + output);
+        }
+        ToneMapOptions options;
+        options.Exposure = shot.value("exposure", options.Exposure);
+        options.Gamma = shot.value("gamma", options.Gamma);
+        DenoiseOptions denoise;
+        denoise.Enabled = shot.value("denoise", false);
+
+        printf("[%d/%d] %s\n", i + 1, int(shots.size()), output.c_str());
+        const auto start = std::chrono::steady_clock::now();
+
+        const P_HittableList world = ParseWorld(
+            ShotObjects(shot), assets,
+            ParseBVHOptions(shot.value("bvh", json::object())));
+        const Camera camera = ParseCamera(shot.at("camera"), real(width) / height);
+        Sampler sampler(world);
+        if (shot.count("clamp")) {
+            sampler.SetClamp(shot["clamp"].get<real>());
+        }
+        const double setupSeconds = elapsed(start);
+
+        ImageLayout layout;
+        layout.Variance = denoise.Enabled;
+        Image image(width, height, layout);
+        std::unique_ptr<AOVBuffers> aovs;
+        MemoryCharge denoiseCharge(MemoryImages);
+        if (denoise.Enabled) {
+            AOVOptions aovOptions;
+            aovOptions.Albedo = true;
+            aovOptions.Normal = true;
+            aovs.reset(new AOVBuffers(image, aovOptions));
+            ReserveDenoise(image, denoiseCharge);
+        }
+        Render(image, sampler, camera, samples, numThreads, aovs.get());
+
+        if (denoise.Enabled) {
+            denoiseCharge.Set(0);
+            Denoise(image, denoise, numThreads).Save(output, options);
+        } else {
+            image.Save(output, options);
+        }
+        Tracer::Shared().Flush();
+        printf("  %.3fs (setup %.3fs)\n", elapsed(start), setupSeconds);
+        MemoryTracker::Shared().Print();
+    }
+
+    printf("%d shots in %.3fs, %d meshes loaded, %d reused\n",
+        int(shots.size()), elapsed(batchStart), assets.Misses(), assets.Hits());
+}
@@ -37,6 +37,34 @@ public:
         return m_Min + Size() * anchor;
     }
 
+    vec3 Center() const {
+        return (m_Min + m_Max) / real(2);
+    }
+
+    bool Contains(const vec3 &p) const {
+        return
+            p.x >= m_Min.x && p.y >= m_Min.y && p.z >= m_Min.z &&
+            p.x <= m_Max.x && p.y <= m_Max.y && p.z <= m_Max.z;
+    }
+
+    Box Extend(const Box &other) const {
+        return Box(glm::min(m_Min, other.m_Min), glm::max(m_Max, other.m_Max));
+    }
+
+    // bounds of the transformed corners
+    Box Transform(const mat4 &m) const {
+        Box result;
+        for (int i = 0; i < 8; i++) {
+            const vec3 corner(
+                i & 1 ? m_Max.x : m_Min.x,
+                i & 2 ? m_Max.y : m_Min.y,
+                i & 4 ? m_Max.z : m_Min.z);
+            const vec3 p = vec3(m * vec4(corner, 1));
+            result = i ? result.Extend(Box(p, p)) : Box(p, p);
+        }
+        return result;
+    }
+
 private:
     vec3 m_Min;
     vec3 m_Max;
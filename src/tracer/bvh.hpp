@@ -0,0 +1,614 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#include "box.hpp"
+#include "config.hpp"
+#include "memory.hpp"
+#include "parallel.hpp"
+#include "ray.hpp"
+#include "trace.hpp"
+
+enum BVHQuality {
+    BVHLow,
+    BVHMedium,
+    BVHHigh
+};
+
+// How a BVH is built and traversed, by Embree or by BVH4. Low quality
+// builds fastest and suits previews; high quality takes longer to build
+// but traces faster, which pays off for final renders. Compact trades
+// traversal speed for memory, and robust keeps rays from slipping through
+// shared edges at some speed (Embree only).
+struct BVHOptions {
+    BVHQuality Quality = BVHMedium;
+    bool Compact = false;
+    bool Robust = false;
+    // hints that consecutive rays are similar, e.g. primary rays
+    bool Coherent = false;
+
+    // e.g. "high,compact"; also the asset cache key
+    std::string Name() const {
+        static const char *qualities[] = {"low", "medium", "high"};
+        std::string result = qualities[Quality];
+        if (Compact) {
+            result += ",compact";
+        }
+        if (Robust) {
+            result += ",robust";
+        }
+        if (Coherent) {
+            result += ",coherent";
+        }
+        return result;
+    }
+};
+
+inline BVHQuality ParseBVHQuality(const std::string &name) {
+    if (name == "low") {
+        return BVHLow;
+    }
+    if (name == "medium") {
+        return BVHMedium;
+    }
+    if (name == "high") {
+        return BVHHigh;
+    }
+    throw std::runtime_error("unknown build quality: " + name);
+}
+
+// Four wide bounding volume hierarchy over primitive bounds, traced without
+// Embree. The tree is built top down with binned SAH (more bins for higher
+// quality): the top levels split with parallel binning until there are
+// enough subtrees to keep every thread busy, then the subtrees are built
+// in parallel. The binary tree is then collapsed into nodes of four
+// children whose bounds are stored as SoA floats and tested against a ray
+// at once (with SSE where available).
+//
+// Bounds are rounded outward to floats so that no primitive is missed;
+// leaves hold ranges of Indices(), the primitive order.
+class BVH4 {
+public:
+    BVH4() : m_Charge(MemoryBVH) {}
+
+    BVH4(const std::vector<Box> &boxes, const BVHOptions &options = BVHOptions()) :
+        m_Charge(MemoryBVH)
+    {
+        TraceSpan span("BVH4::Build", "load", "primitives", boxes.size());
+        const int n = boxes.size();
+        if (n == 0) {
+            return;
+        }
+        m_NumBins = options.Quality == BVHLow ? 8 :
+            options.Quality == BVHMedium ? 16 : 32;
+
+        m_Prims.resize(n);
+        for (int i = 0; i < n; i++) {
+            for (int k = 0; k < 3; k++) {
+                m_Prims[i].Lo[k] = RoundDown(boxes[i].Min()[k]);
+                m_Prims[i].Hi[k] = RoundUp(boxes[i].Max()[k]);
+            }
+        }
+        m_Indices.resize(n);
+        for (int i = 0; i < n; i++) {
+            m_Indices[i] = i;
+        }
+
+        m_BuildNodes.resize(2 * n - 1);
+        BuildTop(n);
+
+        Collapse(0);
+        m_BuildNodes = std::vector<BuildNode>();
+        m_Prims = std::vector<Prim>();
+        m_Charge.Set(Bytes());
+    }
+
+    bool Empty() const {
+        return m_Nodes.empty();
+    }
+
+    // primitive i of leaf range [start, start + count) is Indices()[i]
+    const std::vector<int> &Indices() const {
+        return m_Indices;
+    }
+
+    Box Bounds() const {
+        if (m_Nodes.empty()) {
+            return Box();
+        }
+        const Node &root = m_Nodes[0];
+        vec3 lo(INF);
+        vec3 hi(-INF);
+        for (int i = 0; i < 4; i++) {
+            if (root.Child[i] < 0) {
+                continue;
+            }
+            for (int k = 0; k < 3; k++) {
+                lo[k] = std::min(lo[k], real(root.Lo[k][i]));
+                hi[k] = std::max(hi[k], real(root.Hi[k][i]));
+            }
+        }
+        return Box(lo, hi);
+    }
+
+    size_t Bytes() const {
+        return m_Nodes.capacity() * sizeof(Node) +
+            m_Indices.capacity() * sizeof(int);
+    }
+
+    // Calls hit(position, tmax) for the leaf primitives whose boxes the ray
+    // reaches before tmax, nearest nodes first; position indexes
+    // Indices(). hit returns true after lowering tmax to a closer hit.
+    // Returns whether any call did.
+    template <typename F>
+    bool Intersect(const Ray &ray, const real tmin, real &tmax, F hit) const {
+        if (m_Nodes.empty()) {
+            return false;
+        }
+        RayData r;
+        for (int k = 0; k < 3; k++) {
+            const real d = ray.Direction()[k];
+            r.Org[k] = ray.Origin()[k];
+            r.Inv[k] = d != 0 ? float(1 / d) : std::copysign(1e30f, float(d));
+            r.Neg[k] = r.Inv[k] < 0;
+        }
+        r.TMin = tmin;
+
+        struct Entry {
+            int Node;
+            float T;
+        };
+        Entry stack[StackSize];
+        int size = 0;
+        stack[size++] = Entry{0, float(tmin)};
+        bool result = false;
+        while (size > 0) {
+            const Entry entry = stack[--size];
+            if (entry.T > tmax) {
+                continue;
+            }
+            const Node &node = m_Nodes[entry.Node];
+            float tNear[4];
+            const int mask = SlabTest(node, r, float(tmax) * 1.000001f, tNear);
+            int order[4];
+            int numInner = 0;
+            for (int i = 0; i < 4; i++) {
+                if (!(mask & (1 << i))) {
+                    continue;
+                }
+                if (node.Count[i] == 0) {
+                    order[numInner++] = i;
+                    continue;
+                }
+                const int end = node.Child[i] + node.Count[i];
+                for (int j = node.Child[i]; j < end; j++) {
+                    if (hit(j, tmax)) {
+                        result = true;
+                    }
+                }
+            }
+            // push the farthest child first so the nearest is popped next
+            for (int i = 1; i < numInner; i++) {
+                for (int j = i; j > 0 && tNear[order[j]] > tNear[order[j - 1]]; j--) {
+                    std::swap(order[j], order[j - 1]);
+                }
+            }
+            for (int i = 0; i < numInner; i++) {
+                stack[size++] = Entry{node.Child[order[i]], tNear[order[i]]};
+            }
+        }
+        return result;
+    }
+
+private:
+    // deeper subtrees switch to median splits, which bounds the depth and
+    // with it the traversal stack
+    static const int MaxSAHDepth = 48;
+    static const int StackSize = 256;
+    static const int MaxLeafSize = 8;
+    static const int MaxBins = 32;
+    // ranges at least this large are binned in parallel
+    static const int ParallelBinning = 1 << 16;
+
+    // child i is a leaf of Count[i] primitives from Child[i] when Count[i]
+    // is positive, an inner node when it is 0, and empty when Child[i] < 0
+    struct Node {
+        float Lo[3][4];
+        float Hi[3][4];
+        int32_t Child[4];
+        int32_t Count[4];
+    };
+
+    struct Prim {
+        float Lo[3];
+        float Hi[3];
+
+        float Centroid(const int k) const {
+            return (Lo[k] + Hi[k]) * 0.5f;
+        }
+    };
+
+    struct BuildNode {
+        float Lo[3];
+        float Hi[3];
+        int Start;
+        int Count;
+        int Left;
+        int Right;
+    };
+
+    struct Bin {
+        float Lo[3];
+        float Hi[3];
+        int Count;
+    };
+
+    struct RayData {
+        float Org[3];
+        float Inv[3];
+        int Neg[3];
+        float TMin;
+    };
+
+    static float RoundDown(const real x) {
+        const float f = x;
+        return f > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+    }
+
+    static float RoundUp(const real x) {
+        const float f = x;
+        return f < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+    }
+
+    static void EmptyBounds(float *lo, float *hi) {
+        for (int k = 0; k < 3; k++) {
+            lo[k] = std::numeric_limits<float>::infinity();
+            hi[k] = -std::numeric_limits<float>::infinity();
+        }
+    }
+
+    static void Grow(float *lo, float *hi, const float *plo, const float *phi) {
+        for (int k = 0; k < 3; k++) {
+            lo[k] = std::min(lo[k], plo[k]);
+            hi[k] = std::max(hi[k], phi[k]);
+        }
+    }
+
+    // half the surface area
+    static float Area(const float *lo, const float *hi) {
+        const float dx = hi[0] - lo[0];
+        const float dy = hi[1] - lo[1];
+        const float dz = hi[2] - lo[2];
+        return dx < 0 ? 0 : dx * dy + dy * dz + dz * dx;
+    }
+
+    // splits the root until there are a few subtrees per thread, then
+    // builds those in parallel
+    void BuildTop(const int n) {
+        struct Task {
+            int Node;
+            int Depth;
+        };
+        InitNode(0, 0, n);
+        std::vector<Task> tasks = {Task{0, 0}};
+        const int target = 4 * NumWorkers(0);
+        while (tasks.size() < target) {
+            int largest = 0;
+            for (int i = 1; i < tasks.size(); i++) {
+                if (m_BuildNodes[tasks[i].Node].Count >
+                    m_BuildNodes[tasks[largest].Node].Count)
+                {
+                    largest = i;
+                }
+            }
+            const Task task = tasks[largest];
+            if (m_BuildNodes[task.Node].Count < 4096) {
+                break;
+            }
+            tasks.erase(tasks.begin() + largest);
+            if (Split(task.Node, task.Depth, true)) {
+                const BuildNode &node = m_BuildNodes[task.Node];
+                tasks.push_back(Task{node.Left, task.Depth + 1});
+                tasks.push_back(Task{node.Right, task.Depth + 1});
+            }
+        }
+        ParallelFor(tasks.size(), 0, [&](const int i) {
+            Build(tasks[i].Node, tasks[i].Depth);
+        });
+    }
+
+    void Build(const int index, const int depth) {
+        if (Split(index, depth, false)) {
+            const BuildNode &node = m_BuildNodes[index];
+            const int left = node.Left;
+            const int right = node.Right;
+            Build(left, depth + 1);
+            Build(right, depth + 1);
+        }
+    }
+
+    void InitNode(const int index, const int start, const int count) {
+        BuildNode &node = m_BuildNodes[index];
+        node.Start = start;
+        node.Count = count;
+        node.Left = node.Right = -1;
+        EmptyBounds(node.Lo, node.Hi);
+        for (int i = start; i < start + count; i++) {
+            const Prim &p = m_Prims[m_Indices[i]];
+            Grow(node.Lo, node.Hi, p.Lo, p.Hi);
+        }
+    }
+
+    // Splits node index in two or leaves it a leaf, returning whether it
+    // was split. Child bounds are computed here.
+    bool Split(const int index, const int depth, const bool parallel) {
+        BuildNode &node = m_BuildNodes[index];
+        const int start = node.Start;
+        const int count = node.Count;
+        if (count <= 1) {
+            return false;
+        }
+
+        float clo[3];
+        float chi[3];
+        EmptyBounds(clo, chi);
+        for (int i = start; i < start + count; i++) {
+            const Prim &p = m_Prims[m_Indices[i]];
+            for (int k = 0; k < 3; k++) {
+                clo[k] = std::min(clo[k], p.Centroid(k));
+                chi[k] = std::max(chi[k], p.Centroid(k));
+            }
+        }
+
+        int axis = 0;
+        for (int k = 1; k < 3; k++) {
+            if (chi[k] - clo[k] > chi[axis] - clo[axis]) {
+                axis = k;
+            }
+        }
+        int mid = -1;
+        if (chi[axis] > clo[axis] && depth < MaxSAHDepth) {
+            int bestAxis = -1;
+            int bestBin = 0;
+            float bestCost = std::numeric_limits<float>::infinity();
+            for (int k = 0; k < 3; k++) {
+                if (chi[k] <= clo[k]) {
+                    continue;
+                }
+                Bin bins[MaxBins];
+                BinCentroids(start, count, k, clo[k], chi[k], parallel, bins);
+                int splitBin;
+                const float cost = BestSplit(bins, splitBin);
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = k;
+                    bestBin = splitBin;
+                }
+            }
+            // cost of a leaf, with traversing a node costing one test
+            const float leafCost = count * Area(node.Lo, node.Hi);
+            if (bestCost + Area(node.Lo, node.Hi) >= leafCost &&
+                count <= MaxLeafSize)
+            {
+                return false;
+            }
+            const float lo = clo[bestAxis];
+            const float scale = m_NumBins / (chi[bestAxis] - lo);
+            const auto begin = m_Indices.begin() + start;
+            mid = std::partition(begin, begin + count, [&](const int i) {
+                return BinIndex(m_Prims[i].Centroid(bestAxis), lo, scale) <= bestBin;
+            }) - m_Indices.begin();
+            if (mid == start || mid == start + count) {
+                mid = -1;
+            }
+        }
+        if (mid < 0) {
+            if (count <= MaxLeafSize) {
+                return false;
+            }
+            // median split, also for coincident centroids
+            mid = start + count / 2;
+            const auto begin = m_Indices.begin() + start;
+            std::nth_element(begin, begin + count / 2, begin + count,
+                [&](const int a, const int b) {
+                    return m_Prims[a].Centroid(axis) < m_Prims[b].Centroid(axis);
+                });
+        }
+
+        // a subtree over c primitives has at most 2c - 1 nodes, so each
+        // subtree owns a fixed range of node indices
+        node.Left = index + 1;
+        node.Right = index + 2 * (mid - start);
+        InitNode(node.Left, start, mid - start);
+        InitNode(node.Right, mid, start + count - mid);
+        return true;
+    }
+
+    int BinIndex(const float c, const float lo, const float scale) const {
+        return std::min(m_NumBins - 1, std::max(0, int((c - lo) * scale)));
+    }
+
+    void BinCentroids(
+        const int start, const int count, const int axis, const float lo,
+        const float hi, const bool parallel, Bin *bins) const
+    {
+        const float scale = m_NumBins / (hi - lo);
+        const auto binRange = [&](const int begin, const int end, Bin *result) {
+            for (int b = 0; b < m_NumBins; b++) {
+                EmptyBounds(result[b].Lo, result[b].Hi);
+                result[b].Count = 0;
+            }
+            for (int i = begin; i < end; i++) {
+                const Prim &p = m_Prims[m_Indices[i]];
+                Bin &bin = result[BinIndex(p.Centroid(axis), lo, scale)];
+                Grow(bin.Lo, bin.Hi, p.Lo, p.Hi);
+                bin.Count++;
+            }
+        };
+        if (!parallel || count < ParallelBinning) {
+            binRange(start, start + count, bins);
+            return;
+        }
+        const int numChunks = (count + ParallelBinning - 1) / ParallelBinning;
+        std::vector<Bin> chunks(numChunks * MaxBins);
+        ParallelFor(numChunks, 0, [&](const int c) {
+            const int begin = start + c * ParallelBinning;
+            binRange(begin, std::min(begin + ParallelBinning, start + count),
+                chunks.data() + c * MaxBins);
+        });
+        for (int b = 0; b < m_NumBins; b++) {
+            EmptyBounds(bins[b].Lo, bins[b].Hi);
+            bins[b].Count = 0;
+            for (int c = 0; c < numChunks; c++) {
+                const Bin &chunk = chunks[c * MaxBins + b];
+                Grow(bins[b].Lo, bins[b].Hi, chunk.Lo, chunk.Hi);
+                bins[b].Count += chunk.Count;
+            }
+        }
+    }
+
+    // lowest SAH cost of splitting after one of the bins
+    float BestSplit(const Bin *bins, int &splitBin) const {
+        float rightCost[MaxBins];
+        float lo[3];
+        float hi[3];
+        EmptyBounds(lo, hi);
+        int count = 0;
+        for (int b = m_NumBins - 1; b > 0; b--) {
+            Grow(lo, hi, bins[b].Lo, bins[b].Hi);
+            count += bins[b].Count;
+            rightCost[b] = count * Area(lo, hi);
+        }
+        float best = std::numeric_limits<float>::infinity();
+        splitBin = 0;
+        EmptyBounds(lo, hi);
+        count = 0;
+        for (int b = 0; b < m_NumBins - 1; b++) {
+            Grow(lo, hi, bins[b].Lo, bins[b].Hi);
+            count += bins[b].Count;
+            const float cost = count * Area(lo, hi) + rightCost[b + 1];
+            if (cost < best) {
+                best = cost;
+                splitBin = b;
+            }
+        }
+        return best;
+    }
+
+    // turns binary node index, and its descendants, into four wide nodes;
+    // returns the index of its node
+    int Collapse(const int index) {
+        std::vector<int> children;
+        const BuildNode &root = m_BuildNodes[index];
+        if (root.Left < 0) {
+            children.push_back(index);
+        } else {
+            children.push_back(root.Left);
+            children.push_back(root.Right);
+        }
+        while (children.size() < 4) {
+            int best = -1;
+            float bestArea = -1;
+            for (int i = 0; i < children.size(); i++) {
+                const BuildNode &child = m_BuildNodes[children[i]];
+                const float area = Area(child.Lo, child.Hi);
+                if (child.Left >= 0 && area > bestArea) {
+                    best = i;
+                    bestArea = area;
+                }
+            }
+            if (best < 0) {
+                break;
+            }
+            const BuildNode &child = m_BuildNodes[children[best]];
+            children[best] = child.Left;
+            children.push_back(child.Right);
+        }
+
+        const int result = m_Nodes.size();
+        m_Nodes.emplace_back();
+        for (int i = 0; i < 4; i++) {
+            Node &node = m_Nodes[result];
+            if (i >= children.size()) {
+                for (int k = 0; k < 3; k++) {
+                    node.Lo[k][i] = std::numeric_limits<float>::infinity();
+                    node.Hi[k][i] = -std::numeric_limits<float>::infinity();
+                }
+                node.Child[i] = -1;
+                node.Count[i] = 0;
+                continue;
+            }
+            const BuildNode &child = m_BuildNodes[children[i]];
+            for (int k = 0; k < 3; k++) {
+                node.Lo[k][i] = child.Lo[k];
+                node.Hi[k][i] = child.Hi[k];
+            }
+            if (child.Left < 0) {
+                node.Child[i] = child.Start;
+                node.Count[i] = child.Count;
+            } else {
+                // m_Nodes may grow, so node is looked up again
+                const int inner = Collapse(children[i]);
+                m_Nodes[result].Child[i] = inner;
+                m_Nodes[result].Count[i] = 0;
+            }
+        }
+        return result;
+    }
+
+    // bit i is set if the ray enters child i's box between tmin and tmax,
+    // at tNear[i]
+    static int SlabTest(
+        const Node &node, const RayData &r, const float tmax, float *tNear)
+    {
+#if defined(__SSE__)
+        __m128 t0 = _mm_set1_ps(r.TMin);
+        __m128 t1 = _mm_set1_ps(tmax);
+        for (int k = 0; k < 3; k++) {
+            const __m128 lo = _mm_loadu_ps(node.Lo[k]);
+            const __m128 hi = _mm_loadu_ps(node.Hi[k]);
+            const __m128 org = _mm_set1_ps(r.Org[k]);
+            const __m128 inv = _mm_set1_ps(r.Inv[k]);
+            const __m128 nearT = _mm_mul_ps(_mm_sub_ps(r.Neg[k] ? hi : lo, org), inv);
+            const __m128 farT = _mm_mul_ps(_mm_sub_ps(r.Neg[k] ? lo : hi, org), inv);
+            t0 = _mm_max_ps(t0, nearT);
+            t1 = _mm_min_ps(t1, farT);
+        }
+        _mm_storeu_ps(tNear, t0);
+        return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+        int mask = 0;
+        for (int i = 0; i < 4; i++) {
+            float t0 = r.TMin;
+            float t1 = tmax;
+            for (int k = 0; k < 3; k++) {
+                const float lo = r.Neg[k] ? node.Hi[k][i] : node.Lo[k][i];
+                const float hi = r.Neg[k] ? node.Lo[k][i] : node.Hi[k][i];
+                t0 = std::max(t0, (lo - r.Org[k]) * r.Inv[k]);
+                t1 = std::min(t1, (hi - r.Org[k]) * r.Inv[k]);
+            }
+            tNear[i] = t0;
+            mask |= (t0 <= t1) << i;
+        }
+        return mask;
+#endif
+    }
+
+    std::vector<Node> m_Nodes;
+    std::vector<int> m_Indices;
+    MemoryCharge m_Charge;
+
+    // only while building
+    int m_NumBins = 16;
+    std::vector<Prim> m_Prims;
+    std::vector<BuildNode> m_BuildNodes;
+};
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdexcept>
+#include <vector>
+
+#include "box.hpp"
+#include "bvh.hpp"
+#include "config.hpp"
+#include "hit.hpp"
+#include "ray.hpp"
+
+// Objects grouped under a BVH4 over their bounding boxes, so that scenes of
+// many analytic primitives (spheres, cubes, instances) are not tested one
+// by one. Objects without bounds, like planes, are tested after the tree.
+// The tree is built once, so grouped objects must not move afterwards.
+// Participating media belong in the scene's list instead.
+class BVHList : public Hittable {
+public:
+    BVHList(
+        const std::vector<P_Hittable> &items,
+        const BVHOptions &options = BVHOptions())
+    {
+        std::vector<P_Hittable> bounded;
+        std::vector<Box> boxes;
+        for (const auto &item : items) {
+            if (item->Medium()) {
+                throw std::runtime_error("media cannot be grouped");
+            }
+            Box box;
+            if (item->BoundingBox(box)) {
+                bounded.push_back(item);
+                boxes.push_back(box);
+                m_Bounds = boxes.size() > 1 ? m_Bounds.Extend(box) : box;
+            } else {
+                m_Unbounded.push_back(item);
+            }
+            if (!item->Emits()) {
+                continue;
+            }
+            const auto emitters = item->Emitters();
+            if (emitters.empty()) {
+                m_Lights.push_back(item);
+            } else {
+                m_Lights.insert(m_Lights.end(), emitters.begin(), emitters.end());
+            }
+        }
+
+        m_Tree = BVH4(boxes, options);
+        // stored in leaf order, as the tree visits them
+        const auto &indices = m_Tree.Indices();
+        m_Items.resize(indices.size());
+        for (int i = 0; i < indices.size(); i++) {
+            m_Items[i] = bounded[indices[i]];
+        }
+    }
+
+    int Size() const {
+        return m_Items.size() + m_Unbounded.size();
+    }
+
+    virtual bool Emits() const {
+        return !m_Lights.empty();
+    }
+
+    virtual std::vector<P_Hittable> Emitters() const {
+        return m_Lights;
+    }
+
+    virtual bool BoundingBox(Box &box) const {
+        if (m_Items.empty() || !m_Unbounded.empty()) {
+            return false;
+        }
+        box = m_Bounds;
+        return true;
+    }
+
+    virtual bool Hit(
+        const Ray &ray, const real tmin, const real tmax, HitInfo &hit) const
+    {
+        real closest = tmax;
+        bool result = m_Tree.Intersect(ray, tmin, closest,
+            [&](const int i, real &t) {
+                HitInfo temp;
+                if (!m_Items[i]->Hit(ray, tmin, t, temp)) {
+                    return false;
+                }
+                t = temp.T;
+                hit = temp;
+                return true;
+            });
+        for (const auto &item : m_Unbounded) {
+            HitInfo temp;
+            if (item->Hit(ray, tmin, closest, temp)) {
+                result = true;
+                closest = temp.T;
+                hit = temp;
+            }
+        }
+        return result;
+    }
+
+private:
+    BVH4 m_Tree;
+    Box m_Bounds;
+    std::vector<P_Hittable> m_Items;
+    std::vector<P_Hittable> m_Unbounded;
+    std::vector<P_Hittable> m_Lights;
+};
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <glm/glm.hpp>
+#include <memory>
+#include <vector>
+
+#include "box.hpp"
+#include "bvh.hpp"
+#include "config.hpp"
+#include "hit.hpp"
+#include "material.hpp"
+#include "memory.hpp"
+#include "mesh.hpp"
+#include "meshlight.hpp"
+#include "parallel.hpp"
+#include "ray.hpp"
+
+// Triangle mesh traced with BVH4, the counterpart of EmbreeMesh for builds
+// without Embree. Triangles are copied in leaf order as a vertex and two
+// edges, so the triangles of a leaf are read from consecutive memory;
+// compact skips the copy and reads the mesh's vertices instead.
+class BVHMesh : public Hittable {
+public:
+    BVHMesh(
+        const P_Mesh &mesh,
+        const P_Material &material,
+        const BVHOptions &options = BVHOptions()) :
+        m_Mesh(mesh),
+        m_Material(material),
+        m_Light(mesh, material),
+        m_Geometry(std::make_shared<Geometry>())
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const auto &positions = mesh->Positions();
+        const auto &triangles = mesh->Triangles();
+
+        std::vector<Box> boxes(triangles.size());
+        ParallelFor(triangles.size(), 0, [&](const int i) {
+            const auto &t = triangles[i];
+            const vec3 &a = positions[t.x];
+            const vec3 &b = positions[t.y];
+            const vec3 &c = positions[t.z];
+            boxes[i] = Box(
+                glm::min(a, glm::min(b, c)), glm::max(a, glm::max(b, c)));
+        }, 4096);
+        m_Geometry->Tree = BVH4(boxes, options);
+
+        if (!options.Compact) {
+            const auto &indices = m_Geometry->Tree.Indices();
+            auto &packed = m_Geometry->Triangles;
+            packed.resize(indices.size());
+            ParallelFor(indices.size(), 0, [&](const int i) {
+                const auto &t = triangles[indices[i]];
+                const vec3 &v0 = positions[t.x];
+                packed[i] = Triangle{
+                    v0, positions[t.y] - v0, positions[t.z] - v0};
+            }, 4096);
+            m_Geometry->Charge.Set(packed.capacity() * sizeof(Triangle));
+        }
+        m_Geometry->BuildSeconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+
+    // shares the tree of geometry with a different material, so one BVH
+    // can be reused by many renders
+    BVHMesh(const BVHMesh &geometry, const P_Material &material) :
+        m_Mesh(geometry.m_Mesh),
+        m_Material(material),
+        m_Light(geometry.m_Mesh, material),
+        m_Geometry(geometry.m_Geometry)
+    {}
+
+    const P_Mesh &GetMesh() const {
+        return m_Mesh;
+    }
+
+    double BuildSeconds() const {
+        return m_Geometry->BuildSeconds;
+    }
+
+    virtual bool Emits() const {
+        return !m_Light.Empty();
+    }
+
+    virtual LightInfo EmitterInfo() const {
+        return m_Light.Info();
+    }
+
+    virtual bool BoundingBox(Box &box) const {
+        box = m_Mesh->BoundingBox();
+        return true;
+    }
+
+    virtual bool Hit(
+        const Ray &ray, const real tmin, const real tmax, HitInfo &hit) const
+    {
+        real t = tmax;
+        const int index = Intersect(ray, tmin, t);
+        if (index < 0) {
+            return false;
+        }
+        hit.T = t;
+        hit.Position = ray.At(t);
+        hit.Normal = m_Mesh->TriangleNormalAt(index, hit.Position);
+        hit.Material = m_Material;
+        return true;
+    }
+
+    virtual Ray RandomRay(const vec3 &o) const {
+        const vec3 p = m_Light.RandomPoint(*m_Mesh);
+        return Ray(o, glm::normalize(p - o));
+    }
+
+    // solid angle pdf of sampling the first surface point along ray
+    virtual real Pdf(const Ray &ray) const {
+        real t = INF;
+        const int index = Intersect(ray, EPS, t);
+        if (index < 0) {
+            return 0;
+        }
+        const auto &positions = m_Mesh->Positions();
+        const auto &tri = m_Mesh->Triangles()[index];
+        const vec3 ng = glm::cross(
+            positions[tri.y] - positions[tri.x],
+            positions[tri.z] - positions[tri.x]);
+        return m_Light.Pdf(ng, ray.Direction(), t);
+    }
+
+private:
+    struct Triangle {
+        vec3 V0;
+        vec3 E1;
+        vec3 E2;
+    };
+
+    struct Geometry {
+        Geometry() : Charge(MemoryBVH), BuildSeconds(0) {}
+
+        BVH4 Tree;
+        // in Tree.Indices() order; empty when compact
+        std::vector<Triangle> Triangles;
+        MemoryCharge Charge;
+        double BuildSeconds;
+    };
+
+    // index of the nearest triangle hit between tmin and tmax, which is
+    // lowered to its distance, or -1
+    int Intersect(const Ray &ray, const real tmin, real &tmax) const {
+        const auto &indices = m_Geometry->Tree.Indices();
+        const auto &packed = m_Geometry->Triangles;
+        const auto &positions = m_Mesh->Positions();
+        const auto &triangles = m_Mesh->Triangles();
+        const vec3 &o = ray.Origin();
+        const vec3 &d = ray.Direction();
+        int result = -1;
+        m_Geometry->Tree.Intersect(ray, tmin, tmax, [&](const int i, real &t) {
+            vec3 v0, e1, e2;
+            if (packed.empty()) {
+                const auto &tri = triangles[indices[i]];
+                v0 = positions[tri.x];
+                e1 = positions[tri.y] - v0;
+                e2 = positions[tri.z] - v0;
+            } else {
+                v0 = packed[i].V0;
+                e1 = packed[i].E1;
+                e2 = packed[i].E2;
+            }
+            // Moller-Trumbore
+            const vec3 p = glm::cross(d, e2);
+            const real det = glm::dot(e1, p);
+            if (det == 0) {
+                return false;
+            }
+            const real inv = 1 / det;
+            const vec3 s = o - v0;
+            const real u = glm::dot(s, p) * inv;
+            if (u < 0 || u > 1) {
+                return false;
+            }
+            const vec3 q = glm::cross(s, e1);
+            const real v = glm::dot(d, q) * inv;
+            if (v < 0 || u + v > 1) {
+                return false;
+            }
+            const real hitT = glm::dot(e2, q) * inv;
+            if (hitT <= tmin || hitT >= t) {
+                return false;
+            }
+            t = hitT;
+            result = indices[i];
+            return true;
+        });
+        return result;
+    }
+
+    P_Mesh m_Mesh;
+    P_Material m_Material;
+    MeshLight m_Light;
+    std::shared_ptr<Geometry> m_Geometry;
+};
@@ -31,6 +31,11 @@ public:
         m_Aperture = aperture;
     }
 
+    // all rays share one origin, so MakeRay is deterministic in u, v
+    bool Pinhole() const {
+        return m_Aperture <= 0;
+    }
+
     Ray MakeRay(const real u, const real v) const {
         const vec3 rd = RandomInUnitDisk() * (m_Aperture / 2);
         const vec3 offset = m_U * rd.x + m_V * rd.y;
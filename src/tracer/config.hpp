@@ -3,12 +3,14 @@
 #include <glm/glm.hpp>
 
 // using real = float;
+// using vec2 = glm::vec2;
 // using vec3 = glm::vec3;
 // using vec4 = glm::vec4;
 // using mat3 = glm::mat3;
 // using mat4 = glm::mat4;
 
 using real = double;
+using vec2 = glm::highp_dvec2;
 using vec3 = glm::highp_dvec3;
 using vec4 = glm::highp_dvec4;
 using mat3 = glm::highp_dmat3;
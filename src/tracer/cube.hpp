@@ -40,6 +40,11 @@ public:
         return true;
     }
 
+    virtual bool BoundingBox(Box &box) const {
+        box = Box(m_Min, m_Max);
+        return true;
+    }
+
     vec3 NormalAt(const vec3 &p) const {
         if (p.x < m_Min.x + EPS) {
             return vec3(-1, 0, 0);
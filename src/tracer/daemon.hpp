@@ -0,0 +1,228 @@
+#pragma once
+
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+#include "assets.hpp"
+#include "backend.hpp"
+#include "camera.hpp"
+#include "config.hpp"
+#include "image.hpp"
+#include "memory.hpp"
+#include "render.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+#include "tonemap.hpp"
+#include "trace.hpp"
+
+// Long running render server on a Unix domain socket. The geometry device
+// and an AssetCache of committed meshes persist across jobs, so a job on a
+// warm asset only builds its small scene and starts rendering.
+//
+// Clients send one job per line: a JSON scene (see scene.hpp) plus
+// optional "band" (rows per streamed band, default 16), "format" ("rgb8"
+// tone mapped with "exposure" / "gamma", or linear "float32") and "clamp".
+// For each job the daemon replies with
+//
+//   {"width": W, "height": H, "format": F}\n
+//   {"y": y0, "rows": n, "bytes": N}\n followed by N bytes of interleaved
+//       RGB rows, once per band from top to bottom
+//   {"done": true, "seconds": ..., "firstPixelSeconds": ..., ...}\n
+//
+// or {"error": "..."}\n. Jobs are handled one at a time, each using every
+// render thread.
+class RenderDaemon {
+public:
+    RenderDaemon(
+        const std::string &path, const int cacheSize, const int numThreads) :
+        m_Path(path),
+        m_Device(NewGeometryDevice()),
+        m_Assets(m_Device, cacheSize),
+        m_NumThreads(numThreads)
+    {}
+
+    void Serve() {
+        // a client hanging up mid job must not kill the daemon
+        signal(SIGPIPE, SIG_IGN);
+
+        const int server = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (server < 0) {
+            throw std::runtime_error("cannot create socket");
+        }
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, m_Path.c_str(), sizeof(addr.sun_path) - 1);
+        unlink(m_Path.c_str());
+        if (bind(server, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(server, 16) < 0)
+        {
+            close(server);
+            throw std::runtime_error("cannot listen on " + m_Path);
+        }
+        std::cout << "listening on " << m_Path << std::endl;
+
+        while (true) {
+            const int client = accept(server, nullptr, nullptr);
+            if (client < 0) {
+                continue;
+            }
+            HandleClient(client);
+            close(client);
+        }
+    }
+
+private:
+    void HandleClient(const int fd) {
+        std::string buffer;
+        char chunk[4096];
+        while (true) {
+            size_t newline;
+            while ((newline = buffer.find('\n')) == std::string::npos) {
+                const ssize_t n = read(fd, chunk, sizeof(chunk));
+                if (n <= 0) {
+                    return;
+                }
+                buffer.append(chunk, n);
+            }
+            const std::string line = buffer.substr(0, newline);
+            buffer.erase(0, newline + 1);
+            if (line.empty()) {
+                continue;
+            }
+            try {
+                if (!RunJob(json::parse(line), fd)) {
+                    return;
+                }
+            } catch (const std::exception &e) {
+                std::cout << "job failed: " << e.what() << std::endl;
+                if (!Send(fd, json{{"error", e.what()}})) {
+                    return;
+                }
+            }
+        }
+    }
+
+    // returns false if the client went away
+    bool RunJob(const json &job, const int fd) {
+        const auto start = std::chrono::steady_clock::now();
+        const auto elapsed = [&start]() {
+            return std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+        };
+
+        const int width = job.value("width", 512);
+        const int height = job.value("height", 512);
+        const int samples = job.value("samples", 16);
+        const int bandHeight = std::max(1, job.value("band", 16));
+        const std::string format = job.value("format", "rgb8");
+        if (width <= 0 || height <= 0 || samples <= 0) {
+            throw std::runtime_error("invalid size or sample count");
+        }
+        if (format != "rgb8" && format != "float32") {
+            throw std::runtime_error("unknown format: " + format);
+        }
+        ToneMapOptions options;
+        options.Exposure = job.value("exposure", options.Exposure);
+        options.Gamma = job.value("gamma", options.Gamma);
+
+        const P_HittableList world = ParseWorld(
+            job.at("objects"), m_Assets,
+            ParseBVHOptions(job.value("bvh", json::object())));
+        const Camera camera = ParseCamera(job.at("camera"), real(width) / height);
+        Sampler sampler(world);
+        if (job.count("clamp")) {
+            sampler.SetClamp(job["clamp"].get<real>());
+        }
+        const double setupSeconds = elapsed();
+
+        if (!Send(fd, json{
+            {"width", width}, {"height", height}, {"format", format}}))
+        {
+            return false;
+        }
+
+        ImageLayout layout;
+        layout.Variance = false;
+        double firstPixelSeconds = 0;
+        std::vector<float> floats;
+        for (int y0 = 0; y0 < height; y0 += bandHeight) {
+            Image band(width, std::min(bandHeight, height - y0), layout);
+            RenderBand(
+                band, y0, height, sampler, camera, samples, m_NumThreads);
+
+            std::vector<uint8_t> bytes;
+            if (format == "rgb8") {
+                bytes = band.ToneMap(options);
+            } else {
+                floats.resize(size_t(width) * band.Height() * 3);
+                for (int y = 0; y < band.Height(); y++) {
+                    for (int x = 0; x < width; x++) {
+                        const vec3 c = band.Color(x, y);
+                        float *dst = &floats[(size_t(y) * width + x) * 3];
+                        dst[0] = c.r;
+                        dst[1] = c.g;
+                        dst[2] = c.b;
+                    }
+                }
+                const uint8_t *src = (const uint8_t *)floats.data();
+                bytes.assign(src, src + floats.size() * sizeof(float));
+            }
+
+            const json header = {
+                {"y", y0}, {"rows", band.Height()}, {"bytes", bytes.size()}};
+            if (!Send(fd, header) || !Write(fd, bytes.data(), bytes.size())) {
+                return false;
+            }
+            if (y0 == 0) {
+                firstPixelSeconds = elapsed();
+            }
+        }
+
+        Tracer::Shared().Flush();
+        const double seconds = elapsed();
+        std::cout << "job done in " << seconds << "s (setup " << setupSeconds
+            << "s, first band " << firstPixelSeconds << "s)" << std::endl;
+        return Send(fd, json{
+            {"done", true},
+            {"seconds", seconds},
+            {"setupSeconds", setupSeconds},
+            {"firstPixelSeconds", firstPixelSeconds},
+            {"cachedAssets", m_Assets.Size()},
+            {"cacheHits", m_Assets.Hits()},
+            {"cacheMisses", m_Assets.Misses()},
+            {"memory", MemoryTracker::Shared().ToJSON()}});
+    }
+
+    static bool Send(const int fd, const json &message) {
+        const std::string line = message.dump() + "\n";
+        return Write(fd, line.data(), line.size());
+    }
+
+    static bool Write(const int fd, const void *data, size_t size) {
+        const char *p = (const char *)data;
+        while (size > 0) {
+            const ssize_t n = write(fd, p, size);
+            if (n <= 0) {
+                return false;
+            }
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    std::string m_Path;
+    GeometryDevice m_Device;
+    AssetCache m_Assets;
+    int m_NumThreads;
+};
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "config.hpp"
+#include "image.hpp"
+#include "memory.hpp"
+#include "parallel.hpp"
+#include "trace.hpp"
+#include "util.hpp"
+
+struct DenoiseOptions {
+    bool Enabled = false;
+    // filter passes; pass i uses taps 2^i pixels apart
+    int Iterations = 5;
+    // luminance edge stop, in standard deviations of the pixel estimate
+    real ColorSigma = 4;
+    // exponent on the normal similarity
+    real NormalPower = 128;
+    // albedo edge stop, as a distance in albedo
+    real AlbedoSigma = 0.1;
+    // optional high sample count PFM to report RMSE against
+    std::string Reference;
+};
+
+namespace {
+
+const real AtrousKernel[3] = {3.0 / 8, 1.0 / 4, 1.0 / 16};
+
+}
+
+// Bytes Denoise allocates for a width x height image: its single precision
+// buffers and the single sample result.
+int64_t DenoiseBytes(const int width, const int height) {
+    const int64_t n = int64_t(width) * height;
+    return n * (4 * sizeof(glm::vec3) + 2 * sizeof(float) +
+        sizeof(uint32_t) + 3 * sizeof(float));
+}
+
+// Checks before rendering that image can be denoised, and charges what
+// Denoise will allocate to charge so that the render cannot use it up.
+// The filter needs the variance that Image drops when it does not fit the
+// memory budget, so that is an error rather than an unfiltered result.
+// Release the charge just before calling Denoise, which charges its own.
+void ReserveDenoise(const Image &image, MemoryCharge &charge) {
+    if (!image.Layout().Variance) {
+        throw std::runtime_error(
+            "denoising needs the image's variance, which does not fit "
+            "the memory budget");
+    }
+    const int64_t bytes = DenoiseBytes(image.Width(), image.Height());
+    MemoryTracker::Shared().Require(bytes, "denoise buffers");
+    charge.Set(bytes);
+}
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) with the
+// variance-guided luminance weight from SVGF (Schied et al. 2017).
+//
+// Radiance is divided by the "albedo" plane (when present) so that texture
+// detail is not blurred, filtered, and multiplied back. Edge stopping uses
+// the "normal" and "albedo" planes and the per-pixel variance of the mean,
+// so the image must have been rendered with ImageLayout::Variance (see
+// ReserveDenoise). Returns a new single sample image.
+Image Denoise(
+    const Image &image, const DenoiseOptions &options, const int numThreads)
+{
+    TraceSpan span("Denoise");
+    const int w = image.Width();
+    const int h = image.Height();
+    const int albedoPlane = image.FindPlane("albedo");
+    const int normalPlane = image.FindPlane("normal");
+    // channels that are black in albedo are filtered as is
+    const auto divisor = [](const glm::vec3 &a) {
+        return vec3(a.x > 1e-3f ? a.x : 1, a.y > 1e-3f ? a.y : 1,
+            a.z > 1e-3f ? a.z : 1);
+    };
+
+    const size_t n = size_t(w) * h;
+    MemoryCharge charge(MemoryImages);
+    charge.Set(n * (4 * sizeof(glm::vec3) + 2 * sizeof(float)));
+    std::vector<glm::vec3> albedo(n, glm::vec3(1));
+    std::vector<glm::vec3> normal(n, glm::vec3(0));
+    std::vector<glm::vec3> color(n);
+    std::vector<float> variance(n);
+    ParallelFor(h, numThreads, [&](const int y) {
+        for (int x = 0; x < w; x++) {
+            const int i = y * w + x;
+            if (albedoPlane >= 0) {
+                const Plane &plane = image.GetPlane(albedoPlane);
+                for (int c = 0; c < 3; c++) {
+                    albedo[i][c] = plane.Get(i, c);
+                }
+            }
+            if (normalPlane >= 0) {
+                const Plane &plane = image.GetPlane(normalPlane);
+                for (int c = 0; c < 3; c++) {
+                    normal[i][c] = plane.Get(i, c);
+                }
+            }
+            const int samples = std::max(1, image.NumSamples(x, y));
+            const vec3 a = divisor(albedo[i]);
+            color[i] = glm::vec3(image.Color(x, y) / a);
+            variance[i] = Luminance(image.Variance(x, y) / (a * a)) / samples;
+        }
+    }, 8);
+
+    std::vector<glm::vec3> nextColor(n);
+    std::vector<float> nextVariance(n);
+    const real albedoScale = 1 / (options.AlbedoSigma * options.AlbedoSigma);
+
+    for (int iteration = 0; iteration < options.Iterations; iteration++) {
+        const int step = 1 << iteration;
+        ParallelFor(h, numThreads, [&](const int y) {
+            for (int x = 0; x < w; x++) {
+                const int i = y * w + x;
+
+                // variance prefiltered with a 3x3 gaussian for a stable
+                // edge stop
+                real blurred = 0;
+                real blurredWeight = 0;
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        const int qx = x + dx;
+                        const int qy = y + dy;
+                        if (qx < 0 || qy < 0 || qx >= w || qy >= h) {
+                            continue;
+                        }
+                        const real k = (dx ? 0.25 : 0.5) * (dy ? 0.25 : 0.5);
+                        blurred += k * variance[qy * w + qx];
+                        blurredWeight += k;
+                    }
+                }
+                const real sigma = options.ColorSigma *
+                    std::sqrt(std::max(real(0), blurred / blurredWeight)) + 1e-6;
+
+                const real lp = Luminance(vec3(color[i]));
+                const glm::vec3 &np = normal[i];
+                const bool hasNormal = glm::dot(np, np) > 0;
+
+                vec3 sumColor(0);
+                real sumVariance = 0;
+                real sumWeight = 0;
+                for (int dy = -2; dy <= 2; dy++) {
+                    const int qy = y + dy * step;
+                    if (qy < 0 || qy >= h) {
+                        continue;
+                    }
+                    for (int dx = -2; dx <= 2; dx++) {
+                        const int qx = x + dx * step;
+                        if (qx < 0 || qx >= w) {
+                            continue;
+                        }
+                        const int q = qy * w + qx;
+                        real weight = AtrousKernel[std::abs(dx)] *
+                            AtrousKernel[std::abs(dy)];
+                        if (q != i) {
+                            const real lq = Luminance(vec3(color[q]));
+                            weight *= std::exp(-std::abs(lp - lq) / sigma);
+                            const glm::vec3 &nq = normal[q];
+                            if (hasNormal) {
+                                weight *= std::pow(
+                                    std::max(real(0), real(glm::dot(np, nq))),
+                                    options.NormalPower);
+                            } else if (glm::dot(nq, nq) > 0) {
+                                weight = 0;
+                            }
+                            const glm::vec3 da = albedo[i] - albedo[q];
+                            weight *= std::exp(-glm::dot(da, da) * albedoScale);
+                        }
+                        sumColor += weight * vec3(color[q]);
+                        sumVariance += weight * weight * variance[q];
+                        sumWeight += weight;
+                    }
+                }
+                nextColor[i] = glm::vec3(sumColor / sumWeight);
+                nextVariance[i] = sumVariance / (sumWeight * sumWeight);
+            }
+        }, 8);
+        std::swap(color, nextColor);
+        std::swap(variance, nextVariance);
+    }
+
+    ImageLayout layout;
+    layout.Variance = false;
+    Image result(w, h, layout);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            const int i = y * w + x;
+            result.AddSample(x, y, vec3(color[i]) * divisor(albedo[i]));
+        }
+    }
+    return result;
+}
@@ -255,6 +255,10 @@ public:
         return sum / 3;
     }
 
+    virtual vec3 Albedo(const vec3 &p) const {
+        return m_Params.baseColor;
+    }
+
 private:
     DisneyParameters m_Params;
 };
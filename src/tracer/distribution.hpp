@@ -0,0 +1,96 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "config.hpp"
+
+// Walker / Vose alias table: O(n) to build, O(1) to sample a discrete
+// distribution with arbitrary (non-negative) weights.
+class AliasTable {
+public:
+    AliasTable() :
+        m_Total(0) {}
+
+    AliasTable(const std::vector<real> &weights) :
+        m_Total(0)
+    {
+        const int n = weights.size();
+        for (const real w : weights) {
+            m_Total += w;
+        }
+        if (n == 0 || m_Total <= 0) {
+            return;
+        }
+
+        m_Pmf.resize(n);
+        m_Probability.resize(n);
+        m_Alias.resize(n);
+
+        std::vector<real> scaled(n);
+        std::vector<int> small;
+        std::vector<int> large;
+        for (int i = 0; i < n; i++) {
+            m_Pmf[i] = weights[i] / m_Total;
+            scaled[i] = m_Pmf[i] * n;
+            if (scaled[i] < 1) {
+                small.push_back(i);
+            } else {
+                large.push_back(i);
+            }
+        }
+
+        while (!small.empty() && !large.empty()) {
+            const int s = small.back();
+            small.pop_back();
+            const int l = large.back();
+            m_Probability[s] = scaled[s];
+            m_Alias[s] = l;
+            scaled[l] = (scaled[l] + scaled[s]) - 1;
+            if (scaled[l] < 1) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+
+        // leftovers are within rounding error of 1
+        for (const int i : large) {
+            m_Probability[i] = 1;
+            m_Alias[i] = i;
+        }
+        for (const int i : small) {
+            m_Probability[i] = 1;
+            m_Alias[i] = i;
+        }
+    }
+
+    int Size() const {
+        return m_Pmf.size();
+    }
+
+    bool Empty() const {
+        return m_Pmf.empty();
+    }
+
+    real Total() const {
+        return m_Total;
+    }
+
+    real Pmf(const int index) const {
+        return m_Pmf[index];
+    }
+
+    // u in [0, 1)
+    int Sample(const real u) const {
+        const int n = m_Pmf.size();
+        const real x = u * n;
+        const int i = std::min(int(x), n - 1);
+        return x - i < m_Probability[i] ? i : m_Alias[i];
+    }
+
+private:
+    real m_Total;
+    std::vector<real> m_Pmf;
+    std::vector<float> m_Probability;
+    std::vector<int> m_Alias;
+};
@@ -1,10 +1,14 @@
 #pragma once
 
 #include <embree4/rtcore.h>
-#include <vector>
+#include <glm/glm.hpp>
 
+#include "bvh.hpp"
+#include "embreescene.hpp"
+#include "hit.hpp"
 #include "material.hpp"
 #include "mesh.hpp"
+#include "meshlight.hpp"
 
 typedef struct {
     float x, y, z;
@@ -19,15 +23,18 @@ public:
     EmbreeMesh(
         RTCDevice device,
         const P_Mesh &mesh,
-        const P_Material &material) :
+        const P_Material &material,
+        const BVHOptions &options = BVHOptions()) :
         m_Mesh(mesh),
-        m_Material(material)
+        m_Material(material),
+        m_Light(mesh, material),
+        m_Args(EmbreeIntersectArguments(options, RTC_FEATURE_FLAG_TRIANGLE))
     {
-        m_Scene = rtcNewScene(device);
+        m_Scene = NewEmbreeScene(device, options);
         RTCGeometry geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
 
-        const auto positions = mesh->Positions();
-        const auto triangles = mesh->Triangles();
+        const auto &positions = mesh->Positions();
+        const auto &triangles = mesh->Triangles();
 
         EmbreeVertex *vertexBuf = (EmbreeVertex *)rtcSetNewGeometryBuffer(
             geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3,
@@ -52,31 +59,58 @@ public:
         rtcCommitGeometry(geom);
         rtcAttachGeometry(m_Scene, geom);
         rtcReleaseGeometry(geom);
-        rtcCommitScene(m_Scene);
+        m_BuildSeconds = CommitEmbreeScene(
+            device, m_Scene, options, "triangles", triangles.size());
     }
 
-    virtual bool Hit(
-        const Ray &ray, const real tmin, const real tmax, HitInfo &hit) const
+    // shares the committed scene of geometry with a different material, so
+    // one BVH can be reused by many renders
+    EmbreeMesh(const EmbreeMesh &geometry, const P_Material &material) :
+        m_Scene(geometry.m_Scene),
+        m_Mesh(geometry.m_Mesh),
+        m_Material(material),
+        m_Light(geometry.m_Mesh, material),
+        m_Args(geometry.m_Args),
+        m_BuildSeconds(geometry.m_BuildSeconds)
     {
-        const vec3 &org = ray.Origin();
-        const vec3 &dir = ray.Direction();
+        rtcRetainScene(m_Scene);
+    }
 
-        RTCRayHit r;
-        r.ray.org_x = org.x; r.ray.org_y = org.y; r.ray.org_z = org.z;
-        r.ray.dir_x = dir.x; r.ray.dir_y = dir.y; r.ray.dir_z = dir.z;
-        r.ray.tnear = tmin;
-        r.ray.tfar = tmax;
-        r.ray.mask = -1;
-        r.ray.flags = 0;
-        r.ray.time = 0;
-        r.ray.id = 0;
+    // a plain copy would release the scene twice; share through the
+    // constructor above instead
+    EmbreeMesh(const EmbreeMesh &) = delete;
+    EmbreeMesh &operator=(const EmbreeMesh &) = delete;
 
-        r.hit.geomID = RTC_INVALID_GEOMETRY_ID;
-        r.hit.primID = RTC_INVALID_GEOMETRY_ID;
+    virtual ~EmbreeMesh() {
+        rtcReleaseScene(m_Scene);
+    }
+
+    const P_Mesh &GetMesh() const {
+        return m_Mesh;
+    }
+
+    double BuildSeconds() const {
+        return m_BuildSeconds;
+    }
 
-        rtcIntersect1(m_Scene, &r);
+    virtual bool Emits() const {
+        return !m_Light.Empty();
+    }
+
+    virtual LightInfo EmitterInfo() const {
+        return m_Light.Info();
+    }
 
-        if (r.hit.primID == RTC_INVALID_GEOMETRY_ID) {
+    virtual bool BoundingBox(Box &box) const {
+        box = m_Mesh->BoundingBox();
+        return true;
+    }
+
+    virtual bool Hit(
+        const Ray &ray, const real tmin, const real tmax, HitInfo &hit) const
+    {
+        RTCRayHit r;
+        if (!Intersect(ray, tmin, tmax, r)) {
             return false;
         }
 
@@ -92,8 +126,50 @@ public:
         return true;
     }
 
+    virtual Ray RandomRay(const vec3 &o) const {
+        const vec3 p = m_Light.RandomPoint(*m_Mesh);
+        return Ray(o, glm::normalize(p - o));
+    }
+
+    // solid angle pdf of sampling the first surface point along ray
+    virtual real Pdf(const Ray &ray) const {
+        RTCRayHit r;
+        if (!Intersect(ray, EPS, INF, r)) {
+            return 0;
+        }
+        const vec3 ng(r.hit.Ng_x, r.hit.Ng_y, r.hit.Ng_z);
+        return m_Light.Pdf(ng, ray.Direction(), r.ray.tfar);
+    }
+
 private:
+    bool Intersect(
+        const Ray &ray, const real tmin, const real tmax, RTCRayHit &r) const
+    {
+        const vec3 &org = ray.Origin();
+        const vec3 &dir = ray.Direction();
+
+        r.ray.org_x = org.x; r.ray.org_y = org.y; r.ray.org_z = org.z;
+        r.ray.dir_x = dir.x; r.ray.dir_y = dir.y; r.ray.dir_z = dir.z;
+        r.ray.tnear = tmin;
+        r.ray.tfar = tmax;
+        r.ray.mask = -1;
+        r.ray.flags = 0;
+        r.ray.time = 0;
+        r.ray.id = 0;
+
+        r.hit.geomID = RTC_INVALID_GEOMETRY_ID;
+        r.hit.primID = RTC_INVALID_GEOMETRY_ID;
+
+        RTCIntersectArguments args = m_Args;
+        rtcIntersect1(m_Scene, &r, &args);
+
+        return r.hit.primID != RTC_INVALID_GEOMETRY_ID;
+    }
+
     RTCScene m_Scene;
     P_Mesh m_Mesh;
     P_Material m_Material;
+    MeshLight m_Light;
+    RTCIntersectArguments m_Args;
+    double m_BuildSeconds;
 };
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <embree4/rtcore.h>
+#include <stdexcept>
+#include <string>
+#include <sys/types.h>
+
+#include "bvh.hpp"
+#include "memory.hpp"
+#include "trace.hpp"
+
+// Routes the device's allocations to the Embree category. Allocations
+// that would exceed the budget are refused, which makes Embree fail the
+// operation with RTC_ERROR_OUT_OF_MEMORY (see CommitEmbreeScene).
+inline void MonitorDeviceMemory(RTCDevice device) {
+    rtcSetDeviceMemoryMonitorFunction(device,
+        [](void *, ssize_t bytes, bool post) {
+            // Embree releases refused allocations too, so always count them
+            const bool fits = MemoryTracker::Shared().Add(MemoryEmbree, bytes);
+            return fits || bytes <= 0 || post;
+        }, nullptr);
+}
+
+inline RTCSceneFlags EmbreeSceneFlags(const BVHOptions &options) {
+    int flags = RTC_SCENE_FLAG_NONE;
+    if (options.Compact) {
+        flags |= RTC_SCENE_FLAG_COMPACT;
+    }
+    if (options.Robust) {
+        flags |= RTC_SCENE_FLAG_ROBUST;
+    }
+    return RTCSceneFlags(flags);
+}
+
+inline RTCBuildQuality EmbreeBuildQuality(const BVHOptions &options) {
+    if (options.Quality == BVHLow) {
+        return RTC_BUILD_QUALITY_LOW;
+    }
+    if (options.Quality == BVHHigh) {
+        return RTC_BUILD_QUALITY_HIGH;
+    }
+    return RTC_BUILD_QUALITY_MEDIUM;
+}
+
+inline RTCScene NewEmbreeScene(RTCDevice device, const BVHOptions &options) {
+    RTCScene scene = rtcNewScene(device);
+    rtcSetSceneFlags(scene, EmbreeSceneFlags(options));
+    rtcSetSceneBuildQuality(scene, EmbreeBuildQuality(options));
+    return scene;
+}
+
+// Arguments for rtcIntersect1 on a scene holding only geometry of the
+// given features, which lets Embree specialize traversal where it compiles
+// per feature set (SYCL devices; CPU traversal ignores the mask).
+inline RTCIntersectArguments EmbreeIntersectArguments(
+    const BVHOptions &options, const RTCFeatureFlags features)
+{
+    RTCIntersectArguments args;
+    rtcInitIntersectArguments(&args);
+    args.flags = options.Coherent ?
+        RTC_RAY_QUERY_FLAG_COHERENT : RTC_RAY_QUERY_FLAG_INCOHERENT;
+    args.feature_mask = features;
+    return args;
+}
+
+// Commits scene and returns the build time in seconds. A build refused by
+// the memory budget (see MonitorDeviceMemory) is retried compact at low
+// quality before giving up.
+inline double CommitEmbreeScene(
+    RTCDevice device, RTCScene scene, const BVHOptions &options,
+    const char *argName, const int64_t argValue)
+{
+    TraceSpan span("rtcCommitScene", "load", argName, argValue);
+    const auto start = std::chrono::steady_clock::now();
+    rtcGetDeviceError(device);
+    rtcCommitScene(scene);
+    if (rtcGetDeviceError(device) == RTC_ERROR_OUT_OF_MEMORY) {
+        printf("  memory budget: rebuilding BVH compact at low quality\n");
+        rtcSetSceneFlags(
+            scene, RTCSceneFlags(EmbreeSceneFlags(options) | RTC_SCENE_FLAG_COMPACT));
+        rtcSetSceneBuildQuality(scene, RTC_BUILD_QUALITY_LOW);
+        rtcCommitScene(scene);
+        if (rtcGetDeviceError(device) == RTC_ERROR_OUT_OF_MEMORY) {
+            throw std::runtime_error("memory budget exceeded building BVH");
+        }
+    }
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+}
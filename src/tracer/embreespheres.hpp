@@ -1,14 +1,21 @@
 #pragma once
 
+#include <cstdint>
 #include <cstring>
 #include <embree4/rtcore.h>
+#include <functional>
 #include <glm/glm.hpp>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
 #include "config.hpp"
+#include "embreescene.hpp"
 #include "hit.hpp"
 #include "material.hpp"
+#include "memory.hpp"
+#include "sphere.hpp"
 
 typedef struct {
     float x;
@@ -17,29 +24,167 @@ typedef struct {
     float r;
 } EmbreeSphere;
 
+// Writes the spheres and, when given a buffer, each sphere's index into
+// the materials.
+typedef std::function<void(EmbreeSphere *spheres, uint16_t *materials)> SphereFill;
+
+// One emitting sphere of an EmbreeSpheres as a light, read from the vertex
+// buffer whenever it is sampled; valid while the EmbreeSpheres lives.
+class EmbreeSphereEmitter : public Hittable {
+public:
+    EmbreeSphereEmitter(
+        const EmbreeSphere *sphere, const P_Material *material) :
+        m_Sphere(sphere), m_Material(material) {}
+
+    virtual bool Emits() const {
+        return true;
+    }
+
+    virtual LightInfo EmitterInfo() const {
+        const vec3 center = Center();
+        return SphereLightInfo(
+            center, m_Sphere->r, (*m_Material)->Emitted(0, 0, center));
+    }
+
+    virtual bool BoundingBox(Box &box) const {
+        const vec3 r(m_Sphere->r);
+        box = Box(Center() - r, Center() + r);
+        return true;
+    }
+
+    virtual bool Hit(
+        const Ray &ray, const real tmin, const real tmax, HitInfo &hit) const
+    {
+        const vec3 center = Center();
+        real t;
+        if (!IntersectSphere(center, m_Sphere->r, ray, tmin, tmax, t)) {
+            return false;
+        }
+        hit.T = t;
+        hit.Position = ray.At(t);
+        hit.Normal = (hit.Position - center) / real(m_Sphere->r);
+        hit.Material = *m_Material;
+        return true;
+    }
+
+    virtual Ray RandomRay(const vec3 &o) const {
+        return SphereRandomRay(Center(), m_Sphere->r, o);
+    }
+
+    virtual real Pdf(const Ray &ray) const {
+        return SpherePdf(Center(), m_Sphere->r, ray);
+    }
+
+private:
+    vec3 Center() const {
+        return vec3(m_Sphere->x, m_Sphere->y, m_Sphere->z);
+    }
+
+    const EmbreeSphere *m_Sphere;
+    const P_Material *m_Material;
+};
+
+// Spheres live only in Embree's vertex buffer (16 bytes each), plus a
+// 2 byte material index each when indexed. Without indices the spheres are
+// split evenly between the materials in order.
 class EmbreeSpheres : public Hittable {
 public:
     EmbreeSpheres(
         RTCDevice device,
         const std::vector<EmbreeSphere> &spheres,
-        const std::vector<P_Material> &materials) :
-        m_NumSpheres(spheres.size()),
-        m_Materials(materials)
+        const std::vector<P_Material> &materials,
+        const BVHOptions &options = BVHOptions()) :
+        EmbreeSpheres(device, spheres.size(),
+            [&](EmbreeSphere *buf, uint16_t *) {
+                memcpy(buf, spheres.data(), sizeof(EmbreeSphere) * spheres.size());
+            }, false, materials, options)
+    {}
+
+    // count spheres written by fill straight into the vertex buffer, so
+    // large point clouds are never held twice
+    EmbreeSpheres(
+        RTCDevice device,
+        const int count,
+        const SphereFill &fill,
+        const bool indexed,
+        const std::vector<P_Material> &materials,
+        const BVHOptions &options = BVHOptions()) :
+        m_NumSpheres(count),
+        m_Materials(materials),
+        m_Charge(MemoryMeshes),
+        m_Args(EmbreeIntersectArguments(options, RTC_FEATURE_FLAG_SPHERE_POINT))
     {
-        m_Scene = rtcNewScene(device);
-        // rtcSetSceneFlags(m_Scene, RTC_SCENE_FLAG_ROBUST);
+        if (indexed && materials.size() > 65536) {
+            throw std::runtime_error("too many sphere materials");
+        }
+        m_Scene = NewEmbreeScene(device, options);
         RTCGeometry geom = rtcNewGeometry(
             device, RTC_GEOMETRY_TYPE_SPHERE_POINT);
         EmbreeSphere *buf = (EmbreeSphere *)rtcSetNewGeometryBuffer(
             geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT4,
             sizeof(EmbreeSphere), m_NumSpheres);
+        m_Spheres = buf;
 
-        memcpy(buf, spheres.data(), sizeof(EmbreeSphere) * m_NumSpheres);
+        m_MaterialIndices.resize(indexed ? count : 0);
+        try {
+            fill(buf, indexed ? m_MaterialIndices.data() : nullptr);
+        } catch (...) {
+            rtcReleaseGeometry(geom);
+            rtcReleaseScene(m_Scene);
+            throw;
+        }
+        m_Charge.Set(m_MaterialIndices.capacity() * sizeof(uint16_t));
+        m_Emits = ReferencesEmitter();
 
         rtcCommitGeometry(geom);
         rtcAttachGeometry(m_Scene, geom);
         rtcReleaseGeometry(geom);
-        rtcCommitScene(m_Scene);
+        m_BuildSeconds = CommitEmbreeScene(
+            device, m_Scene, options, "spheres", m_NumSpheres);
+    }
+
+    // the scene is released once, by its only owner
+    EmbreeSpheres(const EmbreeSpheres &) = delete;
+    EmbreeSpheres &operator=(const EmbreeSpheres &) = delete;
+
+    virtual ~EmbreeSpheres() {
+        rtcReleaseScene(m_Scene);
+    }
+
+    double BuildSeconds() const {
+        return m_BuildSeconds;
+    }
+
+    virtual bool Emits() const {
+        return m_Emits;
+    }
+
+    // every emitting sphere as a view into the vertex buffer (24 bytes),
+    // all held by one shared vector instead of a Sphere allocated apiece
+    virtual std::vector<P_Hittable> Emitters() const {
+        std::vector<char> emits(m_Materials.size());
+        for (int m = 0; m < m_Materials.size(); m++) {
+            emits[m] = m_Materials[m]->Emits();
+        }
+        int count = 0;
+        for (int i = 0; i < m_NumSpheres; i++) {
+            count += emits[MaterialIndex(i)];
+        }
+        const auto views =
+            std::make_shared<std::vector<EmbreeSphereEmitter>>();
+        views->reserve(count);
+        for (int i = 0; i < m_NumSpheres; i++) {
+            const int m = MaterialIndex(i);
+            if (emits[m]) {
+                views->emplace_back(m_Spheres + i, &m_Materials[m]);
+            }
+        }
+        std::vector<P_Hittable> result;
+        result.reserve(count);
+        for (EmbreeSphereEmitter &view : *views) {
+            result.push_back(P_Hittable(views, &view));
+        }
+        return result;
     }
 
     virtual bool Hit(
@@ -61,7 +206,8 @@ public:
         r.hit.geomID = RTC_INVALID_GEOMETRY_ID;
         r.hit.primID = RTC_INVALID_GEOMETRY_ID;
 
-        rtcIntersect1(m_Scene, &r);
+        RTCIntersectArguments args = m_Args;
+        rtcIntersect1(m_Scene, &r, &args);
 
         if (r.hit.primID == RTC_INVALID_GEOMETRY_ID) {
             return false;
@@ -72,17 +218,45 @@ public:
         const real y = r.ray.org_y + r.ray.dir_y * t;
         const real z = r.ray.org_z + r.ray.dir_z * t;
 
-        const int i = m_Materials.size() * (real)r.hit.primID / m_NumSpheres;
-
         hit.T = t;
         hit.Position = vec3(x, y, z);
         hit.Normal = glm::normalize(vec3(r.hit.Ng_x, r.hit.Ng_y, r.hit.Ng_z));
-        hit.Material = m_Materials[i];
+        hit.Material = m_Materials[MaterialIndex(r.hit.primID)];
         return true;
     }
 
 private:
+    int MaterialIndex(const int primID) const {
+        if (!m_MaterialIndices.empty()) {
+            return m_MaterialIndices[primID];
+        }
+        return m_Materials.size() * (real)primID / m_NumSpheres;
+    }
+
+    // whether any sphere, not just any material, emits: otherwise the
+    // spheres would be registered as a light with no emitters
+    bool ReferencesEmitter() const {
+        std::vector<char> emits(m_Materials.size());
+        bool any = false;
+        for (int m = 0; m < m_Materials.size(); m++) {
+            emits[m] = m_Materials[m]->Emits();
+            any = any || emits[m];
+        }
+        for (int i = 0; any && i < m_NumSpheres; i++) {
+            if (emits[MaterialIndex(i)]) {
+                return true;
+            }
+        }
+        return false;
+    }
+
     int m_NumSpheres;
+    const EmbreeSphere *m_Spheres;
     RTCScene m_Scene;
     std::vector<P_Material> m_Materials;
+    std::vector<uint16_t> m_MaterialIndices;
+    MemoryCharge m_Charge;
+    bool m_Emits;
+    RTCIntersectArguments m_Args;
+    double m_BuildSeconds;
 };
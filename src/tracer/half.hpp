@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+// IEEE 754 binary16 conversion (round to nearest even), used for compact
+// auxiliary image planes and half float outputs.
+
+inline uint16_t FloatToHalf(const float value) {
+    uint32_t f;
+    memcpy(&f, &value, sizeof(f));
+    const uint32_t sign = (f >> 16) & 0x8000;
+    const int biased = (f >> 23) & 0xff;
+    const int exponent = biased - 127 + 15;
+    uint32_t mantissa = f & 0x7fffff;
+
+    // inf / nan
+    if (biased == 0xff) {
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    }
+
+    // overflow
+    if (exponent >= 31) {
+        return sign | 0x7c00;
+    }
+
+    // subnormal or zero
+    if (exponent <= 0) {
+        if (exponent < -10) {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        const int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        const uint32_t rest = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) {
+            half++;
+        }
+        return sign | half;
+    }
+
+    // normal; a carry out of the mantissa correctly bumps the exponent
+    uint32_t half = (uint32_t(exponent) << 10) | (mantissa >> 13);
+    const uint32_t rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+        half++;
+    }
+    return sign | half;
+}
+
+inline float HalfToFloat(const uint16_t value) {
+    const uint32_t sign = uint32_t(value & 0x8000) << 16;
+    int exponent = (value >> 10) & 0x1f;
+    uint32_t mantissa = value & 0x3ff;
+    uint32_t f;
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            f = sign;
+        } else {
+            // renormalize subnormal
+            exponent = 1;
+            while (!(mantissa & 0x400)) {
+                mantissa <<= 1;
+                exponent--;
+            }
+            mantissa &= 0x3ff;
+            f = sign | (uint32_t(exponent - 15 + 127) << 23) | (mantissa << 13);
+        }
+    } else if (exponent == 31) {
+        f = sign | 0x7f800000 | (mantissa << 13);
+    } else {
+        f = sign | (uint32_t(exponent - 15 + 127) << 23) | (mantissa << 13);
+    }
+    float result;
+    memcpy(&result, &f, sizeof(result));
+    return result;
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "half.hpp"
+
+// Linear float image files. Pixel data is pulled one row of one channel
+// at a time, so planar accumulators can be written without an interleaved
+// copy of the whole image.
+
+// fills row (width floats) with channel c of image row y (top to bottom)
+typedef std::function<void(int y, int c, float *row)> RowSource;
+
+// Portable float map: 1 ("Pf") or 3 ("PF") channels, rows bottom to top.
+void WritePFM(
+    const std::string &path, const int width, const int height,
+    const int channels, const RowSource &source)
+{
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    out << (channels == 1 ? "Pf" : "PF") << "\n";
+    out << width << " " << height << "\n";
+    out << "-1.0\n";
+    std::vector<float> plane(width);
+    std::vector<float> row(width * channels);
+    for (int y = height - 1; y >= 0; y--) {
+        for (int c = 0; c < channels; c++) {
+            source(y, c, plane.data());
+            for (int x = 0; x < width; x++) {
+                row[x * channels + c] = plane[x];
+            }
+        }
+        out.write((const char *)row.data(), row.size() * sizeof(float));
+    }
+}
+
+// Reads a PFM into interleaved floats, rows top to bottom.
+std::vector<float> ReadPFM(
+    const std::string &path, int &width, int &height, int &channels)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    std::string type;
+    float scale;
+    in >> type >> width >> height >> scale;
+    in.get(); // single whitespace before the data
+    if (!in || (type != "PF" && type != "Pf") || width <= 0 || height <= 0) {
+        throw std::runtime_error("invalid pfm: " + path);
+    }
+    channels = type == "PF" ? 3 : 1;
+    const size_t rowSize = size_t(width) * channels;
+    std::vector<float> data(rowSize * height);
+    for (int y = height - 1; y >= 0; y--) {
+        in.read((char *)(data.data() + y * rowSize), rowSize * sizeof(float));
+    }
+    if (!in) {
+        throw std::runtime_error("truncated pfm: " + path);
+    }
+    // a positive scale means big endian data
+    if (scale > 0) {
+        for (float &value : data) {
+            uint32_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            bits = (bits >> 24) | ((bits >> 8) & 0xff00) |
+                ((bits << 8) & 0xff0000) | (bits << 24);
+            memcpy(&value, &bits, sizeof(value));
+        }
+    }
+    return data;
+}
+
+namespace {
+
+template <typename T>
+void PutLE(std::vector<uint8_t> &buf, const T value) {
+    for (int i = 0; i < sizeof(T); i++) {
+        buf.push_back(uint8_t(uint64_t(value) >> (i * 8)));
+    }
+}
+
+void PutFloat(std::vector<uint8_t> &buf, const float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    PutLE(buf, bits);
+}
+
+void PutAttribute(
+    std::vector<uint8_t> &buf, const std::string &name,
+    const std::string &type, const std::vector<uint8_t> &value)
+{
+    buf.insert(buf.end(), name.begin(), name.end());
+    buf.push_back(0);
+    buf.insert(buf.end(), type.begin(), type.end());
+    buf.push_back(0);
+    PutLE<int32_t>(buf, value.size());
+    buf.insert(buf.end(), value.begin(), value.end());
+}
+
+}
+
+// Uncompressed scanline OpenEXR with one float or half channel per name.
+void WriteEXR(
+    const std::string &path, const int width, const int height,
+    const std::vector<std::string> &names, const RowSource &source,
+    const bool half)
+{
+    // channels are stored in alphabetical order
+    std::vector<int> order(names.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&names](int a, int b) {
+        return names[a] < names[b];
+    });
+
+    std::vector<uint8_t> header;
+    PutLE<uint32_t>(header, 20000630); // magic
+    PutLE<uint32_t>(header, 2);        // version, scanline
+
+    std::vector<uint8_t> value;
+    for (const int c : order) {
+        value.insert(value.end(), names[c].begin(), names[c].end());
+        value.push_back(0);
+        PutLE<int32_t>(value, half ? 1 : 2); // pixel type
+        PutLE<uint32_t>(value, 0);           // pLinear + reserved
+        PutLE<int32_t>(value, 1);            // x sampling
+        PutLE<int32_t>(value, 1);            // y sampling
+    }
+    value.push_back(0);
+    PutAttribute(header, "channels", "chlist", value);
+
+    PutAttribute(header, "compression", "compression", {0});
+
+    value.clear();
+    PutLE<int32_t>(value, 0);
+    PutLE<int32_t>(value, 0);
+    PutLE<int32_t>(value, width - 1);
+    PutLE<int32_t>(value, height - 1);
+    PutAttribute(header, "dataWindow", "box2i", value);
+    PutAttribute(header, "displayWindow", "box2i", value);
+
+    PutAttribute(header, "lineOrder", "lineOrder", {0});
+
+    value.clear();
+    PutFloat(value, 1);
+    PutAttribute(header, "pixelAspectRatio", "float", value);
+
+    value.clear();
+    PutFloat(value, 0);
+    PutFloat(value, 0);
+    PutAttribute(header, "screenWindowCenter", "v2f", value);
+
+    value.clear();
+    PutFloat(value, 1);
+    PutAttribute(header, "screenWindowWidth", "float", value);
+
+    header.push_back(0);
+
+    // one scanline per block, so block offsets are known up front
+    const int sampleSize = half ? 2 : 4;
+    const uint64_t dataSize = uint64_t(width) * names.size() * sampleSize;
+    const uint64_t blockSize = 8 + dataSize;
+    const uint64_t first = header.size() + uint64_t(height) * 8;
+    for (int y = 0; y < height; y++) {
+        PutLE<uint64_t>(header, first + y * blockSize);
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    out.write((const char *)header.data(), header.size());
+
+    std::vector<float> row(width);
+    std::vector<uint16_t> halves(width);
+    std::vector<uint8_t> block;
+    for (int y = 0; y < height; y++) {
+        block.clear();
+        PutLE<int32_t>(block, y);
+        PutLE<int32_t>(block, dataSize);
+        out.write((const char *)block.data(), block.size());
+        for (const int c : order) {
+            source(y, c, row.data());
+            if (half) {
+                for (int x = 0; x < width; x++) {
+                    halves[x] = FloatToHalf(row[x]);
+                }
+                out.write((const char *)halves.data(), width * 2);
+            } else {
+                out.write((const char *)row.data(), width * 4);
+            }
+        }
+    }
+}
@@ -3,6 +3,7 @@
 #include <memory>
 #include <vector>
 
+#include "box.hpp"
 #include "config.hpp"
 #include "material.hpp"
 #include "ray.hpp"
@@ -14,6 +15,16 @@ struct HitInfo {
     P_Material Material;
 };
 
+// Spatial and directional extent of an emitter, used to build the light
+// tree. Normals of the emitting surface lie within CosTheta of Axis;
+// CosTheta = -1 means light leaves in every direction.
+struct LightInfo {
+    Box Bounds;
+    vec3 Axis;
+    real CosTheta;
+    real Power;
+};
+
 class Hittable {
 public:
     virtual bool Hit(
@@ -31,6 +42,34 @@ public:
         return false;
     }
 
+    // participating media are skipped by HitSurface and attenuate shadow
+    // rays through Transmittance instead
+    virtual bool Medium() const {
+        return false;
+    }
+
+    virtual real Transmittance(
+        const Ray &ray, const real tmin, const real tmax) const
+    {
+        return 1;
+    }
+
+    // sets box to the object's bounds, or returns false if it has none
+    // (e.g. an infinite plane)
+    virtual bool BoundingBox(Box &box) const {
+        return false;
+    }
+
+    virtual LightInfo EmitterInfo() const {
+        return LightInfo{Box(), vec3(0, 0, 1), -1, 0};
+    }
+
+    // aggregates that hold many emitters (e.g. EmbreeSpheres) return each
+    // one as its own light so that it can be sampled individually
+    virtual std::vector<std::shared_ptr<Hittable>> Emitters() const {
+        return {};
+    }
+
     virtual ~Hittable() {}
 };
 
@@ -40,8 +79,19 @@ class HittableList : public Hittable {
 public:
     void Add(const P_Hittable &item) {
         m_Items.push_back(item);
-        if (item->Emits()) {
+        if (item->Medium()) {
+            m_Media.push_back(item);
+        } else {
+            m_Surfaces.push_back(item);
+        }
+        if (!item->Emits()) {
+            return;
+        }
+        const auto emitters = item->Emitters();
+        if (emitters.empty()) {
             m_Lights.push_back(item);
+        } else {
+            m_Lights.insert(m_Lights.end(), emitters.begin(), emitters.end());
         }
     }
 
@@ -49,12 +99,55 @@ public:
         return m_Lights;
     }
 
+    const std::vector<P_Hittable> &Media() const {
+        return m_Media;
+    }
+
     virtual bool Hit(
         const Ray &ray, const real tmin, const real tmax, HitInfo &hit) const
+    {
+        return HitItems(m_Items, ray, tmin, tmax, hit);
+    }
+
+    // closest hit ignoring participating media
+    bool HitSurface(
+        const Ray &ray, const real tmin, const real tmax, HitInfo &hit) const
+    {
+        return HitItems(m_Surfaces, ray, tmin, tmax, hit);
+    }
+
+    virtual bool BoundingBox(Box &box) const {
+        for (int i = 0; i < m_Items.size(); i++) {
+            Box b;
+            if (!m_Items[i]->BoundingBox(b)) {
+                return false;
+            }
+            box = i ? box.Extend(b) : b;
+        }
+        return !m_Items.empty();
+    }
+
+    virtual real Transmittance(
+        const Ray &ray, const real tmin, const real tmax) const
+    {
+        real result = 1;
+        for (const auto &item : m_Media) {
+            result *= item->Transmittance(ray, tmin, tmax);
+            if (result <= 0) {
+                break;
+            }
+        }
+        return result;
+    }
+
+private:
+    static bool HitItems(
+        const std::vector<P_Hittable> &items,
+        const Ray &ray, const real tmin, const real tmax, HitInfo &hit)
     {
         bool result = false;
         real closest = tmax;
-        for (const auto &item : m_Items) {
+        for (const auto &item : items) {
             HitInfo temp;
             if (item->Hit(ray, tmin, closest, temp)) {
                 result = true;
@@ -65,8 +158,9 @@ public:
         return result;
     }
 
-private:
     std::vector<P_Hittable> m_Items;
+    std::vector<P_Hittable> m_Surfaces;
+    std::vector<P_Hittable> m_Media;
     std::vector<P_Hittable> m_Lights;
 };
 
@@ -1,58 +1,110 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
 #include <fstream>
 #include <glm/glm.hpp>
+#include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "../vendor/stb_image_write.h"
 
 #include "config.hpp"
+#include "half.hpp"
+#include "hdr.hpp"
+#include "memory.hpp"
+#include "parallel.hpp"
+#include "tonemap.hpp"
 
-class Pixel {
+// Storage choices for an Image. Accumulators are always single precision
+// and stored as separate planes (SoA); variance accumulators are only
+// allocated when requested, and auxiliary planes can be stored as halves.
+struct ImageLayout {
+    bool Variance = true;
+    bool HalfPlanes = false;
+};
+
+// Named multi-channel plane of per-pixel values stored as float or half.
+class Plane {
 public:
-    Pixel() :
-        m_NumSamples(0), m_Mean(0), m_Variance(0) {}
+    Plane(
+        const std::string &name, const int numPixels, const int channels,
+        const bool half) :
+        m_Name(name), m_Channels(channels), m_Half(half)
+    {
+        if (half) {
+            m_HalfData.resize(size_t(numPixels) * channels);
+        } else {
+            m_FloatData.resize(size_t(numPixels) * channels);
+        }
+    }
 
-    vec3 Color() const {
-        return m_Mean;
+    const std::string &Name() const {
+        return m_Name;
     }
 
-    vec3 Variance() const {
-        if (m_NumSamples < 2) {
-            return vec3(0);
-        }
-        return m_Variance / real(m_NumSamples - 1);
+    int Channels() const {
+        return m_Channels;
+    }
+
+    bool Half() const {
+        return m_Half;
     }
 
-    vec3 StandardDeviation() const {
-        return glm::sqrt(Variance());
+    float Get(const int index, const int channel) const {
+        const size_t i = size_t(index) * m_Channels + channel;
+        return m_Half ? HalfToFloat(m_HalfData[i]) : m_FloatData[i];
     }
 
-    void AddSample(const vec3 &c) {
-        m_NumSamples++;
-        if (m_NumSamples == 1) {
-            m_Mean = c;
-            return;
+    void Set(const int index, const int channel, const float value) {
+        const size_t i = size_t(index) * m_Channels + channel;
+        if (m_Half) {
+            m_HalfData[i] = FloatToHalf(value);
+        } else {
+            m_FloatData[i] = value;
         }
-        const vec3 m = m_Mean;
-        m_Mean += (c - m_Mean) / real(m_NumSamples);
-        m_Variance += (c - m) * (c - m_Mean);
+    }
+
+    void Clear() {
+        std::fill(m_FloatData.begin(), m_FloatData.end(), 0.f);
+        std::fill(m_HalfData.begin(), m_HalfData.end(), 0);
+    }
+
+    size_t Bytes() const {
+        return m_FloatData.size() * sizeof(float) +
+            m_HalfData.size() * sizeof(uint16_t);
     }
 
 private:
-    int m_NumSamples;
-    vec3 m_Mean;
-    vec3 m_Variance;
+    std::string m_Name;
+    int m_Channels;
+    bool m_Half;
+    std::vector<float> m_FloatData;
+    std::vector<uint16_t> m_HalfData;
 };
 
 class Image {
 public:
-    Image(int width, int height) :
-        m_Width(width), m_Height(height)
+    // without room in the memory budget for variance it is not stored
+    Image(int width, int height, const ImageLayout &layout = ImageLayout()) :
+        m_Width(width), m_Height(height),
+        m_Layout(FitLayout(width, height, layout)),
+        m_Charge(MemoryImages)
     {
-        m_Pixels.resize(width * height);
+        const size_t n = size_t(width) * height;
+        m_NumSamples.resize(n);
+        for (int c = 0; c < 3; c++) {
+            m_Mean[c].resize(n);
+            if (m_Layout.Variance) {
+                m_M2[c].resize(n);
+            }
+        }
+        m_Charge.Set(Bytes());
     }
 
     int Width() const {
@@ -63,60 +115,288 @@ public:
         return m_Height;
     }
 
+    const ImageLayout &Layout() const {
+        return m_Layout;
+    }
+
     void AddSample(const int x, const int y, const vec3 &c) {
-        m_Pixels[y * m_Width + x].AddSample(c);
+        const int i = y * m_Width + x;
+        const uint32_t n = ++m_NumSamples[i];
+        // Welford's online mean / variance, evaluated in full precision
+        for (int k = 0; k < 3; k++) {
+            const real m = m_Mean[k][i];
+            const real mean = m + (c[k] - m) / real(n);
+            m_Mean[k][i] = mean;
+            if (m_Layout.Variance && n > 1) {
+                m_M2[k][i] += (c[k] - m) * (c[k] - mean);
+            }
+        }
+    }
+
+    int NumSamples(const int x, const int y) const {
+        return m_NumSamples[y * m_Width + x];
     }
 
     vec3 Color(const int x, const int y) const {
-        return m_Pixels[y * m_Width + x].Color();
+        const int i = y * m_Width + x;
+        return vec3(m_Mean[0][i], m_Mean[1][i], m_Mean[2][i]);
     }
 
     vec3 Variance(const int x, const int y) const {
-        return m_Pixels[y * m_Width + x].Variance();
+        const int i = y * m_Width + x;
+        const uint32_t n = m_NumSamples[i];
+        if (!m_Layout.Variance || n < 2) {
+            return vec3(0);
+        }
+        return vec3(m_M2[0][i], m_M2[1][i], m_M2[2][i]) / real(n - 1);
     }
 
     vec3 StandardDeviation(const int x, const int y) const {
-        return m_Pixels[y * m_Width + x].StandardDeviation();
-    }
-
-    void SavePNG(const std::string &path) const {
-        const vec3 exponent = vec3(1 / 2.2);
-        std::vector<uint8_t> data;
-        data.reserve(m_Width * m_Height * 3);
-        int i = 0;
-        for (int y = 0; y < m_Height; y++) {
-            for (int x = 0; x < m_Width; x++) {
-                const vec3 c = glm::pow(m_Pixels[i++].Color(), exponent);
-                data.push_back(std::min(c.r * 256, real(255)));
-                data.push_back(std::min(c.g * 256, real(255)));
-                data.push_back(std::min(c.b * 256, real(255)));
+        return glm::sqrt(Variance(x, y));
+    }
+
+    // adds an auxiliary plane (stored per the layout, or as halves when
+    // floats do not fit the memory budget) and returns its index
+    int AddPlane(const std::string &name, const int channels) {
+        const size_t bytes = size_t(m_Width) * m_Height * channels * sizeof(float);
+        bool half = m_Layout.HalfPlanes;
+        if (!half && !MemoryTracker::Shared().Fits(bytes)) {
+            printf("  memory budget: storing %s as half\n", name.c_str());
+            half = true;
+        }
+        return AddPlane(name, channels, half);
+    }
+
+    // half overrides ImageLayout::HalfPlanes, for values outside its range
+    int AddPlane(const std::string &name, const int channels, const bool half) {
+        MemoryTracker::Shared().Require(
+            size_t(m_Width) * m_Height * channels *
+            (half ? sizeof(uint16_t) : sizeof(float)), "image plane " + name);
+        m_Planes.emplace_back(name, m_Width * m_Height, channels, half);
+        m_Charge.Set(Bytes());
+        return m_Planes.size() - 1;
+    }
+
+    int NumPlanes() const {
+        return m_Planes.size();
+    }
+
+    // index of the plane with the given name, or -1
+    int FindPlane(const std::string &name) const {
+        for (int i = 0; i < m_Planes.size(); i++) {
+            if (m_Planes[i].Name() == name) {
+                return i;
             }
         }
+        return -1;
+    }
+
+    Plane &GetPlane(const int index) {
+        return m_Planes[index];
+    }
+
+    const Plane &GetPlane(const int index) const {
+        return m_Planes[index];
+    }
+
+    void Clear() {
+        std::fill(m_NumSamples.begin(), m_NumSamples.end(), 0);
+        for (int c = 0; c < 3; c++) {
+            std::fill(m_Mean[c].begin(), m_Mean[c].end(), 0.f);
+            std::fill(m_M2[c].begin(), m_M2[c].end(), 0.f);
+        }
+        for (auto &plane : m_Planes) {
+            plane.Clear();
+        }
+    }
+
+    // memory held by accumulators and planes
+    size_t Bytes() const {
+        size_t result = m_NumSamples.size() * sizeof(uint32_t);
+        for (int c = 0; c < 3; c++) {
+            result += m_Mean[c].size() * sizeof(float);
+            result += m_M2[c].size() * sizeof(float);
+        }
+        for (const auto &plane : m_Planes) {
+            result += plane.Bytes();
+        }
+        return result;
+    }
+
+    // tone maps row y into width * 3 interleaved RGB bytes
+    void ToneMapRow(
+        const int y, const ToneMapOptions &options, uint8_t *dst) const
+    {
+        const size_t i = size_t(y) * m_Width;
+        ToneMapPixels(
+            m_Mean[0].data() + i, m_Mean[1].data() + i, m_Mean[2].data() + i,
+            m_Width, options, dst);
+    }
+
+    std::vector<uint8_t> ToneMap(const ToneMapOptions &options) const {
+        const size_t rowBytes = size_t(m_Width) * 3;
+        std::vector<uint8_t> data(rowBytes * m_Height);
+        ParallelFor(m_Height, 0, [&](const int y) {
+            ToneMapRow(y, options, data.data() + y * rowBytes);
+        }, 16);
+        return data;
+    }
+
+    void SavePNG(
+        const std::string &path,
+        const ToneMapOptions &options = ToneMapOptions()) const
+    {
+        const std::vector<uint8_t> data = ToneMap(options);
         stbi_write_png(
             path.c_str(), m_Width, m_Height, 3, data.data(), m_Width * 3);
     }
 
-    void SavePPM(const std::string &path) const {
-        const vec3 exponent = vec3(1 / 2.2);
-        std::ofstream out(path);
-        out << "P3\n";
+    void SavePPM(
+        const std::string &path,
+        const ToneMapOptions &options = ToneMapOptions()) const
+    {
+        const std::vector<uint8_t> data = ToneMap(options);
+        std::ofstream out(path, std::ios::binary);
+        out << "P6\n";
         out << m_Width << " " << m_Height << "\n";
         out << 255 << "\n";
-        int i = 0;
-        for (int y = 0; y < m_Height; y++) {
-            for (int x = 0; x < m_Width; x++) {
-                const vec3 c = glm::pow(m_Pixels[i++].Color(), exponent);
-                const int r = std::min(c.r * 256, real(255));
-                const int g = std::min(c.g * 256, real(255));
-                const int b = std::min(c.b * 256, real(255));
-                out << r << " " << g << " " << b << "\n";
+        out.write((const char *)data.data(), data.size());
+        out.close();
+    }
+
+    // linear output straight from the mean accumulators
+    void SavePFM(const std::string &path) const {
+        WritePFM(path, m_Width, m_Height, 3, MeanRows());
+    }
+
+    // auxiliary planes are written as extra channels named <plane>.R/G/B
+    // (or just <plane> for single channel planes)
+    void SaveEXR(const std::string &path, const bool half = false) const {
+        std::vector<std::string> names = {"R", "G", "B"};
+        std::vector<std::pair<int, int>> sources;
+        for (int i = 0; i < m_Planes.size(); i++) {
+            const Plane &plane = m_Planes[i];
+            for (int c = 0; c < plane.Channels(); c++) {
+                names.push_back(plane.Channels() == 1 ?
+                    plane.Name() : plane.Name() + "." + "RGBA"[c]);
+                sources.emplace_back(i, c);
             }
         }
-        out.close();
+        const RowSource mean = MeanRows();
+        WriteEXR(path, m_Width, m_Height, names,
+            [&](const int y, const int c, float *row) {
+                if (c < 3) {
+                    mean(y, c, row);
+                } else {
+                    const auto &source = sources[c - 3];
+                    PlaneRow(source.first, y, source.second, row);
+                }
+            }, half);
+    }
+
+    // picks the format from the extension: png, ppm, pfm or exr
+    void Save(
+        const std::string &path,
+        const ToneMapOptions &options = ToneMapOptions()) const
+    {
+        const std::string ext = path.substr(path.find_last_of('.') + 1);
+        if (ext == "png") {
+            SavePNG(path, options);
+        } else if (ext == "ppm") {
+            SavePPM(path, options);
+        } else if (ext == "pfm") {
+            SavePFM(path);
+        } else if (ext == "exr") {
+            SaveEXR(path);
+        } else {
+            throw std::runtime_error("unsupported output format: " + path);
+        }
+    }
+
+    void SavePlanePFM(const int index, const std::string &path) const {
+        const Plane &plane = m_Planes[index];
+        WritePFM(path, m_Width, m_Height, plane.Channels() == 1 ? 1 : 3,
+            [&](const int y, const int c, float *row) {
+                if (c < plane.Channels()) {
+                    PlaneRow(index, y, c, row);
+                } else {
+                    std::fill(row, row + m_Width, 0.f);
+                }
+            });
     }
 
 private:
+    static ImageLayout FitLayout(
+        const int width, const int height, const ImageLayout &layout)
+    {
+        ImageLayout result = layout;
+        const size_t n = size_t(width) * height;
+        const size_t bytes = n * (sizeof(uint32_t) + 3 * sizeof(float));
+        const size_t varianceBytes = n * 3 * sizeof(float);
+        if (result.Variance &&
+            !MemoryTracker::Shared().Fits(bytes + varianceBytes))
+        {
+            printf("  memory budget: storing image without variance\n");
+            result.Variance = false;
+        }
+        MemoryTracker::Shared().Require(bytes, "framebuffer");
+        return result;
+    }
+
+    void PlaneRow(const int index, const int y, const int c, float *row) const {
+        const Plane &plane = m_Planes[index];
+        const int i = y * m_Width;
+        for (int x = 0; x < m_Width; x++) {
+            row[x] = plane.Get(i + x, c);
+        }
+    }
+
+    RowSource MeanRows() const {
+        return [this](const int y, const int c, float *row) {
+            const float *src = m_Mean[c].data() + size_t(y) * m_Width;
+            std::copy(src, src + m_Width, row);
+        };
+    }
+
     int m_Width;
     int m_Height;
-    std::vector<Pixel> m_Pixels;
+    ImageLayout m_Layout;
+    std::vector<uint32_t> m_NumSamples;
+    std::vector<float> m_Mean[3];
+    std::vector<float> m_M2[3];
+    std::vector<Plane> m_Planes;
+    MemoryCharge m_Charge;
 };
+
+// Loads a PFM (for example a high sample count reference) as an image with
+// one sample per pixel.
+Image LoadPFM(const std::string &path) {
+    int width, height, channels;
+    const std::vector<float> data = ReadPFM(path, width, height, channels);
+    ImageLayout layout;
+    layout.Variance = false;
+    Image image(width, height, layout);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const float *p = data.data() + (size_t(y) * width + x) * channels;
+            image.AddSample(x, y, channels == 3 ?
+                vec3(p[0], p[1], p[2]) : vec3(p[0]));
+        }
+    }
+    return image;
+}
+
+// root mean square error over all pixels and channels
+real RMSE(const Image &a, const Image &b) {
+    if (a.Width() != b.Width() || a.Height() != b.Height()) {
+        throw std::runtime_error("image sizes differ");
+    }
+    double sum = 0;
+    for (int y = 0; y < a.Height(); y++) {
+        for (int x = 0; x < a.Width(); x++) {
+            const vec3 d = a.Color(x, y) - b.Color(x, y);
+            sum += glm::dot(d, d);
+        }
+    }
+    return std::sqrt(sum / (3.0 * a.Width() * a.Height()));
+}
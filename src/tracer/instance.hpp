@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cmath>
+#include <glm/glm.hpp>
+#include <memory>
+#include <vector>
+
+#include "box.hpp"
+#include "config.hpp"
+#include "hit.hpp"
+#include "ray.hpp"
+
+// Places a Hittable in the world with a transform that can change between
+// frames without touching the object itself, so its acceleration structure
+// (e.g. a mesh's BVH) is built once and reused. Rays are moved into
+// object space, exactly as with Embree's instance geometries.
+//
+// Emissive instances assume a similarity transform (rotation, translation
+// and uniform scale), under which solid angle pdfs are unchanged.
+class Instance : public Hittable {
+public:
+    Instance(const P_Hittable &object, const mat4 &transform = mat4(1)) :
+        m_Object(object)
+    {
+        for (const auto &emitter : object->Emitters()) {
+            m_Emitters.push_back(std::make_shared<Instance>(emitter));
+        }
+        SetTransform(transform);
+    }
+
+    void SetTransform(const mat4 &transform) {
+        m_Transform = transform;
+        m_Inverse = glm::inverse(transform);
+        m_NormalMatrix = glm::transpose(glm::inverse(mat3(transform)));
+        for (const auto &emitter : m_Emitters) {
+            emitter->SetTransform(transform);
+        }
+    }
+
+    const mat4 &Transform() const {
+        return m_Transform;
+    }
+
+    virtual bool Hit(
+        const Ray &ray, const real tmin, const real tmax, HitInfo &hit) const
+    {
+        if (!m_Object->Hit(ToObject(ray), tmin, tmax, hit)) {
+            return false;
+        }
+        hit.Position = vec3(m_Transform * vec4(hit.Position, 1));
+        hit.Normal = glm::normalize(m_NormalMatrix * hit.Normal);
+        return true;
+    }
+
+    virtual bool Medium() const {
+        return m_Object->Medium();
+    }
+
+    virtual real Transmittance(
+        const Ray &ray, const real tmin, const real tmax) const
+    {
+        return m_Object->Transmittance(ToObject(ray), tmin, tmax);
+    }
+
+    virtual bool Emits() const {
+        return m_Object->Emits();
+    }
+
+    virtual std::vector<std::shared_ptr<Hittable>> Emitters() const {
+        return std::vector<P_Hittable>(m_Emitters.begin(), m_Emitters.end());
+    }
+
+    virtual Ray RandomRay(const vec3 &o) const {
+        const vec3 local = vec3(m_Inverse * vec4(o, 1));
+        const Ray ray = m_Object->RandomRay(local);
+        return Ray(o, glm::normalize(mat3(m_Transform) * ray.Direction()));
+    }
+
+    virtual real Pdf(const Ray &ray) const {
+        return m_Object->Pdf(ToObject(ray));
+    }
+
+    virtual LightInfo EmitterInfo() const {
+        const LightInfo info = m_Object->EmitterInfo();
+        // emitted power scales with area
+        const real scale = std::cbrt(std::abs(glm::determinant(mat3(m_Transform))));
+        return LightInfo{
+            info.Bounds.Transform(m_Transform),
+            glm::normalize(m_NormalMatrix * info.Axis), info.CosTheta,
+            info.Power * scale * scale};
+    }
+
+    virtual bool BoundingBox(Box &box) const {
+        Box object;
+        if (!m_Object->BoundingBox(object)) {
+            return false;
+        }
+        box = object.Transform(m_Transform);
+        return true;
+    }
+
+private:
+    // the direction is left unnormalized so that t is the same in both spaces
+    Ray ToObject(const Ray &ray) const {
+        return Ray(
+            vec3(m_Inverse * vec4(ray.Origin(), 1)),
+            mat3(m_Inverse) * ray.Direction());
+    }
+
+    P_Hittable m_Object;
+    std::vector<std::shared_ptr<Instance>> m_Emitters;
+    mat4 m_Transform;
+    mat4 m_Inverse;
+    mat3 m_NormalMatrix;
+};
+
+typedef std::shared_ptr<Instance> P_Instance;
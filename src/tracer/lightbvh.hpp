@@ -0,0 +1,283 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <glm/gtx/norm.hpp>
+#include <unordered_map>
+#include <vector>
+
+#include "box.hpp"
+#include "config.hpp"
+#include "hit.hpp"
+#include "util.hpp"
+
+// Bounding volume hierarchy over emitters (bounds, normal cone and power
+// per node). Sample picks a light with probability roughly proportional to
+// its contribution at a shading point by descending the tree, so the cost
+// is logarithmic in the number of lights and the pmf can be recomputed.
+
+namespace {
+
+real SafeAcos(const real x) {
+    return std::acos(Clamp(x, -1, 1));
+}
+
+vec3 RotateAbout(const vec3 &v, const vec3 &axis, const real theta) {
+    const real c = std::cos(theta);
+    const real s = std::sin(theta);
+    return v * c + glm::cross(axis, v) * s + axis * glm::dot(axis, v) * (1 - c);
+}
+
+LightInfo UnionLightInfo(const LightInfo &a, const LightInfo &b) {
+    if (a.Power <= 0) {
+        return b;
+    }
+    if (b.Power <= 0) {
+        return a;
+    }
+
+    LightInfo result;
+    result.Bounds = a.Bounds.Extend(b.Bounds);
+    result.Power = a.Power + b.Power;
+    result.Axis = a.Axis;
+    result.CosTheta = -1;
+
+    if (a.CosTheta <= -1 || b.CosTheta <= -1) {
+        return result;
+    }
+
+    // smallest cone containing both cones
+    const real thetaA = SafeAcos(a.CosTheta);
+    const real thetaB = SafeAcos(b.CosTheta);
+    const real thetaD = SafeAcos(glm::dot(a.Axis, b.Axis));
+    if (std::min(thetaD + thetaB, PI) <= thetaA) {
+        result.Axis = a.Axis;
+        result.CosTheta = a.CosTheta;
+        return result;
+    }
+    if (std::min(thetaD + thetaA, PI) <= thetaB) {
+        result.Axis = b.Axis;
+        result.CosTheta = b.CosTheta;
+        return result;
+    }
+    const real thetaO = (thetaA + thetaD + thetaB) / 2;
+    if (thetaO >= PI) {
+        return result;
+    }
+    const vec3 wr = glm::cross(a.Axis, b.Axis);
+    if (glm::length2(wr) < EPS * EPS) {
+        return result;
+    }
+    result.Axis = RotateAbout(a.Axis, glm::normalize(wr), thetaO - thetaA);
+    result.CosTheta = std::cos(thetaO);
+    return result;
+}
+
+// Conservative estimate of the light reaching point p with normal n from
+// everything inside info. Pass n = 0 for points without a surface
+// (e.g. inside participating media).
+real LightImportance(const LightInfo &info, const vec3 &p, const vec3 &n) {
+    if (info.Power <= 0) {
+        return 0;
+    }
+
+    const vec3 center = info.Bounds.Center();
+    const real radius = glm::length(info.Bounds.Size()) / 2;
+    real d2 = glm::distance2(p, center);
+    d2 = std::max(d2, radius * radius / 4);
+
+    real importance = info.Power / d2;
+
+    // inside the bounds every direction is possible
+    if (info.Bounds.Contains(p) || d2 <= radius * radius) {
+        return importance;
+    }
+
+    // angle subtended by the bounds as seen from p
+    const real thetaB = std::asin(std::sqrt(radius * radius / d2));
+    const vec3 wi = glm::normalize(p - center);
+
+    // emission cone: can any normal in the cone face p?
+    if (info.CosTheta > -1) {
+        const real thetaW = SafeAcos(glm::dot(info.Axis, wi));
+        const real thetaO = SafeAcos(info.CosTheta);
+        const real theta = std::max(real(0), thetaW - thetaO - thetaB);
+        if (theta >= PI / 2) {
+            return 0;
+        }
+        importance *= std::cos(theta);
+    }
+
+    // receiver: can p see the bounds from above its surface?
+    if (glm::length2(n) > 0) {
+        const real thetaI = SafeAcos(std::abs(glm::dot(n, wi)));
+        const real theta = std::max(real(0), thetaI - thetaB);
+        importance *= std::cos(theta);
+    }
+
+    return std::max(importance, real(0));
+}
+
+}
+
+class LightBVH {
+public:
+    LightBVH() {}
+
+    LightBVH(const std::vector<P_Hittable> &lights) {
+        std::vector<Primitive> primitives;
+        for (int i = 0; i < lights.size(); i++) {
+            const LightInfo info = lights[i]->EmitterInfo();
+            if (info.Power <= 0) {
+                continue;
+            }
+            m_Lookup[lights[i].get()] = i;
+            primitives.push_back(Primitive{info, i});
+        }
+        m_Trails.resize(lights.size(), 0);
+        if (!primitives.empty()) {
+            m_Nodes.reserve(primitives.size() * 2);
+            Build(primitives, 0, primitives.size(), 0, 0);
+        }
+    }
+
+    bool Empty() const {
+        return m_Nodes.empty();
+    }
+
+    // returns the index of the chosen light (in the vector the tree was
+    // built from) or -1 when no light can contribute; u in [0, 1)
+    int Sample(const vec3 &p, const vec3 &n, real u, real &pmf) const {
+        pmf = 0;
+        if (m_Nodes.empty()) {
+            return -1;
+        }
+        if (LightImportance(m_Nodes[0].Info, p, n) <= 0) {
+            return -1;
+        }
+        int index = 0;
+        real probability = 1;
+        while (true) {
+            const Node &node = m_Nodes[index];
+            if (node.Light >= 0) {
+                pmf = probability;
+                return node.Light;
+            }
+            const real i0 = LightImportance(m_Nodes[index + 1].Info, p, n);
+            const real i1 = LightImportance(m_Nodes[node.Right].Info, p, n);
+            if (i0 <= 0 && i1 <= 0) {
+                return -1;
+            }
+            const real p0 = i0 / (i0 + i1);
+            if (u < p0) {
+                u = std::min(u / p0, real(1) - EPS);
+                probability *= p0;
+                index = index + 1;
+            } else {
+                u = std::min((u - p0) / (1 - p0), real(1) - EPS);
+                probability *= 1 - p0;
+                index = node.Right;
+            }
+        }
+    }
+
+    // probability that Sample picks the given light at p
+    real Pmf(const vec3 &p, const vec3 &n, const Hittable *light) const {
+        const auto it = m_Lookup.find(light);
+        if (it == m_Lookup.end()) {
+            return 0;
+        }
+        if (LightImportance(m_Nodes[0].Info, p, n) <= 0) {
+            return 0;
+        }
+        uint64_t trail = m_Trails[it->second];
+        int index = 0;
+        real probability = 1;
+        while (m_Nodes[index].Light < 0) {
+            const Node &node = m_Nodes[index];
+            const real i0 = LightImportance(m_Nodes[index + 1].Info, p, n);
+            const real i1 = LightImportance(m_Nodes[node.Right].Info, p, n);
+            if (i0 <= 0 && i1 <= 0) {
+                return 0;
+            }
+            if (trail & 1) {
+                probability *= i1 / (i0 + i1);
+                index = node.Right;
+            } else {
+                probability *= i0 / (i0 + i1);
+                index = index + 1;
+            }
+            trail >>= 1;
+        }
+        return probability;
+    }
+
+private:
+    struct Primitive {
+        LightInfo Info;
+        int Light;
+    };
+
+    // interior nodes store their left child at index + 1
+    struct Node {
+        LightInfo Info;
+        int Right;
+        int Light;
+    };
+
+    int Build(
+        std::vector<Primitive> &primitives, const int start, const int end,
+        const uint64_t trail, const int depth)
+    {
+        const int index = m_Nodes.size();
+        m_Nodes.push_back(Node());
+
+        if (end - start == 1) {
+            const Primitive &primitive = primitives[start];
+            m_Nodes[index] = Node{primitive.Info, -1, primitive.Light};
+            m_Trails[primitive.Light] = trail;
+            return index;
+        }
+
+        // split at the centroid median along the widest axis; the tree is
+        // balanced so the trail of left/right turns always fits in 64 bits
+        Box centroids(
+            primitives[start].Info.Bounds.Center(),
+            primitives[start].Info.Bounds.Center());
+        for (int i = start + 1; i < end; i++) {
+            const vec3 c = primitives[i].Info.Bounds.Center();
+            centroids = centroids.Extend(Box(c, c));
+        }
+        const vec3 size = centroids.Size();
+        int axis = 0;
+        if (size.y > size[axis]) {
+            axis = 1;
+        }
+        if (size.z > size[axis]) {
+            axis = 2;
+        }
+        const int mid = (start + end) / 2;
+        std::nth_element(
+            primitives.begin() + start, primitives.begin() + mid,
+            primitives.begin() + end,
+            [axis](const Primitive &a, const Primitive &b) {
+                return a.Info.Bounds.Center()[axis] <
+                    b.Info.Bounds.Center()[axis];
+            });
+
+        Build(primitives, start, mid, trail, depth + 1);
+        const int right = Build(
+            primitives, mid, end, trail | (uint64_t(1) << depth), depth + 1);
+
+        const LightInfo info = UnionLightInfo(
+            m_Nodes[index + 1].Info, m_Nodes[right].Info);
+        m_Nodes[index] = Node{info, right, -1};
+        return index;
+    }
+
+    std::vector<Node> m_Nodes;
+    std::vector<uint64_t> m_Trails;
+    std::unordered_map<const Hittable *, int> m_Lookup;
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <glm/glm.hpp>
 #include <iostream>
 #include <memory>
@@ -12,6 +13,9 @@
 
 class Material {
 public:
+    Material() :
+        m_ID(NextID()) {}
+
     virtual vec3 f(
         const vec3 &p,
         const vec3 &wo, const vec3 &wi) const = 0;
@@ -51,7 +55,30 @@ public:
         return false;
     }
 
+    // phase functions scatter in all directions and have no cosine term
+    virtual bool Volumetric() const {
+        return false;
+    }
+
+    // reflectance at p, used for albedo outputs and denoising guides
+    virtual vec3 Albedo(const vec3 &p) const {
+        return vec3(1);
+    }
+
+    // unique per material instance, for material ID outputs
+    int ID() const {
+        return m_ID;
+    }
+
     virtual ~Material() {}
+
+private:
+    static int NextID() {
+        static std::atomic<int> next(0);
+        return next++;
+    }
+
+    int m_ID;
 };
 
 typedef std::shared_ptr<Material> P_Material;
@@ -64,8 +91,7 @@ public:
     virtual vec3 f(
         const vec3 &p, const vec3 &wo, const vec3 &wi) const
     {
-        return vec3();
-        // return m_Albedo->Sample(0, 0, p) / (2 * PI);
+        return m_Albedo->Sample(0, 0, p) * real(0.25 / PI);
     }
 
     virtual vec3 Sample_f(
@@ -73,17 +99,21 @@ public:
         vec3 &wi, real &pdf, bool &specular) const
     {
         wi = glm::normalize(RandomInUnitSphere());
-        pdf = 1;
-        specular = true;
-        return m_Albedo->Sample(0, 0, p);
-        // pdf = Pdf(wo, wi);
-        // specular = false;
-        // return f(p, wo, wi);
+        pdf = Pdf(wo, wi);
+        specular = false;
+        return f(p, wo, wi);
     }
 
     virtual real Pdf(const vec3 &wo, const vec3 &wi) const {
-        return 0;
-        // return 0.25 / PI;
+        return 0.25 / PI;
+    }
+
+    virtual bool Volumetric() const {
+        return true;
+    }
+
+    virtual vec3 Albedo(const vec3 &p) const {
+        return m_Albedo->Sample(0, 0, p);
     }
 
 private:
@@ -155,6 +185,10 @@ public:
         return f(p, wo, wi);
     }
 
+    virtual vec3 Albedo(const vec3 &p) const {
+        return m_Rd->Sample(0, 0, p);
+    }
+
 private:
     P_Texture m_Rd;
     P_Texture m_Rs;
@@ -203,6 +237,10 @@ public:
         return f(p, wo, wi);
     }
 
+    virtual vec3 Albedo(const vec3 &p) const {
+        return m_Albedo->Sample(0, 0, p);
+    }
+
 private:
     P_Texture m_Albedo;
     P_MicrofacetDistribution m_Distribution;
@@ -234,6 +272,10 @@ public:
         return m_Albedo->Sample(0, 0, p);
     }
 
+    virtual vec3 Albedo(const vec3 &p) const {
+        return m_Albedo->Sample(0, 0, p);
+    }
+
 private:
     P_Texture m_Albedo;
 };
@@ -252,6 +294,11 @@ public:
         const real horizonScatter = std::pow(sinThetaO, m_Factor);
         return horizonScatter * cosThetaI * m_Albedo->Sample(0, 0, p) / PI;
     }
+
+    virtual vec3 Albedo(const vec3 &p) const {
+        return m_Albedo->Sample(0, 0, p);
+    }
+
 private:
     P_Texture m_Albedo;
     real m_Factor;
@@ -305,6 +352,10 @@ public:
         return m_Albedo->Sample(0, 0, p);
     }
 
+    virtual vec3 Albedo(const vec3 &p) const {
+        return m_Albedo->Sample(0, 0, p);
+    }
+
 private:
     P_Texture m_Albedo;
     real m_Eta;
@@ -336,6 +387,10 @@ public:
         return 0;
     }
 
+    virtual vec3 Albedo(const vec3 &p) const {
+        return m_Albedo->Sample(0, 0, p);
+    }
+
 private:
     P_Texture m_Albedo;
     real m_Eta;
@@ -352,6 +407,10 @@ public:
         return m_Albedo->Sample(0, 0, p) / PI;
     }
 
+    virtual vec3 Albedo(const vec3 &p) const {
+        return m_Albedo->Sample(0, 0, p);
+    }
+
 private:
     P_Texture m_Albedo;
 };
@@ -393,6 +452,10 @@ public:
             (m_A + m_B * maxcos * sinalpha * tanbeta) / PI;
     }
 
+    virtual vec3 Albedo(const vec3 &p) const {
+        return m_Albedo->Sample(0, 0, p);
+    }
+
 private:
     P_Texture m_Albedo;
     real m_A, m_B;
@@ -432,6 +495,10 @@ public:
         return true;
     }
 
+    virtual vec3 Albedo(const vec3 &p) const {
+        return m_Emit->Sample(0, 0, p);
+    }
+
 private:
     P_Texture m_Emit;
 };
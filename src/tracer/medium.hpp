@@ -1,9 +1,15 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
 #include <glm/glm.hpp>
+#include <glm/gtx/component_wise.hpp>
+#include <vector>
 
+#include "box.hpp"
 #include "config.hpp"
 #include "hit.hpp"
+#include "volume.hpp"
 
 class ConstantMedium : public Hittable {
 public:
@@ -14,6 +20,35 @@ public:
     m_Material(std::make_shared<Isotropic>(texture)),
     m_Density(density) {}
 
+    virtual bool Medium() const {
+        return true;
+    }
+
+    virtual real Transmittance(
+        const Ray &ray, const real tmin, const real tmax) const
+    {
+        HitInfo boundaryHit;
+        if (!m_Boundary->Hit(ray, tmin, INF, boundaryHit)) {
+            return 1;
+        }
+        real t0 = tmin;
+        real t1 = boundaryHit.T;
+        if (glm::dot(ray.Direction(), boundaryHit.Normal) <= 0) {
+            // entering: find where the ray leaves again
+            t0 = boundaryHit.T;
+            if (!m_Boundary->Hit(ray, t0 + EPS, INF, boundaryHit)) {
+                return 1;
+            }
+            t1 = boundaryHit.T;
+        }
+        t1 = std::min(t1, tmax);
+        if (t0 >= t1) {
+            return 1;
+        }
+        const real distance = (t1 - t0) * glm::length(ray.Direction());
+        return std::exp(-m_Density * distance);
+    }
+
     virtual bool Hit(
         const Ray &ray, const real tmin, const real tmax, HitInfo &hit) const
     {
@@ -80,3 +115,182 @@ private:
     P_Material m_Material;
     real m_Density;
 };
+
+// Heterogeneous medium defined by a density grid stretched over a box.
+// Free-flight sampling uses delta tracking and shadow rays ratio tracking,
+// both against a coarse grid of per-cell density maxima (majorants) that is
+// walked with a 3D DDA so empty and thin regions are skipped cheaply.
+class GridMedium : public Hittable {
+public:
+    GridMedium(
+        const Box &bounds, const P_DensityGrid &grid,
+        const P_Texture &texture, const real density,
+        const int majorantResolution = 16) :
+    m_Bounds(bounds),
+    m_Grid(grid),
+    m_Material(std::make_shared<Isotropic>(texture)),
+    m_Density(density),
+    m_Resolution(majorantResolution)
+    {
+        const int n = m_Resolution;
+        m_Majorants.resize(n * n * n);
+        for (int z = 0; z < n; z++) {
+            for (int y = 0; y < n; y++) {
+                for (int x = 0; x < n; x++) {
+                    const vec3 lo = vec3(x, y, z) / real(n);
+                    const vec3 hi = vec3(x + 1, y + 1, z + 1) / real(n);
+                    m_Majorants[(z * n + y) * n + x] =
+                        m_Grid->MaxDensity(lo, hi) * m_Density;
+                }
+            }
+        }
+    }
+
+    virtual bool Medium() const {
+        return true;
+    }
+
+    virtual bool Hit(
+        const Ray &ray, const real tmin, const real tmax, HitInfo &hit) const
+    {
+        real t0, t1;
+        if (!Clip(ray, tmin, tmax, t0, t1)) {
+            return false;
+        }
+        const real length = glm::length(ray.Direction());
+        bool result = false;
+        Traverse(ray, t0, t1, [&](const real a, const real b, const real majorant) {
+            if (majorant <= 0) {
+                return true;
+            }
+            real t = a;
+            while (true) {
+                t -= std::log(1 - Random()) / (majorant * length);
+                if (t >= b) {
+                    return true;
+                }
+                if (Random() * majorant < DensityAt(ray.At(t))) {
+                    hit.T = t;
+                    result = true;
+                    return false;
+                }
+            }
+        });
+        if (result) {
+            hit.Position = ray.At(hit.T);
+            hit.Normal = vec3(0, 0, 1);
+            hit.Material = m_Material;
+        }
+        return result;
+    }
+
+    virtual real Transmittance(
+        const Ray &ray, const real tmin, const real tmax) const
+    {
+        real t0, t1;
+        if (!Clip(ray, tmin, tmax, t0, t1)) {
+            return 1;
+        }
+        const real length = glm::length(ray.Direction());
+        real result = 1;
+        Traverse(ray, t0, t1, [&](const real a, const real b, const real majorant) {
+            if (majorant <= 0) {
+                return true;
+            }
+            real t = a;
+            while (true) {
+                t -= std::log(1 - Random()) / (majorant * length);
+                if (t >= b) {
+                    return true;
+                }
+                result *= 1 - DensityAt(ray.At(t)) / majorant;
+                // russian roulette once the estimate gets small
+                if (result < 0.1) {
+                    const real q = 1 - result;
+                    if (Random() < q) {
+                        result = 0;
+                        return false;
+                    }
+                    result /= 1 - q;
+                }
+            }
+        });
+        return result;
+    }
+
+private:
+    real DensityAt(const vec3 &p) const {
+        const vec3 uvw = (p - m_Bounds.Min()) / m_Bounds.Size();
+        return m_Grid->Density(uvw) * m_Density;
+    }
+
+    bool Clip(
+        const Ray &ray, const real tmin, const real tmax,
+        real &t0, real &t1) const
+    {
+        const vec3 n = (m_Bounds.Min() - ray.Origin()) / ray.Direction();
+        const vec3 f = (m_Bounds.Max() - ray.Origin()) / ray.Direction();
+        t0 = std::max(tmin, glm::compMax(glm::min(n, f)));
+        t1 = std::min(tmax, glm::compMin(glm::max(n, f)));
+        return t0 < t1;
+    }
+
+    // calls visit(a, b, majorant) for each majorant cell the ray crosses
+    // between t0 and t1 until visit returns false
+    template <typename F>
+    void Traverse(const Ray &ray, const real t0, const real t1, F visit) const {
+        const int n = m_Resolution;
+        const vec3 scale = real(n) / m_Bounds.Size();
+        const vec3 o = (ray.Origin() - m_Bounds.Min()) * scale;
+        const vec3 d = ray.Direction() * scale;
+        const vec3 p = o + d * t0;
+
+        int cell[3], step[3];
+        real next[3], delta[3];
+        for (int axis = 0; axis < 3; axis++) {
+            cell[axis] = std::min(std::max(int(std::floor(p[axis])), 0), n - 1);
+            if (d[axis] > 0) {
+                step[axis] = 1;
+                next[axis] = t0 + (cell[axis] + 1 - p[axis]) / d[axis];
+                delta[axis] = 1 / d[axis];
+            } else if (d[axis] < 0) {
+                step[axis] = -1;
+                next[axis] = t0 + (cell[axis] - p[axis]) / d[axis];
+                delta[axis] = -1 / d[axis];
+            } else {
+                step[axis] = 0;
+                next[axis] = INF;
+                delta[axis] = INF;
+            }
+        }
+
+        real t = t0;
+        while (t < t1) {
+            int axis = 0;
+            if (next[1] < next[axis]) {
+                axis = 1;
+            }
+            if (next[2] < next[axis]) {
+                axis = 2;
+            }
+            const real end = std::min(next[axis], t1);
+            const int i = (cell[2] * n + cell[1]) * n + cell[0];
+            if (!visit(t, end, m_Majorants[i])) {
+                return;
+            }
+            t = end;
+            cell[axis] += step[axis];
+            if (cell[axis] < 0 || cell[axis] >= n) {
+                return;
+            }
+            next[axis] += delta[axis];
+        }
+    }
+
+    Box m_Bounds;
+    P_DensityGrid m_Grid;
+    P_Material m_Material;
+    real m_Density;
+    int m_Resolution;
+    std::vector<real> m_Majorants;
+};
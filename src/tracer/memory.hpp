@@ -0,0 +1,179 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+#include "../vendor/json.hpp"
+
+// Memory held by each subsystem, and an optional budget for all of them.
+// Meshes, built in BVHs, images and volumes charge what they allocate
+// through a MemoryCharge member; Embree reports its BVHs and geometry
+// buffers through the device memory monitor (see MonitorDeviceMemory).
+//
+// With a budget set, loaders check their estimated needs up front and
+// throw, so a job that cannot fit fails at load time instead of being
+// killed mid-render. Where there is a smaller representation it is used
+// instead: images drop variance and store planes as halves, and BVHs are
+// rebuilt with Embree's compact flag at low quality.
+enum MemoryCategory {
+    MemoryMeshes,
+    MemoryEmbree,
+    MemoryBVH,
+    MemoryImages,
+    MemoryVolumes,
+    NumMemoryCategories
+};
+
+class MemoryTracker {
+public:
+    // never destroyed, as charges may be released during exit
+    static MemoryTracker &Shared() {
+        static MemoryTracker *tracker = new MemoryTracker();
+        return *tracker;
+    }
+
+    // bytes over all categories; 0 disables the budget
+    void SetBudget(const int64_t bytes) {
+        m_Budget = bytes;
+    }
+
+    int64_t Budget() const {
+        return m_Budget.load();
+    }
+
+    // whether bytes more would stay within the budget
+    bool Fits(const int64_t bytes) const {
+        return m_Budget <= 0 || Total() + bytes <= m_Budget;
+    }
+
+    // throws unless bytes more fit; what names the allocation
+    void Require(const int64_t bytes, const std::string &what) const {
+        if (!Fits(bytes)) {
+            throw std::runtime_error(
+                "memory budget exceeded: " + what + " needs " +
+                MB(bytes) + " MB with " + MB(Total()) + " of " +
+                MB(Budget()) + " MB in use");
+        }
+    }
+
+    // adds bytes (or releases them when negative) without checking the
+    // budget, and returns whether the total is still within it
+    bool Add(const MemoryCategory category, const int64_t bytes) {
+        Counter &counter = m_Counters[category];
+        const int64_t value = counter.Bytes.fetch_add(bytes) + bytes;
+        int64_t peak = counter.Peak.load();
+        while (value > peak && !counter.Peak.compare_exchange_weak(peak, value)) {
+        }
+        return m_Budget <= 0 || Total() <= m_Budget;
+    }
+
+    int64_t Bytes(const MemoryCategory category) const {
+        return m_Counters[category].Bytes.load();
+    }
+
+    int64_t Peak(const MemoryCategory category) const {
+        return m_Counters[category].Peak.load();
+    }
+
+    int64_t Total() const {
+        int64_t result = 0;
+        for (int i = 0; i < NumMemoryCategories; i++) {
+            result += m_Counters[i].Bytes.load();
+        }
+        return result;
+    }
+
+    void Print() const {
+        printf("  memory:");
+        for (int i = 0; i < NumMemoryCategories; i++) {
+            printf(" %s %s MB (peak %s),", Name(i),
+                MB(m_Counters[i].Bytes.load()).c_str(),
+                MB(m_Counters[i].Peak.load()).c_str());
+        }
+        printf(" total %s MB", MB(Total()).c_str());
+        if (m_Budget > 0) {
+            printf(" of %s MB", MB(Budget()).c_str());
+        }
+        printf("\n");
+    }
+
+    nlohmann::json ToJSON() const {
+        nlohmann::json result = {{"total", Total()}, {"budget", Budget()}};
+        for (int i = 0; i < NumMemoryCategories; i++) {
+            result[Name(i)] = {
+                {"bytes", m_Counters[i].Bytes.load()},
+                {"peak", m_Counters[i].Peak.load()}};
+        }
+        return result;
+    }
+
+private:
+    struct Counter {
+        std::atomic<int64_t> Bytes{0};
+        std::atomic<int64_t> Peak{0};
+    };
+
+    MemoryTracker() : m_Budget(0) {}
+
+    static const char *Name(const int category) {
+        static const char *names[] = {"meshes", "embree", "bvh", "images", "volumes"};
+        return names[category];
+    }
+
+    static std::string MB(const int64_t bytes) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.1f", bytes / (1024.0 * 1024.0));
+        return buf;
+    }
+
+    std::atomic<int64_t> m_Budget;
+    Counter m_Counters[NumMemoryCategories];
+};
+
+// Bytes held by one object in one category, released on destruction.
+// Copies charge again and moves transfer the charge.
+class MemoryCharge {
+public:
+    explicit MemoryCharge(const MemoryCategory category) :
+        m_Category(category), m_Bytes(0) {}
+
+    MemoryCharge(const MemoryCharge &other) :
+        m_Category(other.m_Category), m_Bytes(0)
+    {
+        Set(other.m_Bytes);
+    }
+
+    MemoryCharge(MemoryCharge &&other) :
+        m_Category(other.m_Category), m_Bytes(other.m_Bytes)
+    {
+        other.m_Bytes = 0;
+    }
+
+    MemoryCharge &operator=(const MemoryCharge &other) {
+        Set(other.m_Bytes);
+        return *this;
+    }
+
+    MemoryCharge &operator=(MemoryCharge &&other) {
+        Set(0);
+        m_Bytes = other.m_Bytes;
+        other.m_Bytes = 0;
+        return *this;
+    }
+
+    ~MemoryCharge() {
+        Set(0);
+    }
+
+    void Set(const size_t bytes) {
+        MemoryTracker::Shared().Add(m_Category, int64_t(bytes) - int64_t(m_Bytes));
+        m_Bytes = bytes;
+    }
+
+private:
+    MemoryCategory m_Category;
+    size_t m_Bytes;
+};
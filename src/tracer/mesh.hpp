@@ -1,36 +1,145 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/component_wise.hpp>
 #include <glm/gtx/hash.hpp>
 #include <glm/gtx/normal.hpp>
 #include <memory>
+#include <stdexcept>
+#include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "box.hpp"
 #include "config.hpp"
+#include "memory.hpp"
+#include "parallel.hpp"
+#include "trace.hpp"
+#include "util.hpp"
+
+// Vertex data as parsed by a loader, before welding. Triangles are
+// consecutive triples of corners. Corner i is at
+// Positions[PositionIndices[i]], or at Positions[i] when there are no
+// PositionIndices (a triangle soup, as in STL, which has positions only).
+// Normals and UVs are optional, indexed per corner by NormalIndices and
+// UVIndices (as in OBJ) or, when those are empty, like the positions (as
+// in PLY).
+struct MeshData {
+    std::vector<vec3> Positions;
+    std::vector<vec3> Normals;
+    std::vector<vec2> UVs;
+    std::vector<int> PositionIndices;
+    std::vector<int> NormalIndices;
+    std::vector<int> UVIndices;
+};
 
 class Mesh {
 public:
-    Mesh(const std::vector<vec3> &data) {
-        // deduplicate vertices
-        std::unordered_map<vec3, int> lookup;
-        for (const vec3 &v : data) {
-            if (lookup.find(v) == lookup.end()) {
-                lookup[v] = m_Positions.size();
-                m_Positions.push_back(v);
+    Mesh(const std::vector<vec3> &data) :
+        Mesh(MeshData{data, {}, {}, {}, {}, {}}) {}
+
+    // Welds data into indexed vertices: corners with the same position,
+    // normal and uv share a vertex. Soup positions are welded by value.
+    Mesh(const MeshData &data) : m_Charge(MemoryMeshes) {
+        TraceSpan span("Mesh::Weld", "load");
+        const bool soup = data.PositionIndices.empty();
+        const int numCorners = soup ?
+            data.Positions.size() : data.PositionIndices.size();
+        if (numCorners % 3) {
+            throw std::runtime_error("corner count is not a multiple of 3");
+        }
+        const auto check = [numCorners](
+            const std::vector<int> &indices, const int size, const char *what)
+        {
+            if (!indices.empty() && indices.size() != numCorners) {
+                throw std::runtime_error(std::string("missing ") + what + " indices");
+            }
+            for (const int i : indices) {
+                if (i < 0 || i >= size) {
+                    throw std::runtime_error(std::string(what) + " index out of range");
+                }
+            }
+        };
+        check(data.PositionIndices, data.Positions.size(), "position");
+        check(data.NormalIndices, data.Normals.size(), "normal");
+        check(data.UVIndices, data.UVs.size(), "uv");
+        const auto matchesPositions = [&](const size_t size) {
+            return size == 0 || (!soup && size == data.Positions.size());
+        };
+        if ((data.NormalIndices.empty() && !matchesPositions(data.Normals.size())) ||
+            (data.UVIndices.empty() && !matchesPositions(data.UVs.size())))
+        {
+            throw std::runtime_error("vertex attribute count mismatch");
+        }
+
+        // position of each corner, welding soups by value
+        std::vector<int> positionIndices;
+        std::vector<vec3> positions;
+        if (soup) {
+            std::unordered_map<vec3, int> lookup;
+            lookup.reserve(numCorners / 2);
+            positionIndices.resize(numCorners);
+            for (int i = 0; i < numCorners; i++) {
+                const vec3 &v = data.Positions[i];
+                const auto it = lookup.find(v);
+                if (it != lookup.end()) {
+                    positionIndices[i] = it->second;
+                    continue;
+                }
+                positionIndices[i] = lookup[v] = positions.size();
+                positions.push_back(v);
             }
         }
+        const std::vector<int> &corners =
+            soup ? positionIndices : data.PositionIndices;
 
-        // create triangles
-        for (int i = 0; i < data.size(); i += 3) {
-            const int i0 = lookup[data[i + 0]];
-            const int i1 = lookup[data[i + 1]];
-            const int i2 = lookup[data[i + 2]];
-            m_Triangles.emplace_back(i0, i1, i2);
+        if (data.NormalIndices.empty() && data.UVIndices.empty()) {
+            // attributes follow the positions: vertices are the positions
+            m_Positions = soup ? std::move(positions) : data.Positions;
+            m_Normals = data.Normals;
+            m_UVs = data.UVs;
+            m_Triangles.resize(numCorners / 3);
+            ParallelFor(m_Triangles.size(), 0, [&](const int i) {
+                m_Triangles[i] = glm::ivec3(
+                    corners[i * 3], corners[i * 3 + 1], corners[i * 3 + 2]);
+            }, 4096);
+        } else {
+            // one vertex per distinct (position, normal, uv) of the corners
+            const auto attribute = [&](const std::vector<int> &indices,
+                const size_t size, const int corner)
+            {
+                return !indices.empty() ? indices[corner] :
+                    size ? corners[corner] : -1;
+            };
+            std::unordered_map<glm::ivec3, int> lookup;
+            lookup.reserve(numCorners / 2);
+            m_Triangles.resize(numCorners / 3);
+            for (int i = 0; i < numCorners; i++) {
+                const glm::ivec3 key(corners[i],
+                    attribute(data.NormalIndices, data.Normals.size(), i),
+                    attribute(data.UVIndices, data.UVs.size(), i));
+                auto it = lookup.find(key);
+                if (it == lookup.end()) {
+                    it = lookup.emplace(key, m_Positions.size()).first;
+                    m_Positions.push_back(data.Positions[key.x]);
+                    if (key.y >= 0) {
+                        m_Normals.push_back(data.Normals[key.y]);
+                    }
+                    if (key.z >= 0) {
+                        m_UVs.push_back(data.UVs[key.z]);
+                    }
+                }
+                m_Triangles[i / 3][i % 3] = it->second;
+            }
         }
+        m_Bounds = ComputeBounds();
+        m_Charge.Set(Bytes());
     }
 
     const std::vector<vec3> &Positions() const {
@@ -41,38 +150,226 @@ public:
         return m_Normals;
     }
 
+    // empty unless loaded with texture coordinates
+    const std::vector<vec2> &UVs() const {
+        return m_UVs;
+    }
+
     const std::vector<glm::ivec3> &Triangles() const {
         return m_Triangles;
     }
 
-    void SmoothNormals() {
-        m_Normals.resize(m_Positions.size(), vec3(0));
-        for (const auto &t : m_Triangles) {
-            const vec3 v1 = m_Positions[t.x];
-            const vec3 v2 = m_Positions[t.y];
-            const vec3 v3 = m_Positions[t.z];
-            const vec3 n = glm::triangleNormal(v1, v2, v3);
-            m_Normals[t.x] += n;
-            m_Normals[t.y] += n;
-            m_Normals[t.z] += n;
+    size_t Bytes() const {
+        return m_Positions.capacity() * sizeof(vec3) +
+            m_Normals.capacity() * sizeof(vec3) +
+            m_UVs.capacity() * sizeof(vec2) +
+            m_Triangles.capacity() * sizeof(glm::ivec3);
+    }
+
+    // Sets vertex normals to the mean normal of the faces around each
+    // vertex. Faces meeting at more than creaseAngle (radians) keep a hard
+    // edge: a vertex whose faces fall into groups with different normals
+    // is split into one vertex per group, each face averaging only the
+    // faces within creaseAngle of its own.
+    //
+    // Face corners are scattered into per vertex lists in parallel, then
+    // each vertex gathers its normals independently. The lists are sorted
+    // into triangle order, so without creases (the default) the sums are
+    // bit for bit those of a serial pass over the triangles.
+    void SmoothNormals(const real creaseAngle = PI) {
+        TraceSpan span("SmoothNormals", "load");
+        const bool creases = creaseAngle < PI;
+        const int numVertices = m_Positions.size();
+        const int numTriangles = m_Triangles.size();
+        MemoryTracker::Shared().Require(
+            numVertices * (sizeof(vec3) + 3 * sizeof(int)) +
+            numTriangles * (sizeof(vec3) + 3 * sizeof(int)), "vertex normals");
+
+        std::vector<vec3> faceNormals(numTriangles);
+        std::vector<std::atomic<int>> counts(numVertices);
+        ParallelFor(numTriangles, 0, [&](const int i) {
+            const auto &t = m_Triangles[i];
+            const vec3 &v1 = m_Positions[t.x];
+            const vec3 &v2 = m_Positions[t.y];
+            const vec3 &v3 = m_Positions[t.z];
+            if (creases) {
+                const vec3 n = glm::cross(v2 - v1, v3 - v1);
+                const real length = glm::length(n);
+                faceNormals[i] = length > 0 ? n / length : vec3(0);
+            } else {
+                faceNormals[i] = glm::triangleNormal(v1, v2, v3);
+            }
+            for (int k = 0; k < 3; k++) {
+                counts[t[k]].fetch_add(1, std::memory_order_relaxed);
+            }
+        }, 4096);
+
+        // corners (3 * triangle + k) around vertex v are
+        // corners[offsets[v]] to corners[offsets[v + 1]]
+        std::vector<int> offsets(numVertices + 1);
+        for (int v = 0; v < numVertices; v++) {
+            offsets[v + 1] = offsets[v] + counts[v].load(std::memory_order_relaxed);
+            counts[v].store(offsets[v], std::memory_order_relaxed);
         }
-        for (int i = 0; i < m_Normals.size(); i++) {
-            m_Normals[i] = glm::normalize(m_Normals[i]);
+        std::vector<int> corners(offsets[numVertices]);
+        ParallelFor(numTriangles, 0, [&](const int i) {
+            const auto &t = m_Triangles[i];
+            for (int k = 0; k < 3; k++) {
+                const int slot = counts[t[k]].fetch_add(1, std::memory_order_relaxed);
+                corners[slot] = 3 * i + k;
+            }
+        }, 4096);
+        counts = std::vector<std::atomic<int>>();
+
+        if (!creases) {
+            m_Normals.resize(numVertices);
+            ParallelFor(numVertices, 0, [&](const int v) {
+                int *begin = corners.data() + offsets[v];
+                int *end = corners.data() + offsets[v + 1];
+                // the scatter order varies from run to run
+                std::sort(begin, end);
+                vec3 sum(0);
+                for (const int *p = begin; p != end; p++) {
+                    sum += faceNormals[*p / 3];
+                }
+                m_Normals[v] = glm::normalize(sum);
+            }, 1024);
+            m_Charge.Set(Bytes());
+            return;
         }
-    }
 
-    // TODO: cache bounding box?
-    Box BoundingBox() const {
-        if (m_Positions.empty()) {
-            return Box();
+        const real cosCrease = std::cos(creaseAngle);
+        // normal of corner c of the list begin to end
+        const auto cornerNormal = [&](const int *begin, const int *end, const int c) {
+            const vec3 &n = faceNormals[c / 3];
+            vec3 sum(0);
+            for (const int *p = begin; p != end; p++) {
+                const vec3 &m = faceNormals[*p / 3];
+                if (glm::dot(n, m) >= cosCrease) {
+                    sum += m;
+                }
+            }
+            const real length = glm::length(sum);
+            return length > 0 ? sum / length : n;
+        };
+
+        // vertices split at creases get new indices after the existing ones
+        std::vector<int> extra(numVertices + 1);
+        ParallelFor(numVertices, 0, [&](const int v) {
+            int *begin = corners.data() + offsets[v];
+            int *end = corners.data() + offsets[v + 1];
+            // the scatter order varies from run to run
+            std::sort(begin, end);
+            static thread_local std::vector<vec3> normals;
+            normals.clear();
+            for (const int *p = begin; p != end; p++) {
+                const vec3 n = cornerNormal(begin, end, *p);
+                if (std::find(normals.begin(), normals.end(), n) == normals.end()) {
+                    normals.push_back(n);
+                }
+            }
+            extra[v + 1] = std::max(0, int(normals.size()) - 1);
+        }, 1024);
+        for (int v = 0; v < numVertices; v++) {
+            extra[v + 1] += extra[v];
         }
-        vec3 min = m_Positions[0];
-        vec3 max = m_Positions[0];
-        for (const vec3 &v : m_Positions) {
-            min = glm::min(min, v);
-            max = glm::max(max, v);
+
+        const int total = numVertices + extra[numVertices];
+        m_Positions.resize(total);
+        m_Normals.assign(total, vec3(0));
+        if (!m_UVs.empty()) {
+            m_UVs.resize(total);
+        }
+        ParallelFor(numVertices, 0, [&](const int v) {
+            const int *begin = corners.data() + offsets[v];
+            const int *end = corners.data() + offsets[v + 1];
+            static thread_local std::vector<vec3> normals;
+            normals.clear();
+            for (const int *p = begin; p != end; p++) {
+                const vec3 n = cornerNormal(begin, end, *p);
+                const int group = std::find(normals.begin(), normals.end(), n) -
+                    normals.begin();
+                if (group == normals.size()) {
+                    normals.push_back(n);
+                }
+                const int index = group ?
+                    numVertices + extra[v] + group - 1 : v;
+                m_Positions[index] = m_Positions[v];
+                m_Normals[index] = n;
+                if (!m_UVs.empty()) {
+                    m_UVs[index] = m_UVs[v];
+                }
+                // each corner belongs to one vertex, so no two threads
+                // write the same index
+                m_Triangles[*p / 3][*p % 3] = index;
+            }
+        }, 1024);
+        m_Charge.Set(Bytes());
+    }
+
+    // Sorts the triangles along a Morton curve through their centroids and
+    // renumbers the vertices in order of first use, so that triangles near
+    // each other, and their vertices, are near each other in memory. Hit
+    // shading then reads fewer cache lines, which matters for large scans
+    // whose STL order is arbitrary. Unused vertices are dropped.
+    void Reorder() {
+        TraceSpan span("Mesh::Reorder", "load", "triangles", m_Triangles.size());
+        const int n = m_Triangles.size();
+        MemoryTracker::Shared().Require(
+            n * (sizeof(std::pair<uint64_t, int>) + sizeof(glm::ivec3)) +
+            m_Positions.size() * (sizeof(int) + sizeof(vec3)) +
+            m_Normals.size() * sizeof(vec3) + m_UVs.size() * sizeof(vec2),
+            "mesh reorder");
+
+        const Box box = BoundingBox();
+        const real cells = 1 << 21;
+        const vec3 scale = cells / glm::max(box.Size(), vec3(EPS));
+        std::vector<std::pair<uint64_t, int>> keys(n);
+        ParallelFor(n, 0, [&](const int i) {
+            const auto &t = m_Triangles[i];
+            const vec3 c = (m_Positions[t.x] + m_Positions[t.y] +
+                m_Positions[t.z]) / real(3);
+            const vec3 q = glm::clamp((c - box.Min()) * scale, vec3(0), vec3(cells - 1));
+            keys[i] = std::make_pair(MortonCode(q.x, q.y, q.z), i);
+        }, 4096);
+        std::sort(keys.begin(), keys.end());
+
+        std::vector<int> remap(m_Positions.size(), -1);
+        std::vector<vec3> positions;
+        std::vector<vec3> normals;
+        std::vector<vec2> uvs;
+        std::vector<glm::ivec3> triangles(n);
+        positions.reserve(m_Positions.size());
+        normals.reserve(m_Normals.size());
+        uvs.reserve(m_UVs.size());
+        for (int i = 0; i < n; i++) {
+            const auto &t = m_Triangles[keys[i].second];
+            for (int k = 0; k < 3; k++) {
+                int &index = remap[t[k]];
+                if (index < 0) {
+                    index = positions.size();
+                    positions.push_back(m_Positions[t[k]]);
+                    if (!m_Normals.empty()) {
+                        normals.push_back(m_Normals[t[k]]);
+                    }
+                    if (!m_UVs.empty()) {
+                        uvs.push_back(m_UVs[t[k]]);
+                    }
+                }
+                triangles[i][k] = index;
+            }
         }
-        return Box(min, max);
+        m_Positions.swap(positions);
+        m_Normals.swap(normals);
+        m_UVs.swap(uvs);
+        m_Triangles.swap(triangles);
+        m_Bounds = ComputeBounds();
+        m_Charge.Set(Bytes());
+    }
+
+    // cached; recomputed by every change to the positions
+    const Box &BoundingBox() const {
+        return m_Bounds;
     }
 
     vec3 TriangleNormalAt(const int index, const vec3 &position) const {
@@ -90,13 +387,29 @@ public:
         return n1 * b.x + n2 * b.y + n3 * b.z;
     }
 
+    real TriangleArea(const int index) const {
+        const auto t = m_Triangles[index];
+        const vec3 v1 = m_Positions[t.x];
+        const vec3 v2 = m_Positions[t.y];
+        const vec3 v3 = m_Positions[t.z];
+        return glm::length(glm::cross(v2 - v1, v3 - v1)) / 2;
+    }
+
+    vec3 RandomPointOnTriangle(const int index) const {
+        const auto t = m_Triangles[index];
+        return RandomInTriangle(
+            m_Positions[t.x], m_Positions[t.y], m_Positions[t.z]);
+    }
+
     void Transform(const mat4 &m) {
-        for (int i = 0; i < m_Positions.size(); i++) {
+        TraceSpan span("Mesh::Transform", "load", "vertices", m_Positions.size());
+        ParallelFor(m_Positions.size(), 0, [&](const int i) {
             m_Positions[i] = vec3(m * vec4(m_Positions[i], real(1)));
-        }
-        for (int i = 0; i < m_Normals.size(); i++) {
+        }, 4096);
+        ParallelFor(m_Normals.size(), 0, [&](const int i) {
             m_Normals[i] = vec3(m * vec4(m_Normals[i], real(0)));
-        }
+        }, 4096);
+        m_Bounds = ComputeBounds();
     }
 
     mat4 MoveTo(const vec3 &position, const vec3 &anchor) {
@@ -140,9 +453,53 @@ public:
     }
 
 private:
+    // bounds of the positions, reduced over chunks in parallel
+    Box ComputeBounds() const {
+        const int n = m_Positions.size();
+        if (n == 0) {
+            return Box();
+        }
+        const int chunkSize = 1 << 16;
+        const int numChunks = (n + chunkSize - 1) / chunkSize;
+        std::vector<Box> chunks(numChunks);
+        ParallelFor(numChunks, 0, [&](const int c) {
+            const int begin = c * chunkSize;
+            const int end = std::min(n, begin + chunkSize);
+            vec3 min = m_Positions[begin];
+            vec3 max = m_Positions[begin];
+            for (int i = begin + 1; i < end; i++) {
+                min = glm::min(min, m_Positions[i]);
+                max = glm::max(max, m_Positions[i]);
+            }
+            chunks[c] = Box(min, max);
+        });
+        Box result = chunks[0];
+        for (int c = 1; c < numChunks; c++) {
+            result = result.Extend(chunks[c]);
+        }
+        return result;
+    }
+
+    // interleaves the low 21 bits of x, y and z
+    static uint64_t MortonCode(const uint32_t x, const uint32_t y, const uint32_t z) {
+        const auto spread = [](uint64_t v) {
+            v &= 0x1fffff;
+            v = (v | v << 32) & 0x1f00000000ffffull;
+            v = (v | v << 16) & 0x1f0000ff0000ffull;
+            v = (v | v << 8) & 0x100f00f00f00f00full;
+            v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+            v = (v | v << 2) & 0x1249249249249249ull;
+            return v;
+        };
+        return spread(x) | spread(y) << 1 | spread(z) << 2;
+    }
+
     std::vector<vec3> m_Positions;
     std::vector<vec3> m_Normals;
+    std::vector<vec2> m_UVs;
     std::vector<glm::ivec3> m_Triangles;
+    Box m_Bounds;
+    MemoryCharge m_Charge;
 };
 
 typedef std::shared_ptr<Mesh> P_Mesh;
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "mesh.hpp"
+#include "obj.hpp"
+#include "parse.hpp"
+#include "ply.hpp"
+#include "stl.hpp"
+
+// Loads a .stl (binary or ASCII), .obj or .ply (binary little endian) mesh
+// by its extension. The file is mapped once and parsed in parallel, then
+// welded into a Mesh.
+P_Mesh LoadMesh(const std::string &path) {
+    const std::string extension = FileExtension(path);
+    if (extension != "stl" && extension != "obj" && extension != "ply") {
+        throw std::runtime_error(path + ": unknown mesh format");
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const MappedFile file(path);
+    P_Mesh mesh;
+    if (extension == "stl") {
+        mesh = std::make_shared<Mesh>(ParseSTL(file.Data(), file.Size(), path));
+    } else if (extension == "obj") {
+        mesh = std::make_shared<Mesh>(ParseOBJ(file.Data(), file.Size(), path));
+    } else {
+        mesh = std::make_shared<Mesh>(ParsePLY(file.Data(), file.Size(), path));
+    }
+    const double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    const double megabytes = file.Size() / 1e6;
+    printf("  %s: %.1f MB in %.3fs (%.0f MB/s)\n",
+        path.c_str(), megabytes, seconds, megabytes / std::max(seconds, 1e-9));
+    return mesh;
+}
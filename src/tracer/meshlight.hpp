@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cmath>
+#include <glm/glm.hpp>
+#include <glm/gtx/normal.hpp>
+#include <vector>
+
+#include "box.hpp"
+#include "config.hpp"
+#include "distribution.hpp"
+#include "hit.hpp"
+#include "material.hpp"
+#include "mesh.hpp"
+#include "util.hpp"
+
+// Emission of a mesh with an emissive material, shared by the mesh
+// geometries of each backend. Points are sampled uniformly by surface area,
+// and the face normals are bounded by a cone around the mean normal for
+// the light tree. Empty unless the material emits.
+class MeshLight {
+public:
+    MeshLight() {}
+
+    MeshLight(const P_Mesh &mesh, const P_Material &material) {
+        if (!material->Emits()) {
+            return;
+        }
+        const auto &positions = mesh->Positions();
+        const auto &triangles = mesh->Triangles();
+        std::vector<real> areas(triangles.size());
+        vec3 axis(0);
+        for (int i = 0; i < triangles.size(); i++) {
+            const auto &t = triangles[i];
+            areas[i] = mesh->TriangleArea(i);
+            axis += areas[i] * glm::triangleNormal(
+                positions[t.x], positions[t.y], positions[t.z]);
+        }
+        m_AreaTable = AliasTable(areas);
+
+        real cosTheta = -1;
+        if (glm::length(axis) > EPS) {
+            axis = glm::normalize(axis);
+            cosTheta = 1;
+            for (int i = 0; i < triangles.size(); i++) {
+                const auto &t = triangles[i];
+                if (areas[i] <= 0) {
+                    continue;
+                }
+                const vec3 n = glm::triangleNormal(
+                    positions[t.x], positions[t.y], positions[t.z]);
+                cosTheta = std::min(cosTheta, glm::dot(axis, n));
+            }
+        } else {
+            axis = vec3(0, 0, 1);
+        }
+
+        const Box box = mesh->BoundingBox();
+        const vec3 emitted = material->Emitted(0, 0, box.Center());
+        m_Info = LightInfo{
+            box, axis, cosTheta, Luminance(emitted) * m_AreaTable.Total()};
+    }
+
+    bool Empty() const {
+        return m_AreaTable.Empty();
+    }
+
+    const LightInfo &Info() const {
+        return m_Info;
+    }
+
+    vec3 RandomPoint(const Mesh &mesh) const {
+        return mesh.RandomPointOnTriangle(m_AreaTable.Sample(Random()));
+    }
+
+    // solid angle pdf of sampling the surface point at t along direction,
+    // where the geometric normal is ng (of any length)
+    real Pdf(const vec3 &ng, const vec3 &direction, const real t) const {
+        const real cosine = std::abs(glm::dot(ng, direction)) /
+            (glm::length(ng) * glm::length(direction));
+        if (cosine < EPS) {
+            return 0;
+        }
+        const real distance = t * glm::length(direction);
+        return distance * distance / (cosine * m_AreaTable.Total());
+    }
+
+private:
+    AliasTable m_AreaTable;
+    LightInfo m_Info;
+};
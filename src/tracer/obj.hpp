@@ -0,0 +1,221 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <glm/glm.hpp>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "config.hpp"
+#include "memory.hpp"
+#include "mesh.hpp"
+#include "parallel.hpp"
+#include "parse.hpp"
+#include "trace.hpp"
+
+// Wavefront OBJ: "v", "vt" and "vn" lines, and "f" lines of polygons (fan
+// triangulated) whose corners are v, v/vt, v//vn or v/vt/vn with 1 based
+// or negative (relative) indices. Other lines are ignored. Normals or uvs
+// given for only some corners are dropped.
+//
+// The file is split into chunks of lines. A first pass counts the vertex
+// lines and face corners of each chunk, so that the second, which parses
+// the chunks in parallel, knows the absolute index of every vertex line
+// and where each chunk's triangles go. Face lines whose corners do not
+// match their words are malformed.
+MeshData ParseOBJ(const char *data, const size_t size, const std::string &path) {
+    TraceSpan span("ParseOBJ", "load", "bytes", size);
+    const std::vector<const char *> bounds = SplitLines(data, data + size);
+    const int numChunks = bounds.size() - 1;
+
+    struct Counts {
+        int Positions = 0;
+        int Normals = 0;
+        int UVs = 0;
+        int64_t Corners = 0;
+    };
+    // space separated words on the line after the keyword at p, which
+    // well formed face lines have one of per corner
+    const auto countWords = [](const char *p, const char *end) {
+        const char *q = (const char *)memchr(p, '\n', end - p);
+        int words = 0;
+        for (const char *w = p + 1; w < (q ? q : end); w++) {
+            words += (w[-1] == ' ' || w[-1] == '\t') &&
+                w[0] != ' ' && w[0] != '\t' && w[0] != '\r';
+        }
+        return words;
+    };
+    std::vector<Counts> counts(numChunks + 1);
+    ParallelFor(numChunks, 0, [&](const int c) {
+        const char *end = bounds[c + 1];
+        Counts &count = counts[c + 1];
+        for (const char *p = bounds[c]; p < end; SkipLine(p, end)) {
+            SkipSpaces(p, end);
+            if (MatchWord(p, end, "v")) {
+                count.Positions++;
+            } else if (MatchWord(p, end, "vn")) {
+                count.Normals++;
+            } else if (MatchWord(p, end, "vt")) {
+                count.UVs++;
+            } else if (MatchWord(p, end, "f")) {
+                // 3 per word past the second, as the fan triangulates
+                count.Corners += 3 * std::max(0, countWords(p, end) - 2);
+            }
+        }
+    });
+    // counts[c] becomes the number of each before chunk c
+    for (int c = 0; c < numChunks; c++) {
+        counts[c + 1].Positions += counts[c].Positions;
+        counts[c + 1].Normals += counts[c].Normals;
+        counts[c + 1].UVs += counts[c].UVs;
+        counts[c + 1].Corners += counts[c].Corners;
+    }
+    const Counts &total = counts[numChunks];
+    MemoryTracker::Shared().Require(
+        total.Positions * sizeof(vec3) + total.Normals * sizeof(vec3) +
+        total.UVs * sizeof(vec2) + total.Corners * 3 * sizeof(int), path);
+
+    MeshData result;
+    result.Positions.resize(total.Positions);
+    result.Normals.resize(total.Normals);
+    result.UVs.resize(total.UVs);
+    result.PositionIndices.resize(total.Corners);
+    result.NormalIndices.resize(total.Corners);
+    result.UVIndices.resize(total.Corners);
+    // whether any corner has (or lacks) a normal or uv
+    std::vector<int> flags(numChunks);
+    enum {HasNormal = 1, LacksNormal = 2, HasUV = 4, LacksUV = 8};
+
+    // parses chunk c, returning what was malformed if anything (the pool
+    // cannot throw from its threads)
+    const auto parseChunk = [&](const int c) -> const char * {
+        const char *end = bounds[c + 1];
+        Counts index = counts[c];
+        int64_t corner = index.Corners;
+        std::vector<glm::ivec3> polygon;
+        // absolute index of the 1 based or negative OBJ index i among
+        // count lines so far
+        const auto resolve = [](const int i, const int count) {
+            return i > 0 ? i - 1 : i < 0 ? count + i : -1;
+        };
+        for (const char *p = bounds[c]; p < end; SkipLine(p, end)) {
+            SkipSpaces(p, end);
+            if (MatchWord(p, end, "v")) {
+                p++;
+                vec3 &v = result.Positions[index.Positions++];
+                if (!ParseReal(p, end, v.x) || !ParseReal(p, end, v.y) ||
+                    !ParseReal(p, end, v.z))
+                {
+                    return "vertex";
+                }
+            } else if (MatchWord(p, end, "vn")) {
+                p += 2;
+                vec3 &n = result.Normals[index.Normals++];
+                if (!ParseReal(p, end, n.x) || !ParseReal(p, end, n.y) ||
+                    !ParseReal(p, end, n.z))
+                {
+                    return "normal";
+                }
+            } else if (MatchWord(p, end, "vt")) {
+                p += 2;
+                vec2 &uv = result.UVs[index.UVs++];
+                if (!ParseReal(p, end, uv.x)) {
+                    return "texture coordinate";
+                }
+                // v is optional, as in 1D textures
+                const char *q = p;
+                if (!ParseReal(q, end, uv.y)) {
+                    uv.y = 0;
+                } else {
+                    p = q;
+                }
+            } else if (MatchWord(p, end, "f")) {
+                const int words = countWords(p, end);
+                p++;
+                polygon.clear();
+                while (true) {
+                    glm::ivec3 v(-1);
+                    int i;
+                    if (!ParseInt(p, end, i)) {
+                        break;
+                    }
+                    v.x = resolve(i, index.Positions);
+                    if (p < end && *p == '/') {
+                        p++;
+                        if (p < end && *p != '/') {
+                            if (!ParseInt(p, end, i)) {
+                                return "face";
+                            }
+                            v.z = resolve(i, index.UVs);
+                        }
+                        if (p < end && *p == '/') {
+                            p++;
+                            if (!ParseInt(p, end, i)) {
+                                return "face";
+                            }
+                            v.y = resolve(i, index.Normals);
+                        }
+                    }
+                    polygon.push_back(v);
+                }
+                // a corner per word keeps the chunk within the corners
+                // the first pass counted for it
+                const int64_t corners = 3 * std::max(0, int(polygon.size()) - 2);
+                if (polygon.size() != words ||
+                    corner + corners > counts[c + 1].Corners)
+                {
+                    return "face";
+                }
+                for (int k = 2; k < polygon.size(); k++) {
+                    const auto triangle = {polygon[0], polygon[k - 1], polygon[k]};
+                    for (const glm::ivec3 &v : triangle) {
+                        result.PositionIndices[corner] = v.x;
+                        result.NormalIndices[corner] = v.y;
+                        result.UVIndices[corner] = v.z;
+                        flags[c] |= v.y >= 0 ? HasNormal : LacksNormal;
+                        flags[c] |= v.z >= 0 ? HasUV : LacksUV;
+                        corner++;
+                    }
+                }
+            }
+        }
+        return nullptr;
+    };
+    std::vector<const char *> errors(numChunks);
+    ParallelFor(numChunks, 0, [&](const int c) {
+        errors[c] = parseChunk(c);
+    });
+    for (const char *error : errors) {
+        if (error) {
+            throw std::runtime_error(path + ": malformed " + error);
+        }
+    }
+
+    int allFlags = 0;
+    for (const int f : flags) {
+        allFlags |= f;
+    }
+    if ((allFlags & (HasNormal | LacksNormal)) != HasNormal) {
+        result.Normals.clear();
+        result.NormalIndices.clear();
+    }
+    if ((allFlags & (HasUV | LacksUV)) != HasUV) {
+        result.UVs.clear();
+        result.UVIndices.clear();
+    }
+    // attributes indexed like the positions (f a/a/a, as many exporters
+    // write) need no per corner indices, which lets Mesh skip the weld
+    const auto mirrored = [&](const std::vector<int> &indices, const size_t count) {
+        return !indices.empty() && count == result.Positions.size() &&
+            indices == result.PositionIndices;
+    };
+    if (mirrored(result.NormalIndices, result.Normals.size())) {
+        result.NormalIndices.clear();
+    }
+    if (mirrored(result.UVIndices, result.UVs.size())) {
+        result.UVIndices.clear();
+    }
+    return result;
+}
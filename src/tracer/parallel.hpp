@@ -0,0 +1,144 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <vector>
+
+#include "trace.hpp"
+
+inline int NumWorkers(const int numThreads) {
+    return numThreads > 0 ?
+        numThreads : std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Persistent worker threads shared by every parallel loop, so rendering
+// many frames does not start and join threads for each one. Threads are
+// created on demand and live until exit.
+class ThreadPool {
+public:
+    static ThreadPool &Shared() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    // Calls f(i) for i in [0, n), each on its own thread, and waits for all
+    // of them; f(0) runs on the calling thread. Nested calls from inside a
+    // job run serially on the calling thread.
+    void Run(const int n, const std::function<void(int)> &f) {
+        if (n <= 1 || InJob()) {
+            for (int i = 0; i < n; i++) {
+                f(i);
+            }
+            return;
+        }
+        std::lock_guard<std::mutex> run(m_RunMutex);
+        {
+            std::lock_guard<std::mutex> guard(m_Mutex);
+            while (m_Threads.size() < n - 1) {
+                const int index = m_Threads.size() + 1;
+                m_Threads.emplace_back([this, index]() { Worker(index); });
+            }
+            m_Job = &f;
+            m_JobSize = n;
+            m_Pending = n - 1;
+            m_Generation++;
+        }
+        m_Start.notify_all();
+        InJob() = true;
+        f(0);
+        InJob() = false;
+        TraceSpan span("barrier", "sync");
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_Done.wait(lock, [this]() { return m_Pending == 0; });
+        m_Job = nullptr;
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> guard(m_Mutex);
+            m_Stop = true;
+        }
+        m_Start.notify_all();
+        for (auto &thread : m_Threads) {
+            thread.join();
+        }
+    }
+
+private:
+    ThreadPool() {}
+
+    static bool &InJob() {
+        static thread_local bool inJob = false;
+        return inJob;
+    }
+
+    void Worker(const int index) {
+        InJob() = true;
+        Tracer::Shared().SetThreadName("worker " + std::to_string(index));
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        while (true) {
+            m_Start.wait(lock, [&]() {
+                return m_Stop || m_Generation != seen;
+            });
+            if (m_Stop) {
+                break;
+            }
+            seen = m_Generation;
+            if (index >= m_JobSize) {
+                continue;
+            }
+            const std::function<void(int)> &f = *m_Job;
+            lock.unlock();
+            f(index);
+            lock.lock();
+            if (--m_Pending == 0) {
+                m_Done.notify_one();
+            }
+        }
+    }
+
+    std::mutex m_RunMutex;
+    std::mutex m_Mutex;
+    std::condition_variable m_Start;
+    std::condition_variable m_Done;
+    std::vector<std::thread> m_Threads;
+    const std::function<void(int)> *m_Job = nullptr;
+    int m_JobSize = 0;
+    int m_Pending = 0;
+    uint64_t m_Generation = 0;
+    bool m_Stop = false;
+};
+
+// Calls f(i) for every i in [0, n) on up to numThreads threads (all cores
+// when numThreads <= 0). Indices are handed out in chunks from a shared
+// counter so uneven work balances itself.
+template <typename F>
+void ParallelFor(const int n, const int numThreads, F f, const int chunk = 1) {
+    const int wn = std::min(NumWorkers(numThreads), (n + chunk - 1) / chunk);
+    if (wn <= 1) {
+        for (int i = 0; i < n; i++) {
+            f(i);
+        }
+        return;
+    }
+    std::atomic<int> next(0);
+    ThreadPool::Shared().Run(wn, [&](const int) {
+        while (true) {
+            const int start = next.fetch_add(chunk);
+            if (start >= n) {
+                break;
+            }
+            const int end = std::min(start + chunk, n);
+            for (int i = start; i < end; i++) {
+                f(i);
+            }
+        }
+    });
+}
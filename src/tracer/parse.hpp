@@ -0,0 +1,160 @@
+#pragma once
+
+#include <algorithm>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "config.hpp"
+
+// Helpers for the mesh loaders: memory mapped files, and parsing of numeric
+// text split into chunks of whole lines that are parsed in parallel.
+
+// a whole file mapped read only
+class MappedFile {
+public:
+    MappedFile(const std::string &path) :
+        m_Mapping(path.c_str(), boost::interprocess::read_only),
+        m_Region(m_Mapping, boost::interprocess::read_only)
+    {}
+
+    const char *Data() const {
+        return (const char *)m_Region.get_address();
+    }
+
+    size_t Size() const {
+        return m_Region.get_size();
+    }
+
+private:
+    boost::interprocess::file_mapping m_Mapping;
+    boost::interprocess::mapped_region m_Region;
+};
+
+// the lowercase extension of path, without the dot
+std::string FileExtension(const std::string &path) {
+    const size_t dot = path.rfind('.');
+    std::string result = dot == std::string::npos ? "" : path.substr(dot + 1);
+    std::transform(result.begin(), result.end(), result.begin(),
+        [](const unsigned char c) { return std::tolower(c); });
+    return result;
+}
+
+// Boundaries of chunks of about chunkSize bytes of [begin, end), each
+// starting at the beginning of a line: chunk i is result[i] to
+// result[i + 1].
+std::vector<const char *> SplitLines(
+    const char *begin, const char *end, const size_t chunkSize = 1 << 20)
+{
+    std::vector<const char *> result = {begin};
+    while (result.back() < end) {
+        const char *p = result.back();
+        if (end - p <= chunkSize) {
+            result.push_back(end);
+            break;
+        }
+        p = (const char *)memchr(p + chunkSize, '\n', end - p - chunkSize);
+        result.push_back(p ? p + 1 : end);
+    }
+    return result;
+}
+
+// skips spaces and tabs (and carriage returns, for CRLF files)
+void SkipSpaces(const char *&p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        p++;
+    }
+}
+
+// moves p past the next line break
+void SkipLine(const char *&p, const char *end) {
+    const char *q = (const char *)memchr(p, '\n', end - p);
+    p = q ? q + 1 : end;
+}
+
+// whether the word at p is word, followed by a space or the line's end
+bool MatchWord(const char *p, const char *end, const char *word) {
+    const size_t n = strlen(word);
+    if (end - p < n || memcmp(p, word, n)) {
+        return false;
+    }
+    return end - p == n || p[n] == ' ' || p[n] == '\t' ||
+        p[n] == '\r' || p[n] == '\n';
+}
+
+// parses an optionally signed integer after any spaces
+bool ParseInt(const char *&p, const char *end, int &value) {
+    SkipSpaces(p, end);
+    const bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) {
+        p++;
+    }
+    if (p >= end || *p < '0' || *p > '9') {
+        return false;
+    }
+    int64_t result = 0;
+    while (p < end && *p >= '0' && *p <= '9' && result < (int64_t(1) << 32)) {
+        result = result * 10 + (*p++ - '0');
+    }
+    value = negative ? -result : result;
+    return true;
+}
+
+// Parses a decimal number (with optional fraction and exponent) after any
+// spaces. Not correctly rounded in every case like strtod, but within an
+// ulp or so of it and many times faster.
+bool ParseReal(const char *&p, const char *end, real &value) {
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    SkipSpaces(p, end);
+    const bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) {
+        p++;
+    }
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    int digits = 0;
+    const auto digit = [&](const int d) {
+        if (mantissa < 100000000000000000ull) {
+            mantissa = mantissa * 10 + d;
+            return 0;
+        }
+        // digits past the 17th no longer change a double
+        return 1;
+    };
+    for (; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+        exponent += digit(*p - '0');
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+            exponent -= 1 - digit(*p - '0');
+        }
+    }
+    if (digits == 0) {
+        return false;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        int e;
+        if (!ParseInt(p, end, e)) {
+            return false;
+        }
+        exponent += e;
+    }
+    double result = mantissa;
+    if (exponent < 0) {
+        result = exponent >= -22 ?
+            result / powers[-exponent] : result * std::pow(10.0, exponent);
+    } else if (exponent > 0) {
+        result = exponent <= 22 ?
+            result * powers[exponent] : result * std::pow(10.0, exponent);
+    }
+    value = negative ? -result : result;
+    return true;
+}
@@ -0,0 +1,417 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "config.hpp"
+#include "memory.hpp"
+#include "mesh.hpp"
+#include "parallel.hpp"
+#include "parse.hpp"
+#include "trace.hpp"
+
+// Binary little endian PLY. The header lists elements, each a count of
+// records of scalar or list properties; the data follows "end_header".
+
+enum PLYType {
+    PLYInt8,
+    PLYUInt8,
+    PLYInt16,
+    PLYUInt16,
+    PLYInt32,
+    PLYUInt32,
+    PLYFloat32,
+    PLYFloat64
+};
+
+struct PLYProperty {
+    std::string Name;
+    PLYType Type;
+    // lists are a count of CountType followed by that many of Type
+    bool List;
+    PLYType CountType;
+};
+
+struct PLYElement {
+    std::string Name;
+    int64_t Count;
+    std::vector<PLYProperty> Properties;
+
+    // index of the property called name, or -1
+    int Find(const std::string &name) const {
+        for (int i = 0; i < Properties.size(); i++) {
+            if (Properties[i].Name == name) {
+                return i;
+            }
+        }
+        return -1;
+    }
+};
+
+struct PLYHeader {
+    std::vector<PLYElement> Elements;
+    // bytes before the first element's data
+    size_t Size;
+};
+
+int PLYTypeSize(const PLYType type) {
+    static const int sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+    return sizes[type];
+}
+
+PLYType ParsePLYType(const std::string &name, const std::string &path) {
+    static const char *names[][2] = {
+        {"char", "int8"}, {"uchar", "uint8"}, {"short", "int16"},
+        {"ushort", "uint16"}, {"int", "int32"}, {"uint", "uint32"},
+        {"float", "float32"}, {"double", "float64"}};
+    for (int i = 0; i < 8; i++) {
+        if (name == names[i][0] || name == names[i][1]) {
+            return PLYType(i);
+        }
+    }
+    throw std::runtime_error(path + ": unknown PLY type " + name);
+}
+
+// reads a value of type from unaligned little endian data
+double ReadPLY(const char *p, const PLYType type) {
+    int8_t i8;
+    uint8_t u8;
+    int16_t i16;
+    uint16_t u16;
+    int32_t i32;
+    uint32_t u32;
+    float f32;
+    double f64;
+    if (type == PLYInt8) {
+        memcpy(&i8, p, 1);
+        return i8;
+    }
+    if (type == PLYUInt8) {
+        memcpy(&u8, p, 1);
+        return u8;
+    }
+    if (type == PLYInt16) {
+        memcpy(&i16, p, 2);
+        return i16;
+    }
+    if (type == PLYUInt16) {
+        memcpy(&u16, p, 2);
+        return u16;
+    }
+    if (type == PLYInt32) {
+        memcpy(&i32, p, 4);
+        return i32;
+    }
+    if (type == PLYUInt32) {
+        memcpy(&u32, p, 4);
+        return u32;
+    }
+    if (type == PLYFloat32) {
+        memcpy(&f32, p, 4);
+        return f32;
+    }
+    memcpy(&f64, p, 8);
+    return f64;
+}
+
+// Parses the header of a binary little endian PLY file; other formats
+// throw.
+PLYHeader ParsePLYHeader(const char *data, const size_t size, const std::string &path) {
+    const char *end = data + size;
+    const char *p = data;
+    if (!MatchWord(p, end, "ply")) {
+        throw std::runtime_error(path + ": not a PLY file");
+    }
+    PLYHeader header;
+    bool binary = false;
+    while (true) {
+        SkipLine(p, end);
+        if (p >= end) {
+            throw std::runtime_error(path + ": PLY header has no end_header");
+        }
+        const char *q = (const char *)memchr(p, '\n', end - p);
+        std::istringstream line(std::string(p, q ? q : end));
+        std::string keyword;
+        line >> keyword;
+        if (keyword == "format") {
+            std::string format;
+            line >> format;
+            binary = format == "binary_little_endian";
+        } else if (keyword == "element") {
+            PLYElement element;
+            line >> element.Name >> element.Count;
+            if (!line || element.Count < 0 ||
+                element.Count > std::numeric_limits<int>::max())
+            {
+                throw std::runtime_error(path + ": malformed PLY element count");
+            }
+            header.Elements.push_back(element);
+        } else if (keyword == "property") {
+            if (header.Elements.empty()) {
+                throw std::runtime_error(path + ": PLY property before element");
+            }
+            PLYProperty property;
+            std::string type;
+            line >> type;
+            property.List = type == "list";
+            if (property.List) {
+                std::string countType;
+                line >> countType >> type;
+                property.CountType = ParsePLYType(countType, path);
+            }
+            property.Type = ParsePLYType(type, path);
+            line >> property.Name;
+            header.Elements.back().Properties.push_back(property);
+        } else if (keyword == "end_header") {
+            SkipLine(p, end);
+            break;
+        }
+    }
+    if (!binary) {
+        throw std::runtime_error(path + ": only binary little endian PLY is supported");
+    }
+    header.Size = p - data;
+    return header;
+}
+
+// Bytes per record of element, or -1 if it has lists.
+int PLYRecordSize(const PLYElement &element) {
+    int result = 0;
+    for (const PLYProperty &property : element.Properties) {
+        if (property.List) {
+            return -1;
+        }
+        result += PLYTypeSize(property.Type);
+    }
+    return result;
+}
+
+// Moves p past the record of element at p, which may have lists; returns
+// false if the record runs past end or has a negative list count, leaving
+// p within the record.
+bool SkipPLYRecord(const PLYElement &element, const char *&p, const char *end) {
+    for (const PLYProperty &property : element.Properties) {
+        if (property.List) {
+            if (end - p < PLYTypeSize(property.CountType)) {
+                return false;
+            }
+            const int64_t count = ReadPLY(p, property.CountType);
+            if (count < 0) {
+                return false;
+            }
+            p += PLYTypeSize(property.CountType) + count * PLYTypeSize(property.Type);
+        } else {
+            p += PLYTypeSize(property.Type);
+        }
+        if (p > end) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Start of property index (a list's count) in the record of element at p,
+// which SkipPLYRecord must have accepted.
+const char *PLYPropertyAt(const PLYElement &element, const int index, const char *p) {
+    for (int i = 0; i < index; i++) {
+        const PLYProperty &property = element.Properties[i];
+        if (property.List) {
+            p += PLYTypeSize(property.CountType) +
+                int64_t(ReadPLY(p, property.CountType)) * PLYTypeSize(property.Type);
+        } else {
+            p += PLYTypeSize(property.Type);
+        }
+    }
+    return p;
+}
+
+// A mesh from the "vertex" element (x, y, z, and nx, ny, nz and u, v, s,
+// t or texture_u, texture_v when present) and the "face" element's
+// "vertex_indices" lists, fan triangulated. Vertices and faces are read in
+// parallel. Faces with differing corner counts have records of differing
+// sizes, which takes a serial scan to find where each chunk of them starts.
+MeshData ParsePLY(const char *data, const size_t size, const std::string &path) {
+    TraceSpan span("ParsePLY", "load", "bytes", size);
+    const PLYHeader header = ParsePLYHeader(data, size, path);
+    const char *end = data + size;
+    const char *p = data + header.Size;
+    const auto truncated = [&]() {
+        return std::runtime_error(path + ": truncated or malformed PLY data");
+    };
+
+    MeshData result;
+    bool faces = false;
+    for (const PLYElement &element : header.Elements) {
+        const int recordSize = PLYRecordSize(element);
+        if (element.Name == "vertex") {
+            if (recordSize < 0) {
+                throw std::runtime_error(path + ": PLY vertex has lists");
+            }
+            if (end - p < element.Count * recordSize) {
+                throw truncated();
+            }
+            // offset and type of each wanted property, offset -1 if absent
+            const auto field = [&](const char *a, const char *b, const char *c) {
+                int offset = 0;
+                for (const PLYProperty &property : element.Properties) {
+                    if (property.Name == a || property.Name == b || property.Name == c) {
+                        return std::make_pair(offset, property.Type);
+                    }
+                    offset += PLYTypeSize(property.Type);
+                }
+                return std::make_pair(-1, PLYFloat32);
+            };
+            const std::pair<int, PLYType> fields[] = {
+                field("x", "x", "x"), field("y", "y", "y"),
+                field("z", "z", "z"), field("nx", "nx", "nx"),
+                field("ny", "ny", "ny"), field("nz", "nz", "nz"),
+                field("u", "s", "texture_u"), field("v", "t", "texture_v")};
+            if (fields[0].first < 0 || fields[1].first < 0 || fields[2].first < 0) {
+                throw std::runtime_error(path + ": PLY vertex has no x, y, z");
+            }
+            const bool normals = fields[3].first >= 0 &&
+                fields[4].first >= 0 && fields[5].first >= 0;
+            const bool uvs = fields[6].first >= 0 && fields[7].first >= 0;
+            MemoryTracker::Shared().Require(element.Count * (
+                sizeof(vec3) + normals * sizeof(vec3) + uvs * sizeof(vec2)), path);
+            result.Positions.resize(element.Count);
+            result.Normals.resize(normals ? element.Count : 0);
+            result.UVs.resize(uvs ? element.Count : 0);
+            const char *vertices = p;
+            ParallelFor(element.Count, 0, [&](const int i) {
+                const char *r = vertices + int64_t(i) * recordSize;
+                const auto read = [&](const int f) {
+                    return ReadPLY(r + fields[f].first, fields[f].second);
+                };
+                result.Positions[i] = vec3(read(0), read(1), read(2));
+                if (normals) {
+                    result.Normals[i] = vec3(read(3), read(4), read(5));
+                }
+                if (uvs) {
+                    result.UVs[i] = vec2(read(6), read(7));
+                }
+            }, 4096);
+            p += element.Count * recordSize;
+        } else if (element.Name == "face") {
+            int list = element.Find("vertex_indices");
+            if (list < 0) {
+                list = element.Find("vertex_index");
+            }
+            if (list < 0 || !element.Properties[list].List) {
+                throw std::runtime_error(path + ": PLY face has no vertex_indices");
+            }
+            const PLYProperty &indices = element.Properties[list];
+            const int countSize = PLYTypeSize(indices.CountType);
+            const int indexSize = PLYTypeSize(indices.Type);
+
+            // where each chunk of faces starts, and its first corner
+            const int chunkSize = 1 << 16;
+            const int numChunks = (element.Count + chunkSize - 1) / chunkSize;
+            std::vector<const char *> starts;
+            std::vector<int64_t> firstCorners;
+            int64_t corners = 0;
+
+            // Faces are usually all triangles or all quads. When vertex
+            // indices is the only list and every record's count matches the
+            // first's (checked in parallel), records have a fixed size and
+            // chunks start at known offsets. The first record's count has
+            // been checked to be non-negative, so the stride is positive;
+            // otherwise the serial scan checks every record.
+            int lists = 0;
+            for (const PLYProperty &property : element.Properties) {
+                lists += property.List;
+            }
+            const char *next = p;
+            bool uniform = lists == 1 && element.Count > 0 &&
+                SkipPLYRecord(element, next, end) &&
+                (next - p) * element.Count <= end - p;
+            const int64_t stride = next - p;
+            const int offset = uniform ? PLYPropertyAt(element, list, p) - p : 0;
+            const int64_t uniformCount =
+                uniform ? ReadPLY(p + offset, indices.CountType) : 0;
+            if (uniform) {
+                std::atomic<bool> same(true);
+                ParallelFor(numChunks, 0, [&](const int c) {
+                    const int64_t last =
+                        std::min(element.Count, int64_t(c + 1) * chunkSize);
+                    for (int64_t i = int64_t(c) * chunkSize; i < last; i++) {
+                        const char *r = p + i * stride + offset;
+                        if (ReadPLY(r, indices.CountType) != uniformCount) {
+                            same = false;
+                            return;
+                        }
+                    }
+                });
+                uniform = same;
+            }
+            const int64_t faceCorners = 3 * std::max(int64_t(0), uniformCount - 2);
+            for (int64_t i = 0; uniform && i < element.Count; i += chunkSize) {
+                starts.push_back(p + i * stride);
+                firstCorners.push_back(i * faceCorners);
+            }
+            if (uniform) {
+                corners = element.Count * faceCorners;
+                p += element.Count * stride;
+            }
+            for (int64_t i = 0; !uniform && i < element.Count; i++) {
+                if (i % chunkSize == 0) {
+                    starts.push_back(p);
+                    firstCorners.push_back(corners);
+                }
+                const char *record = p;
+                if (!SkipPLYRecord(element, p, end)) {
+                    throw truncated();
+                }
+                const char *q = PLYPropertyAt(element, list, record);
+                const int64_t count = ReadPLY(q, indices.CountType);
+                corners += 3 * std::max(int64_t(0), count - 2);
+            }
+            MemoryTracker::Shared().Require(corners * sizeof(int), path);
+            result.PositionIndices.resize(corners);
+            faces = true;
+
+            ParallelFor(starts.size(), 0, [&](const int c) {
+                const int64_t first = int64_t(c) * chunkSize;
+                const int64_t last = std::min(element.Count, first + chunkSize);
+                const char *r = starts[c];
+                int64_t corner = firstCorners[c];
+                for (int64_t i = first; i < last; i++) {
+                    const char *q = PLYPropertyAt(element, list, r);
+                    SkipPLYRecord(element, r, end);
+                    const int count = ReadPLY(q, indices.CountType);
+                    q += countSize;
+                    const int v0 = ReadPLY(q, indices.Type);
+                    for (int k = 2; k < count; k++) {
+                        result.PositionIndices[corner++] = v0;
+                        result.PositionIndices[corner++] =
+                            ReadPLY(q + (k - 1) * indexSize, indices.Type);
+                        result.PositionIndices[corner++] =
+                            ReadPLY(q + k * indexSize, indices.Type);
+                    }
+                }
+            });
+        } else if (recordSize >= 0) {
+            p += element.Count * recordSize;
+        } else {
+            for (int64_t i = 0; i < element.Count; i++) {
+                if (!SkipPLYRecord(element, p, end)) {
+                    throw truncated();
+                }
+            }
+        }
+        if (p > end) {
+            throw truncated();
+        }
+    }
+    if (!faces) {
+        throw std::runtime_error(path + ": PLY has no face element");
+    }
+    return result;
+}
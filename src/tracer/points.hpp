@@ -0,0 +1,159 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "backend.hpp"
+#include "bvh.hpp"
+#include "config.hpp"
+#include "material.hpp"
+#include "memory.hpp"
+#include "parallel.hpp"
+#include "parse.hpp"
+#include "ply.hpp"
+#include "trace.hpp"
+
+// Point clouds rendered as spheres, parsed in parallel from the mapped file
+// straight into the sphere buffer: 16 bytes a point, plus 2 for a material
+// index when the file has them.
+//
+// Binary little endian PLY reads the "vertex" element's x, y, z and,
+// when present, "radius" and "material_index" (an index into materials;
+// without it points are split evenly between them). .xyz is text, a point
+// of x y z per line; further columns and # comments are ignored. Points
+// without a radius get radius.
+P_Hittable LoadPoints(
+    GeometryDevice device, const std::string &path, const real radius,
+    const std::vector<P_Material> &materials,
+    const BVHOptions &options = BVHOptions())
+{
+    TraceSpan span("LoadPoints", "load");
+    const std::string extension = FileExtension(path);
+    if (materials.empty()) {
+        throw std::runtime_error(path + ": points need materials");
+    }
+    const MappedFile file(path);
+    const char *data = file.Data();
+    const char *end = data + file.Size();
+
+    if (extension == "xyz") {
+        const std::vector<const char *> bounds = SplitLines(data, end);
+        const int numChunks = bounds.size() - 1;
+        const auto isPoint = [](const char *p, const char *e) {
+            return p < e && *p != '\n' && *p != '#';
+        };
+        // counts[c] becomes the number of points before chunk c
+        std::vector<int64_t> counts(numChunks + 1);
+        ParallelFor(numChunks, 0, [&](const int c) {
+            const char *e = bounds[c + 1];
+            for (const char *p = bounds[c]; p < e; SkipLine(p, e)) {
+                SkipSpaces(p, e);
+                counts[c + 1] += isPoint(p, e);
+            }
+        });
+        for (int c = 0; c < numChunks; c++) {
+            counts[c + 1] += counts[c];
+        }
+        const int64_t count = counts[numChunks];
+        MemoryTracker::Shared().Require(count * sizeof(EmbreeSphere), path);
+        return MakeSpheres(device, count,
+            [&](EmbreeSphere *spheres, uint16_t *) {
+                // the pool cannot throw from its threads
+                std::vector<char> malformed(numChunks);
+                ParallelFor(numChunks, 0, [&](const int c) {
+                    const char *e = bounds[c + 1];
+                    EmbreeSphere *s = spheres + counts[c];
+                    for (const char *p = bounds[c]; p < e; SkipLine(p, e)) {
+                        SkipSpaces(p, e);
+                        if (!isPoint(p, e)) {
+                            continue;
+                        }
+                        real x, y, z;
+                        if (!ParseReal(p, e, x) || !ParseReal(p, e, y) ||
+                            !ParseReal(p, e, z))
+                        {
+                            malformed[c] = 1;
+                            return;
+                        }
+                        *s++ = {float(x), float(y), float(z), float(radius)};
+                    }
+                });
+                for (const char m : malformed) {
+                    if (m) {
+                        throw std::runtime_error(path + ": malformed point");
+                    }
+                }
+            }, false, materials, options);
+    }
+
+    if (extension != "ply") {
+        throw std::runtime_error(path + ": unknown point cloud format");
+    }
+    const PLYHeader header = ParsePLYHeader(data, file.Size(), path);
+    const char *p = data + header.Size;
+    for (const PLYElement &element : header.Elements) {
+        const int recordSize = PLYRecordSize(element);
+        if (element.Name != "vertex") {
+            for (int64_t i = 0; i < element.Count; i++) {
+                if (!SkipPLYRecord(element, p, end)) {
+                    throw std::runtime_error(path + ": truncated or malformed PLY data");
+                }
+            }
+            continue;
+        }
+        if (recordSize < 0) {
+            throw std::runtime_error(path + ": PLY vertex has lists");
+        }
+        if (end - p < element.Count * recordSize) {
+            throw std::runtime_error(path + ": truncated PLY data");
+        }
+        // offset and type of each property, offset -1 if absent
+        std::vector<std::pair<int, PLYType>> fields;
+        for (const char *name : {"x", "y", "z", "radius", "material_index"}) {
+            int offset = 0;
+            fields.emplace_back(-1, PLYFloat32);
+            for (const PLYProperty &property : element.Properties) {
+                if (property.Name == name) {
+                    fields.back() = std::make_pair(offset, property.Type);
+                    break;
+                }
+                offset += PLYTypeSize(property.Type);
+            }
+        }
+        if (fields[0].first < 0 || fields[1].first < 0 || fields[2].first < 0) {
+            throw std::runtime_error(path + ": PLY vertex has no x, y, z");
+        }
+        const bool indexed = fields[4].first >= 0;
+        MemoryTracker::Shared().Require(element.Count * (
+            sizeof(EmbreeSphere) + indexed * sizeof(uint16_t)), path);
+        const char *vertices = p;
+        return MakeSpheres(device, element.Count,
+            [&](EmbreeSphere *spheres, uint16_t *indices) {
+                std::atomic<bool> outOfRange(false);
+                ParallelFor(element.Count, 0, [&](const int i) {
+                    const char *r = vertices + int64_t(i) * recordSize;
+                    const auto read = [&](const int f) {
+                        return ReadPLY(r + fields[f].first, fields[f].second);
+                    };
+                    spheres[i] = {float(read(0)), float(read(1)), float(read(2)),
+                        float(fields[3].first >= 0 ? read(3) : radius)};
+                    if (indexed) {
+                        const double m = read(4);
+                        if (m < 0 || m >= materials.size()) {
+                            outOfRange = true;
+                            indices[i] = 0;
+                        } else {
+                            indices[i] = m;
+                        }
+                    }
+                }, 4096);
+                if (outOfRange) {
+                    throw std::runtime_error(path + ": material_index out of range");
+                }
+            }, indexed, materials, options);
+    }
+    throw std::runtime_error(path + ": PLY has no vertex element");
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <memory>
+#include <vector>
+
+#include "config.hpp"
+#include "half.hpp"
+#include "material.hpp"
+#include "sampler.hpp"
+
+namespace {
+
+// octahedral normal encoding (Meyer et al. 2010) in two snorm16 values
+void EncodeNormal(const vec3 &n, int16_t out[2]) {
+    const real l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    real x = l1 > 0 ? n.x / l1 : 0;
+    real y = l1 > 0 ? n.y / l1 : 0;
+    if (n.z < 0) {
+        const real ox = x;
+        x = (1 - std::abs(y)) * (ox >= 0 ? 1 : -1);
+        y = (1 - std::abs(ox)) * (y >= 0 ? 1 : -1);
+    }
+    out[0] = int16_t(std::round(x * 32767));
+    out[1] = int16_t(std::round(y * 32767));
+}
+
+vec3 DecodeNormal(const int16_t in[2]) {
+    real x = in[0] / real(32767);
+    real y = in[1] / real(32767);
+    const real z = 1 - std::abs(x) - std::abs(y);
+    if (z < 0) {
+        const real ox = x;
+        x = (1 - std::abs(y)) * (ox >= 0 ? 1 : -1);
+        y = (1 - std::abs(ox)) * (y >= 0 ? 1 : -1);
+    }
+    return glm::normalize(vec3(x, y, z));
+}
+
+}
+
+// Per-pixel cache of camera ray intersections at a fixed set of stratified
+// subpixel positions, filled the first time each one is traced. Later
+// progressive frames cycle through the same positions and start their
+// paths at bounce one.
+//
+// Only valid for a pinhole camera and a static scene without participating
+// media; call Clear() whenever the camera or scene changes. Entries are 32
+// bytes: float position, octahedral normal, half emission and a material
+// pointer (materials are owned by the scene).
+class PrimaryHitCache {
+public:
+    PrimaryHitCache(const int width, const int height, const int strata) :
+        m_Width(width), m_Height(height), m_Strata(strata),
+        m_Entries(size_t(width) * height * strata * strata)
+    {}
+
+    // positions per pixel
+    int Count() const {
+        return m_Strata * m_Strata;
+    }
+
+    size_t Bytes() const {
+        return m_Entries.size() * sizeof(Entry);
+    }
+
+    void Clear() {
+        std::fill(m_Entries.begin(), m_Entries.end(), Entry());
+    }
+
+    // subpixel offset in [0, 1)^2 of position k in pixel (x, y), jittered
+    // within its stratum by a hash so it need not be stored
+    void Subpixel(
+        const int x, const int y, const int k, real &dx, real &dy) const
+    {
+        uint32_t h = uint32_t(x) * 73856093u ^ uint32_t(y) * 19349663u ^
+            uint32_t(k) * 83492791u;
+        h ^= h >> 16;
+        h *= 0x85ebca6b;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35;
+        h ^= h >> 16;
+        dx = (k % m_Strata + (h & 0xffff) / real(65536)) / m_Strata;
+        dy = (k / m_Strata + (h >> 16) / real(65536)) / m_Strata;
+    }
+
+    // decodes entry k of pixel (x, y) for cameraRay; false if not filled
+    bool Get(
+        const int x, const int y, const int k, const Ray &cameraRay,
+        PrimaryHit &primary) const
+    {
+        const Entry &e = m_Entries[Index(x, y, k)];
+        if (e.State == Empty) {
+            return false;
+        }
+        primary.Found = e.State == Found;
+        if (!primary.Found) {
+            return true;
+        }
+        HitInfo &hit = primary.Hit;
+        hit.Position = vec3(e.Position[0], e.Position[1], e.Position[2]);
+        hit.T = glm::length(hit.Position - cameraRay.Origin());
+        hit.Normal = DecodeNormal(e.Normal);
+        // non-owning, so copying it costs no reference count traffic
+        hit.Material = P_Material(P_Material(), e.Surface);
+        primary.Emitted = vec3(
+            HalfToFloat(e.Emitted[0]), HalfToFloat(e.Emitted[1]),
+            HalfToFloat(e.Emitted[2]));
+        return true;
+    }
+
+    void Put(
+        const int x, const int y, const int k, const PrimaryHit &primary)
+    {
+        Entry &e = m_Entries[Index(x, y, k)];
+        e.State = primary.Found ? Found : Missed;
+        if (!primary.Found) {
+            return;
+        }
+        const HitInfo &hit = primary.Hit;
+        for (int i = 0; i < 3; i++) {
+            e.Position[i] = hit.Position[i];
+            e.Emitted[i] = FloatToHalf(primary.Emitted[i]);
+        }
+        EncodeNormal(hit.Normal, e.Normal);
+        e.Surface = hit.Material.get();
+    }
+
+private:
+    static const uint8_t Empty = 0;
+    static const uint8_t Missed = 1;
+    static const uint8_t Found = 2;
+
+    struct Entry {
+        float Position[3] = {0, 0, 0};
+        int16_t Normal[2] = {0, 0};
+        uint16_t Emitted[3] = {0, 0, 0};
+        uint8_t State = Empty;
+        Material *Surface = nullptr;
+    };
+
+    size_t Index(const int x, const int y, const int k) const {
+        return (size_t(y) * m_Width + x) * Count() + k;
+    }
+
+    int m_Width;
+    int m_Height;
+    int m_Strata;
+    std::vector<Entry> m_Entries;
+};
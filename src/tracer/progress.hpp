@@ -1,33 +1,135 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdio>
 #include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
 
+// Progress of one render pass. Workers only bump an atomic counter; a
+// reporter thread started by Start redraws the terminal line every
+// 100 ms and, when a JSON stream is set, appends a JSON object per line
+// to it once a second:
+//
+//   {"event": "progress", "done": 400, "total": 1600, "seconds": 1.2,
+//    "eta": 3.6, "samplesPerSecond": 3.4e6}
+//
+// and a final {"event": "done", ...} line from Done.
 class ProgressBar {
 public:
-    void Start(const int maxValue) {
+    // turns every bar off, for tools that report progress their own way
+    static void SetEnabled(const bool enabled) {
+        EnabledFlag() = enabled;
+    }
+
+    static bool Enabled() {
+        return EnabledFlag();
+    }
+
+    // appends progress records to path (a file or a fifo read by a job
+    // scheduler), independently of the terminal output
+    static void SetJSONStream(const std::string &path) {
+        FILE *file = fopen(path.c_str(), "a");
+        if (!file) {
+            throw std::runtime_error("cannot write " + path);
+        }
+        JSONStream() = file;
+    }
+
+    ProgressBar() :
+        m_Value(0),
+        m_MaxValue(0),
+        m_SamplesPerUnit(0),
+        m_Running(false)
+    {}
+
+    ~ProgressBar() {
+        Stop();
+    }
+
+    // samplesPerUnit converts the count to samples for the reported rate
+    void Start(const int maxValue, const double samplesPerUnit = 0) {
         m_Value = 0;
         m_MaxValue = maxValue;
+        m_SamplesPerUnit = samplesPerUnit;
         m_StartTime = std::chrono::steady_clock::now();
+        if (!Enabled() && !JSONStream()) {
+            return;
+        }
+        m_Running = true;
+        m_Reporter = std::thread([this]() {
+            Report();
+        });
     }
 
     void Increment(const int delta = 1) {
-        std::lock_guard<std::mutex> guard(m_Mutex);
-        m_Value += delta;
-        Display();
+        m_Value.fetch_add(delta, std::memory_order_relaxed);
     }
 
     void Done() {
-        Display();
-        printf("\n");
+        Stop();
+        if (Enabled()) {
+            Display();
+            printf("\n");
+        }
+        if (JSONStream()) {
+            WriteJSON("done");
+        }
     }
 
 private:
-    void Display() {
-        const int pct = m_Value * 100 / m_MaxValue;
-        const int ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+    static bool &EnabledFlag() {
+        static bool enabled = true;
+        return enabled;
+    }
+
+    static FILE *&JSONStream() {
+        static FILE *file = nullptr;
+        return file;
+    }
+
+    void Report() {
+        const auto interval = std::chrono::milliseconds(100);
+        const int jsonTicks = 10;
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        for (int tick = 1; ; tick++) {
+            if (m_Wake.wait_for(lock, interval, [this]() { return !m_Running; })) {
+                break;
+            }
+            if (Enabled()) {
+                Display();
+            }
+            if (JSONStream() && tick % jsonTicks == 0) {
+                WriteJSON("progress");
+            }
+        }
+    }
+
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> guard(m_Mutex);
+            if (!m_Running) {
+                return;
+            }
+            m_Running = false;
+        }
+        m_Wake.notify_one();
+        m_Reporter.join();
+    }
+
+    double Seconds() const {
+        return std::chrono::duration<double>(
             std::chrono::steady_clock::now() - m_StartTime).count();
-        printf("  %4d / %d (%3d%%) [", m_Value, m_MaxValue, pct);
+    }
+
+    void Display() const {
+        const int value = m_Value.load(std::memory_order_relaxed);
+        const int pct = m_MaxValue ? value * 100 / m_MaxValue : 100;
+        const double seconds = Seconds();
+        printf("  %4d / %d (%3d%%) [", value, m_MaxValue, pct);
         for (int p = 0; p < 100; p += 3) {
             if (pct > p) {
                 printf("=");
@@ -35,12 +137,37 @@ private:
                 printf(" ");
             }
         }
-        printf("] %.3fs    \r", ms / 1000.0);
+        printf("] %.3fs", seconds);
+        if (value > 0 && value < m_MaxValue) {
+            printf(", eta %.1fs", seconds * (m_MaxValue - value) / value);
+        }
+        if (m_SamplesPerUnit > 0 && seconds > 0) {
+            printf(", %.2f Msamples/s", value * m_SamplesPerUnit / seconds / 1e6);
+        }
+        printf("    \r");
         fflush(stdout);
     }
 
-    std::mutex m_Mutex;
-    int m_Value;
+    void WriteJSON(const char *event) const {
+        const int value = m_Value.load(std::memory_order_relaxed);
+        const double seconds = Seconds();
+        const double eta = value > 0 ?
+            seconds * (m_MaxValue - value) / value : -1;
+        const double rate = seconds > 0 ?
+            value * m_SamplesPerUnit / seconds : 0;
+        fprintf(JSONStream(),
+            "{\"event\":\"%s\",\"done\":%d,\"total\":%d,\"seconds\":%.3f,"
+            "\"eta\":%.3f,\"samplesPerSecond\":%.6g}\n",
+            event, value, m_MaxValue, seconds, eta, rate);
+        fflush(JSONStream());
+    }
+
+    std::atomic<int> m_Value;
     int m_MaxValue;
+    double m_SamplesPerUnit;
     std::chrono::steady_clock::time_point m_StartTime;
+    std::mutex m_Mutex;
+    std::condition_variable m_Wake;
+    bool m_Running;
+    std::thread m_Reporter;
 };
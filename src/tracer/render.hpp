@@ -1,15 +1,31 @@
 #pragma once
 
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
 #include <thread>
+#include <vector>
 // #include <pmmintrin.h>
 // #include <xmmintrin.h>
 
+#include "animation.hpp"
+#include "aov.hpp"
 #include "camera.hpp"
 #include "config.hpp"
+#include "denoise.hpp"
 #include "image.hpp"
+#include "instance.hpp"
+#include "memory.hpp"
+#include "parallel.hpp"
+#include "primary.hpp"
 #include "progress.hpp"
 #include "ray.hpp"
 #include "sampler.hpp"
+#include "stats.hpp"
+#include "stream.hpp"
+#include "trace.hpp"
 #include "util.hpp"
 
 struct IndexedValue {
@@ -17,84 +33,356 @@ struct IndexedValue {
     real value;
 };
 
-void Render(
-    Image &image, const Sampler &sampler, const Camera &camera,
-    const int numSamples, const int numThreads)
+// Takes a sample of frame pixel (x, y) at the cache position for sample
+// index s, tracing and storing the primary hit if it is not cached yet.
+vec3 SampleCached(
+    PrimaryHitCache &cache, const Sampler &sampler, const Camera &camera,
+    const int x, const int y, const int s, const int width, const int height,
+    SampleAOV *aov)
+{
+    const int k = s % cache.Count();
+    real dx, dy;
+    cache.Subpixel(x, y, k, dx, dy);
+    const Ray ray = camera.MakeRay(
+        (x + dx) / width, 1 - (y + dy) / height);
+    PrimaryHit primary;
+    if (!cache.Get(x, y, k, ray, primary)) {
+        primary = sampler.TracePrimary(ray);
+        cache.Put(x, y, k, primary);
+    }
+    return sampler.Sample(ray, &primary, aov);
+}
+
+// Renders rows y0 .. y0 + image.Height() - 1 of a frame that is
+// frameHeight rows tall into image. AOVs are collected when aovs is set,
+// and primary hits are reused from cache when it is set.
+void RenderBand(
+    Image &image, const int y0, const int frameHeight,
+    const Sampler &sampler, const Camera &camera,
+    const int numSamples, const int numThreads,
+    AOVBuffers *aovs = nullptr, PrimaryHitCache *cache = nullptr)
 {
     const int w = image.Width();
     const int h = image.Height();
-    const int wn = numThreads > 0 ?
-        numThreads : std::max(1u, std::thread::hardware_concurrency());
+    const int wn = NumWorkers(numThreads);
 
     ProgressBar bar;
-    bar.Start(h);
-
-    std::vector<std::thread> threads;
-    for (int wi = 0; wi < wn; wi++) {
-        threads.push_back(std::thread([&](int wi) {
-            // _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
-            // _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
-            std::vector<IndexedValue> stddevs(w);
-            for (int y = wi; y < h; y += wn) {
-                for (int x = 0; x < w; x++) {
-                    for (int s = 0; s < numSamples; s++) {
+    bar.Start(h, double(w) * numSamples);
+
+#ifdef TRACER_STATS
+    const RenderStats statsBefore = TotalStats();
+    const auto statsStart = std::chrono::steady_clock::now();
+#endif
+
+    const bool cost = aovs && aovs->RecordsCost();
+
+    ThreadPool::Shared().Run(wn, [&](const int wi) {
+        // _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+        // _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
+        std::vector<IndexedValue> stddevs(w);
+        for (int y = wi; y < h; y += wn) {
+            TraceSpan span("row", "render", "y", y0 + y);
+            for (int x = 0; x < w; x++) {
+                const uint64_t ticks = cost ? CycleCount() : 0;
+                uint64_t rays = 0;
+                STATS(rays = cost ? ThreadStats().Rays() : 0);
+                for (int s = 0; s < numSamples; s++) {
+                    SampleAOV aov;
+                    vec3 color;
+                    if (cache) {
+                        color = SampleCached(
+                            *cache, sampler, camera, x, y0 + y,
+                            image.NumSamples(x, y), w, frameHeight,
+                            aovs ? &aov : nullptr);
+                    } else {
                         const real u = (x + Random()) / w;
-                        const real v = (y + Random()) / h;
+                        const real v = (y0 + y + Random()) / frameHeight;
                         const Ray ray = camera.MakeRay(u, 1 - v);
-                        image.AddSample(x, y, sampler.Sample(ray));
+                        color = sampler.Sample(ray, aovs ? &aov : nullptr);
+                    }
+                    image.AddSample(x, y, color);
+                    if (aovs) {
+                        aovs->Add(x, y, aov);
                     }
-                    const real value = glm::compMax(image.StandardDeviation(x, y));
-                    // const real value = glm::compMax(image.Color(x, y));
-                    stddevs[x] = IndexedValue{x, value};
-                    // if (glm::compMax(image.StandardDeviation(x, y)) > 0.2) {
-                    //     for (int s = 0; s < 256; s++) {
-                    //         const real u = (x + Random()) / w;
-                    //         const real v = (y + Random()) / h;
-                    //         const Ray ray = camera.MakeRay(u, 1 - v);
-                    //         image.AddSample(x, y, sampler.Sample(ray));
-                    //     }
-                    // }
                 }
-
-                // std::sort(stddevs.begin(), stddevs.end(), [](auto &a, auto &b) {
-                //     return a.value > b.value;
-                // });
-                // for (int i = 0; i < w / 32; i++) {
-                //     int x = stddevs[i].index;
-                //     for (int s = 0; s < 1024; s++) {
+                if (cost) {
+                    STATS(rays = ThreadStats().Rays() - rays);
+                    aovs->AddCost(x, y, numSamples, CycleCount() - ticks, rays);
+                }
+                const real value = glm::compMax(image.StandardDeviation(x, y));
+                // const real value = glm::compMax(image.Color(x, y));
+                stddevs[x] = IndexedValue{x, value};
+                // if (glm::compMax(image.StandardDeviation(x, y)) > 0.2) {
+                //     for (int s = 0; s < 256; s++) {
                 //         const real u = (x + Random()) / w;
                 //         const real v = (y + Random()) / h;
                 //         const Ray ray = camera.MakeRay(u, 1 - v);
                 //         image.AddSample(x, y, sampler.Sample(ray));
                 //     }
                 // }
-
-                bar.Increment();
             }
-        }, wi));
+
+            // std::sort(stddevs.begin(), stddevs.end(), [](auto &a, auto &b) {
+            //     return a.value > b.value;
+            // });
+            // for (int i = 0; i < w / 32; i++) {
+            //     int x = stddevs[i].index;
+            //     for (int s = 0; s < 1024; s++) {
+            //         const real u = (x + Random()) / w;
+            //         const real v = (y + Random()) / h;
+            //         const Ray ray = camera.MakeRay(u, 1 - v);
+            //         image.AddSample(x, y, sampler.Sample(ray));
+            //     }
+            // }
+
+            bar.Increment();
+        }
+    });
+
+    bar.Done();
+
+#ifdef TRACER_STATS
+    if (ProgressBar::Enabled()) {
+        const double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - statsStart).count();
+        (TotalStats() - statsBefore).Print(seconds);
     }
+#endif
+}
+
+void Render(
+    Image &image, const Sampler &sampler, const Camera &camera,
+    const int numSamples, const int numThreads,
+    AOVBuffers *aovs = nullptr, PrimaryHitCache *cache = nullptr)
+{
+    RenderBand(
+        image, 0, image.Height(), sampler, camera, numSamples, numThreads,
+        aovs, cache);
+}
+
+// Renders the frame in horizontal bands of bandHeight rows, each one to
+// completion, and streams it to path (png, tif or pfm) before moving on,
+// so peak memory is proportional to the band height.
+void RunStreaming(
+    const int width, const int height, const int bandHeight,
+    const Sampler &sampler, const Camera &camera,
+    const int numSamples, const int numThreads, const std::string &path)
+{
+    std::cout << path << std::endl;
+
+    ImageLayout layout;
+    layout.Variance = false;
 
-    for (int wi = 0; wi < wn; wi++) {
-        threads[wi].join();
+    P_StripWriter writer = MakeStripWriter(path, width, height);
+    for (int y0 = 0; y0 < height; y0 += bandHeight) {
+        Image band(width, std::min(bandHeight, height - y0), layout);
+        RenderBand(
+            band, y0, height, sampler, camera, numSamples, numThreads);
+        TraceSpan span("WriteStrip", "io", "y", y0);
+        writer->Write(band, y0);
     }
+    writer->Finish();
+}
 
-    bar.Done();
+// zero padded frame number, used as the file name prefix of every output
+std::string FramePrefix(const int frame) {
+    char prefix[100];
+    snprintf(prefix, 100, "%08d", frame);
+    return prefix;
 }
 
+// Output side shared by Run and RunAnimation: frame numbering, AOV planes
+// and the optional denoising pass. Requested AOVs are written next to each
+// frame as %08d.<name>.pfm, cost planes also as %08d.<name>.png heatmaps,
+// and with TRACER_STATS the frame's ray and path statistics as
+// %08d.stats.json. When denoising is enabled the saved image is the
+// denoised one; the accumulation itself is left untouched, and the error
+// against an optional reference is printed. The filter's memory is
+// reserved up front, and an image that cannot be denoised (see
+// ReserveDenoise) fails before rendering.
+class FrameWriter {
+public:
+    FrameWriter(
+        Image &image, const AOVOptions &aovOptions,
+        const DenoiseOptions &denoiseOptions, const int numThreads) :
+        m_Image(image),
+        m_DenoiseOptions(denoiseOptions),
+        m_NumThreads(numThreads),
+        m_Frame(0),
+        m_TraceStart(-1),
+        m_DenoiseCharge(MemoryImages)
+    {
+        AOVOptions options = aovOptions;
+        if (denoiseOptions.Enabled) {
+            options.Albedo = true;
+            options.Normal = true;
+        }
+        if (options.Any()) {
+            m_AOVs.reset(new AOVBuffers(image, options));
+        }
+        if (denoiseOptions.Enabled && !denoiseOptions.Reference.empty()) {
+            m_Reference.reset(new Image(LoadPFM(denoiseOptions.Reference)));
+        }
+        if (denoiseOptions.Enabled) {
+            ReserveDenoise(image, m_DenoiseCharge);
+        }
+    }
+
+    AOVBuffers *AOVs() const {
+        return m_AOVs.get();
+    }
+
+    // announces the next frame's path
+    void Begin() {
+        std::cout << FramePrefix(m_Frame) << ".png" << std::endl;
+        m_TraceStart = Tracer::Shared().Enabled() ? Tracer::Shared().Now() : -1;
+#ifdef TRACER_STATS
+        m_StatsBefore = TotalStats();
+        m_StatsStart = std::chrono::steady_clock::now();
+#endif
+    }
+
+    // saves the image and AOVs as the next frame
+    void Save() {
+        if (m_TraceStart >= 0) {
+            Tracer &tracer = Tracer::Shared();
+            tracer.Record("frame", "render", m_TraceStart, tracer.Now(),
+                "frame", m_Frame);
+        }
+        const std::string prefix = FramePrefix(m_Frame++);
+        const std::string path = prefix + ".png";
+        if (m_AOVs) {
+            m_AOVs->SavePFM(prefix);
+            m_AOVs->SaveHeatmaps(prefix);
+        }
+#ifdef TRACER_STATS
+        const double renderSeconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - m_StatsStart).count();
+        std::ofstream(prefix + ".stats.json") << (TotalStats() - m_StatsBefore)
+            .ToJSON(renderSeconds).dump(2) << std::endl;
+#endif
+        if (!m_DenoiseOptions.Enabled) {
+            SavePNG(m_Image, path);
+            return;
+        }
+        // the reservation is handed to the filter for the frame
+        m_DenoiseCharge.Set(0);
+        {
+            const auto start = std::chrono::steady_clock::now();
+            const Image denoised =
+                Denoise(m_Image, m_DenoiseOptions, m_NumThreads);
+            const double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+            SavePNG(denoised, path);
+            printf("  denoised in %.3fs", seconds);
+            if (m_Reference) {
+                printf(", rmse %g -> %g", RMSE(m_Image, *m_Reference),
+                    RMSE(denoised, *m_Reference));
+            }
+            printf("\n");
+        }
+        m_DenoiseCharge.Set(DenoiseBytes(m_Image.Width(), m_Image.Height()));
+    }
+
+private:
+    // also ends the frame's trace
+    static void SavePNG(const Image &image, const std::string &path) {
+        {
+            TraceSpan span("SavePNG", "io");
+            image.SavePNG(path);
+        }
+        Tracer::Shared().Flush();
+    }
+
+    Image &m_Image;
+    DenoiseOptions m_DenoiseOptions;
+    int m_NumThreads;
+    int m_Frame;
+    int64_t m_TraceStart;
+    std::unique_ptr<AOVBuffers> m_AOVs;
+    std::unique_ptr<Image> m_Reference;
+    MemoryCharge m_DenoiseCharge;
+#ifdef TRACER_STATS
+    RenderStats m_StatsBefore;
+    std::chrono::steady_clock::time_point m_StatsStart;
+#endif
+};
+
+// Renders progressive frames, saving the image after each one (see
+// FrameWriter for AOV and denoising output).
+//
+// With cacheStrata > 0, primary hits are cached at cacheStrata^2 subpixel
+// positions per pixel and reused by later frames. The cache turns itself
+// off for a camera with depth of field or a scene with media.
 void Run(
     Image &image, const Sampler &sampler, const Camera &camera,
-    const int numFrames, const int numSamples, const int numThreads)
+    const int numFrames, const int numSamples, const int numThreads,
+    const AOVOptions &aovOptions = AOVOptions(),
+    const DenoiseOptions &denoiseOptions = DenoiseOptions(),
+    const int cacheStrata = 0)
 {
-    for (int i = 1; ; i++) {
-        char path[100];
-        snprintf(path, 100, "%08d.png", i - 1);
-        std::cout << path << std::endl;
+    std::unique_ptr<PrimaryHitCache> cache;
+    if (cacheStrata > 0) {
+        if (!camera.Pinhole()) {
+            printf("primary hit cache disabled: camera has an aperture\n");
+        } else if (!sampler.CanReusePrimaryHits()) {
+            printf("primary hit cache disabled: scene has media\n");
+        } else {
+            cache.reset(new PrimaryHitCache(
+                image.Width(), image.Height(), cacheStrata));
+            printf("primary hit cache: %.1f MB\n", cache->Bytes() / 1e6);
+        }
+    }
+
+    FrameWriter writer(image, aovOptions, denoiseOptions, numThreads);
+    MemoryTracker::Shared().Print();
 
-        Render(image, sampler, camera, numSamples, numThreads);
-        image.SavePNG(path);
+    for (int i = 1; ; i++) {
+        writer.Begin();
+        Render(
+            image, sampler, camera, numSamples, numThreads, writer.AOVs(),
+            cache.get());
+        writer.Save();
 
         if (numFrames > 0 && i == numFrames) {
             break;
         }
     }
 }
+
+// Renders numFrames frames spread evenly over the animation, the last one
+// just before its end so that looping animations (e.g. Turntable) repeat
+// seamlessly. Each frame applies the keyframe's camera and sets the
+// keyframe transform on every instance; the scene, its BVHs and the worker
+// threads are all reused, and only the light tree is rebuilt. Frames are
+// numbered and written exactly like Run's.
+void RunAnimation(
+    Image &image, Sampler &sampler, const Animation &animation,
+    const std::vector<P_Instance> &instances,
+    const real aspect, const real aperture, const real focalDistance,
+    const int numFrames, const int numSamples, const int numThreads,
+    const AOVOptions &aovOptions = AOVOptions(),
+    const DenoiseOptions &denoiseOptions = DenoiseOptions())
+{
+    FrameWriter writer(image, aovOptions, denoiseOptions, numThreads);
+    MemoryTracker::Shared().Print();
+
+    for (int i = 0; i < numFrames; i++) {
+        const real t = animation.Start() +
+            (animation.End() - animation.Start()) * i / numFrames;
+        const Keyframe k = animation.At(t);
+        const Camera camera(
+            k.Eye, k.Center, k.Up, k.Fovy, aspect, aperture, focalDistance);
+        const mat4 transform = k.Transform();
+        for (const auto &instance : instances) {
+            instance->SetTransform(transform);
+        }
+        sampler.UpdateLights();
+
+        image.Clear();
+        writer.Begin();
+        Render(
+            image, sampler, camera, numSamples, numThreads, writer.AOVs());
+        writer.Save();
+    }
+}
@@ -4,42 +4,118 @@
 #include <glm/gtx/component_wise.hpp>
 #include <memory>
 
+#include "aov.hpp"
 #include "config.hpp"
 #include "hit.hpp"
+#include "lightbvh.hpp"
+#include "onb.hpp"
 #include "ray.hpp"
+#include "stats.hpp"
 #include "util.hpp"
 
-// TODO: sample one random light or sample all lights
+// First intersection of a camera ray, so that a path can start from a
+// cached primary hit instead of tracing it again.
+struct PrimaryHit {
+    bool Found = false;
+    HitInfo Hit;
+    vec3 Emitted = vec3(0);
+};
 
 class Sampler {
 public:
     Sampler(const P_HittableList &world) :
         m_World(world),
+        m_LightTree(world->Lights()),
         m_MinBounces(8),
-        m_MaxBounces(64)
+        m_MaxBounces(64),
+        m_LightTreeThreshold(8),
+        m_Clamp(1)
     {}
 
+    // rebuilds the light tree after lights have moved
+    void UpdateLights() {
+        m_LightTree = LightBVH(m_World->Lights());
+    }
+
+    // per-sample radiance is clamped to this before accumulation to tame
+    // fireflies; <= 0 disables the clamp and keeps the estimate unbiased
+    void SetClamp(const real clamp) {
+        m_Clamp = clamp;
+    }
+
     vec3 Background(const Ray &ray) const {
         return vec3(0);
     }
 
     vec3 Sample(const Ray &cameraRay) const {
+        return Sample(cameraRay, nullptr);
+    }
+
+    // also fills aov (when not null) from the first non-specular vertex
+    vec3 Sample(const Ray &cameraRay, SampleAOV *aov) const {
+        return Sample(cameraRay, nullptr, aov);
+    }
+
+    PrimaryHit TracePrimary(const Ray &cameraRay) const {
+        PrimaryHit primary;
+        STATS(ThreadStats().PrimaryRays++);
+        primary.Found = m_World->Hit(cameraRay, EPS, INF, primary.Hit);
+        if (primary.Found) {
+            primary.Emitted = primary.Hit.Material->Emitted(
+                0, 0, primary.Hit.Position);
+        }
+        return primary;
+    }
+
+    // primary hits are only reusable when intersection is deterministic;
+    // participating media scatter at random distances
+    bool CanReusePrimaryHits() const {
+        return m_World->Media().empty();
+    }
+
+    // starts from primary (when not null) instead of intersecting cameraRay
+    vec3 Sample(
+        const Ray &cameraRay, const PrimaryHit *primary, SampleAOV *aov) const
+    {
         vec3 color(0, 0, 0);
         vec3 throughput(1, 1, 1);
         bool specular = true;
         Ray ray(cameraRay);
+        real distance = 0;
 
         const auto &lights = m_World->Lights();
 
+        STATS(RenderStats &stats = ThreadStats());
+        STATS(stats.Paths++);
+        STATS(int depth = 0);
+
         for (int bounces = 0; bounces < m_MaxBounces; bounces++) {
             HitInfo hit;
-            if (!m_World->Hit(ray, EPS, INF, hit)) {
+            const bool cached = bounces == 0 && primary;
+            STATS(if (!cached) (bounces ? stats.SecondaryRays : stats.PrimaryRays)++);
+            if (cached ? !primary->Found : !m_World->Hit(ray, EPS, INF, hit)) {
                 color = color + throughput * Background(ray);
+                if (aov) {
+                    aov->Albedo = throughput * Background(ray);
+                    aov = nullptr;
+                }
                 break;
             }
+            if (cached) {
+                hit = primary->Hit;
+            }
+            STATS(depth++);
+            if (aov) {
+                distance += hit.T * glm::length(ray.Direction());
+            }
 
-            const vec3 emitted = hit.Material->Emitted(0, 0, hit.Position);
+            const vec3 emitted = cached ? primary->Emitted :
+                hit.Material->Emitted(0, 0, hit.Position);
             if (glm::compMax(emitted) > 0) {
+                if (aov) {
+                    RecordAOV(hit, throughput, distance, *aov);
+                    aov = nullptr;
+                }
                 if (specular && glm::dot(hit.Normal, ray.Direction()) < 0) {
                     color = color + throughput * emitted;
                 }
@@ -54,20 +130,27 @@ public:
             real pdf;
             const vec3 a = hit.Material->Sample_f(p, wo, wi, pdf, specular);
 
-            // direct lighting
+            if (aov && !specular) {
+                RecordAOV(hit, throughput, distance, *aov);
+                aov = nullptr;
+            }
+
+            // direct lighting: every light when there are only a few,
+            // otherwise one light picked from the light tree
             if (!specular && !lights.empty()) {
-                // const auto &light = lights[RandomIntN(lights.size())];
-                for (const auto &light : m_World->Lights()) {
-                    const Ray lightRay = light->RandomRay(p);
-                    HitInfo lightHit;
-                    if (m_World->Hit(lightRay, EPS, INF, lightHit)) {
-                        const vec3 Li = lightHit.Material->Emitted(0, 0, lightHit.Position);
-                        if (glm::compMax(Li) > 0 && glm::dot(lightHit.Normal, lightRay.Direction()) < 0) {
-                            const real lightPdf = light->Pdf(lightRay);
-                            const vec3 lwi = onb.WorldToLocal(lightRay.Direction());
-                            const vec3 direct = hit.Material->f(p, wo, lwi) * Li / lightPdf;
-                            color = color + throughput * direct * std::abs(lwi.z);
-                        }
+                if (lights.size() <= m_LightTreeThreshold) {
+                    for (const auto &light : lights) {
+                        color = color + throughput *
+                            DirectLight(*light, hit, onb, wo);
+                    }
+                } else {
+                    real pmf;
+                    const vec3 n = hit.Material->Volumetric() ?
+                        vec3(0) : hit.Normal;
+                    const int i = m_LightTree.Sample(p, n, Random(), pmf);
+                    if (i >= 0) {
+                        color = color + throughput *
+                            DirectLight(*lights[i], hit, onb, wo) / pmf;
                     }
                 }
             }
@@ -93,9 +176,12 @@ public:
                 throughput = throughput * a;
             } else {
                 if (pdf < EPS) {
+                    STATS(stats.PdfBreaks++);
                     break;
                 }
-                throughput = throughput * a * std::abs(wi.z) / pdf;
+                const real cosine = hit.Material->Volumetric() ?
+                    1 : std::abs(wi.z);
+                throughput = throughput * a * cosine / pdf;
             }
 
             ray = Ray(p, onb.LocalToWorld(wi));
@@ -103,21 +189,72 @@ public:
             if (bounces >= m_MinBounces) {
                 const real prob = glm::compMax(throughput);
                 if (Random() > prob) {
+                    STATS(stats.RussianRoulette++);
                     break;
                 }
                 throughput = throughput / prob;
             }
         }
 
-        color = glm::min(color, vec3(1, 1, 1));
+        STATS(stats.AddDepth(depth));
+
+        if (m_Clamp > 0) {
+            color = glm::min(color, vec3(m_Clamp));
+        }
 
         return color;
     }
 
 private:
+    void RecordAOV(
+        const HitInfo &hit, const vec3 &throughput, const real distance,
+        SampleAOV &aov) const
+    {
+        aov.Albedo = throughput * hit.Material->Albedo(hit.Position);
+        aov.Normal = hit.Normal;
+        aov.Depth = distance;
+        aov.MaterialID = hit.Material->ID();
+    }
+
+    vec3 DirectLight(
+        const Hittable &light, const HitInfo &hit,
+        const ONB &onb, const vec3 &wo) const
+    {
+        const vec3 &p = hit.Position;
+        const Ray lightRay = light.RandomRay(p);
+        HitInfo lightHit;
+        STATS(RenderStats &stats = ThreadStats());
+        STATS(stats.ShadowRays++);
+        if (!m_World->HitSurface(lightRay, EPS, INF, lightHit)) {
+            return vec3(0);
+        }
+        const vec3 Li = lightHit.Material->Emitted(0, 0, lightHit.Position);
+        if (glm::compMax(Li) <= 0 || glm::dot(lightHit.Normal, lightRay.Direction()) >= 0) {
+            STATS(stats.ShadowRaysOccluded++);
+            return vec3(0);
+        }
+        const real lightPdf = light.Pdf(lightRay);
+        if (lightPdf <= 0) {
+            return vec3(0);
+        }
+        const real transmittance = m_World->Transmittance(
+            lightRay, EPS, lightHit.T);
+        if (transmittance <= 0) {
+            STATS(stats.ShadowRaysOccluded++);
+            return vec3(0);
+        }
+        const vec3 lwi = onb.WorldToLocal(lightRay.Direction());
+        const real cosine = hit.Material->Volumetric() ? 1 : std::abs(lwi.z);
+        return hit.Material->f(p, wo, lwi) * Li * transmittance * cosine /
+            lightPdf;
+    }
+
     P_HittableList m_World;
+    LightBVH m_LightTree;
     int m_MinBounces;
     int m_MaxBounces;
+    int m_LightTreeThreshold;
+    real m_Clamp;
 };
 
 typedef std::shared_ptr<Sampler> P_Sampler;
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+#include "../vendor/json.hpp"
+
+#include "assets.hpp"
+#include "camera.hpp"
+#include "config.hpp"
+#include "cube.hpp"
+#include "disney.hpp"
+#include "backend.hpp"
+#include "bvh.hpp"
+#include "bvhlist.hpp"
+#include "hit.hpp"
+#include "instance.hpp"
+#include "material.hpp"
+#include "medium.hpp"
+#include "points.hpp"
+#include "sphere.hpp"
+#include "texture.hpp"
+#include "util.hpp"
+
+using json = nlohmann::json;
+
+// JSON scene descriptions. Vectors are [x, y, z]. Colors are linear
+// [r, g, b], "#rrggbb" hex (decoded like HexColor), or {"kelvin": K}, any
+// of them optionally scaled by "intensity" when given as an object:
+//
+//   {
+//     "width": 1600, "height": 1600, "samples": 64,
+//     "camera": {"eye": [3, 0, 1], "center": [0, 0, 0], "up": [0, 0, 1],
+//                "fovy": 25, "aperture": 0.01, "focalDistance": 3},
+//     "objects": [
+//       {"type": "mesh", "path": "model.stl", "fit": true,
+//        "rotate": {"axis": [0, 0, 1], "degrees": 60},
+//        "material": {"type": "disney", "baseColor": "#777880"}},
+//       {"type": "cube", "min": [-100, -100, -100], "max": [100, 100, -0.5],
+//        "material": {"type": "lambertian", "albedo": "#2A2C2B"}},
+//       {"type": "sphere", "center": [5, 3, 3], "radius": 2,
+//        "material": {"type": "light", "color": {"kelvin": 5000, "intensity": 10}}}
+//     ]
+//   }
+//
+// A "mesh" "path" may be .stl, .obj or .ply (see LoadMesh). One with a
+// "creaseAngle" in degrees gets smooth vertex normals that keep hard edges
+// where faces meet at more than that (180 smooths everything; see
+// Mesh::SmoothNormals). One with "reorder": true has its triangles and
+// vertices sorted for memory locality after loading (see Mesh::Reorder),
+// which speeds up large scans.
+//
+// "spheres" scatters "count" spheres with radii in "radius": [lo, hi]
+// uniformly over the box "min" / "max" from "seed", splitting them evenly
+// between "materials". "points" renders the point cloud at "path" (.ply or
+// .xyz, see LoadPoints) as spheres of "radius" unless the file gives
+// radii, with "materials" picked per point by the file's material_index or
+// else split evenly. A "medium" fills its "boundary" object with a
+// homogeneous volume of "density" and scattering "albedo". Given a "grid"
+// instead, {"path": "smoke.raw", "size": [nx, ny, nz], "format": "uint8"
+// | "float32"} (see LoadRawDensityGrid), it is a heterogeneous volume
+// stretched over the box "min" / "max", with the voxels scaled by
+// "density" (default 1). A "group" puts its "objects" under one BVH over
+// their bounds, which pays off for many spheres, cubes or instances.
+//
+// "bvh" sets how BVHs are built and traversed (see BVHOptions):
+// {"quality": "low" | "medium" | "high", "compact": bool, "robust": bool,
+// "coherent": bool}. On an object it overrides the keys given for the
+// whole scene.
+//
+// Objects may also carry a "name", which batch jobs use to override their
+// materials per shot (see batch.hpp).
+
+vec3 ParseVec3(const json &j) {
+    if (!j.is_array() || j.size() != 3) {
+        throw std::runtime_error("expected [x, y, z]: " + j.dump());
+    }
+    return vec3(j[0].get<real>(), j[1].get<real>(), j[2].get<real>());
+}
+
+vec3 ParseColor(const json &j) {
+    if (j.is_string()) {
+        const std::string s = j.get<std::string>();
+        if (s.size() != 7 || s[0] != '#') {
+            throw std::runtime_error("expected #rrggbb: " + s);
+        }
+        return HexColor(std::stoi(s.substr(1), nullptr, 16));
+    }
+    if (j.is_object()) {
+        const vec3 color = j.count("kelvin") ?
+            Kelvin(j["kelvin"].get<real>()) : ParseColor(j.at("color"));
+        return color * j.value("intensity", real(1));
+    }
+    return ParseVec3(j);
+}
+
+P_Texture ParseTexture(const json &j) {
+    return std::make_shared<SolidTexture>(ParseColor(j));
+}
+
+P_Material ParseMaterial(const json &j) {
+    const std::string type = j.value("type", "disney");
+    if (type == "disney") {
+        DisneyParameters params;
+        params.baseColor = ParseColor(j.value("baseColor", json("#cccccc")));
+        params.metallic = j.value("metallic", real(0));
+        params.subsurface = j.value("subsurface", real(0));
+        params.specular = j.value("specular", real(0.5));
+        params.roughness = j.value("roughness", real(0.5));
+        params.specularTint = j.value("specularTint", real(0));
+        params.anisotropic = j.value("anisotropic", real(0));
+        params.sheen = j.value("sheen", real(0));
+        params.sheenTint = j.value("sheenTint", real(0));
+        params.clearcoat = j.value("clearcoat", real(0));
+        params.clearcoatGloss = j.value("clearcoatGloss", real(0));
+        return std::make_shared<Disney>(params);
+    }
+    if (type == "lambertian") {
+        return std::make_shared<Lambertian>(ParseTexture(j.at("albedo")));
+    }
+    if (type == "metal") {
+        return std::make_shared<Metal>(ParseTexture(j.at("albedo")));
+    }
+    if (type == "dielectric") {
+        return std::make_shared<Dielectric>(
+            ParseTexture(j.value("albedo", json("#ffffff"))),
+            j.value("eta", real(1.5)));
+    }
+    if (type == "light") {
+        return std::make_shared<DiffuseLight>(ParseTexture(j.at("color")));
+    }
+    throw std::runtime_error("unknown material type: " + type);
+}
+
+Camera ParseCamera(const json &j, const real aspect) {
+    return Camera(
+        ParseVec3(j.at("eye")), ParseVec3(j.at("center")),
+        ParseVec3(j.value("up", json({0, 0, 1}))), j.value("fovy", real(25)),
+        aspect, j.value("aperture", real(0)), j.value("focalDistance", real(1)));
+}
+
+BVHOptions ParseBVHOptions(
+    const json &j, const BVHOptions &defaults = BVHOptions())
+{
+    BVHOptions result = defaults;
+    if (j.count("quality")) {
+        result.Quality = ParseBVHQuality(j["quality"].get<std::string>());
+    }
+    result.Compact = j.value("compact", result.Compact);
+    result.Robust = j.value("robust", result.Robust);
+    result.Coherent = j.value("coherent", result.Coherent);
+    return result;
+}
+
+// optional "scale", "rotate" and "translate", applied in that order
+mat4 ParseTransform(const json &j) {
+    mat4 m(1);
+    if (j.count("translate")) {
+        m = glm::translate(m, ParseVec3(j["translate"]));
+    }
+    if (j.count("rotate")) {
+        const json &r = j["rotate"];
+        m = glm::rotate(
+            m, glm::radians(r.at("degrees").get<real>()), ParseVec3(r.at("axis")));
+    }
+    if (j.count("scale")) {
+        m = glm::scale(m, vec3(j["scale"].get<real>()));
+    }
+    return m;
+}
+
+// Meshes come from (and stay in) assets; a transform on a mesh is applied
+// with an Instance so the cached BVH is reused as is.
+P_Hittable ParseObject(
+    const json &j, AssetCache &assets,
+    const BVHOptions &bvh = BVHOptions())
+{
+    const std::string type = j.at("type").get<std::string>();
+    const P_Material material = ParseMaterial(j.value("material", json::object()));
+    const BVHOptions options =
+        ParseBVHOptions(j.value("bvh", json::object()), bvh);
+    if (type == "mesh") {
+        const P_Hittable mesh = assets.Mesh(
+            j.at("path").get<std::string>(), j.value("fit", false), material,
+            options, j.value("reorder", false),
+            j.count("creaseAngle") ?
+                glm::radians(j["creaseAngle"].get<real>()) : real(-1));
+        if (j.count("translate") || j.count("rotate") || j.count("scale")) {
+            return std::make_shared<Instance>(mesh, ParseTransform(j));
+        }
+        return mesh;
+    }
+    if (type == "sphere") {
+        return std::make_shared<Sphere>(
+            ParseVec3(j.at("center")), j.at("radius").get<real>(), material);
+    }
+    if (type == "cube") {
+        return std::make_shared<Cube>(
+            ParseVec3(j.at("min")), ParseVec3(j.at("max")), material);
+    }
+    if (type == "spheres") {
+        std::vector<P_Material> materials;
+        for (const json &m : j.at("materials")) {
+            materials.push_back(ParseMaterial(m));
+        }
+        const vec3 min = ParseVec3(j.at("min"));
+        const vec3 max = ParseVec3(j.at("max"));
+        const json &radius = j.at("radius");
+        std::mt19937 gen(j.value("seed", 0));
+        std::uniform_real_distribution<real> dist(0, 1);
+        std::vector<EmbreeSphere> spheres(j.at("count").get<int>());
+        for (EmbreeSphere &s : spheres) {
+            s.x = glm::mix(min.x, max.x, dist(gen));
+            s.y = glm::mix(min.y, max.y, dist(gen));
+            s.z = glm::mix(min.z, max.z, dist(gen));
+            s.r = glm::mix(
+                radius.at(0).get<real>(), radius.at(1).get<real>(), dist(gen));
+        }
+        return MakeSpheres(assets.Device(), spheres, materials, options);
+    }
+    if (type == "points") {
+        std::vector<P_Material> materials;
+        for (const json &m : j.at("materials")) {
+            materials.push_back(ParseMaterial(m));
+        }
+        return LoadPoints(assets.Device(), j.at("path").get<std::string>(),
+            j.value("radius", real(0.01)), materials, options);
+    }
+    if (type == "group") {
+        std::vector<P_Hittable> items;
+        for (const json &object : j.at("objects")) {
+            items.push_back(ParseObject(object, assets, options));
+        }
+        return std::make_shared<BVHList>(items, options);
+    }
+    if (type == "medium" && j.count("grid")) {
+        const json &grid = j["grid"];
+        const json &size = grid.at("size");
+        if (!size.is_array() || size.size() != 3) {
+            throw std::runtime_error("expected [nx, ny, nz]: " + size.dump());
+        }
+        return std::make_shared<GridMedium>(
+            Box(ParseVec3(j.at("min")), ParseVec3(j.at("max"))),
+            LoadRawDensityGrid(grid.at("path").get<std::string>(),
+                size[0].get<int>(), size[1].get<int>(), size[2].get<int>(),
+                grid.value("format", "")),
+            ParseTexture(j.value("albedo", json("#ffffff"))),
+            j.value("density", real(1)));
+    }
+    if (type == "medium") {
+        return std::make_shared<ConstantMedium>(
+            ParseObject(j.at("boundary"), assets, options),
+            ParseTexture(j.value("albedo", json("#ffffff"))),
+            j.at("density").get<real>());
+    }
+    throw std::runtime_error("unknown object type: " + type);
+}
+
+P_HittableList ParseWorld(
+    const json &objects, AssetCache &assets,
+    const BVHOptions &bvh = BVHOptions())
+{
+    auto world = std::make_shared<HittableList>();
+    for (const json &object : objects) {
+        world->Add(ParseObject(object, assets, bvh));
+    }
+    return world;
+}
@@ -9,6 +9,64 @@
 #include "ray.hpp"
 #include "util.hpp"
 
+// Sphere geometry shared by Sphere and the lights of sphere aggregates
+// (see EmbreeSphereEmitter).
+
+// nearest t in (tmin, tmax) where ray meets the sphere
+inline bool IntersectSphere(
+    const vec3 &center, const real radius, const Ray &ray,
+    const real tmin, const real tmax, real &t)
+{
+    const vec3 oc = ray.Origin() - center;
+    const real a = glm::dot(ray.Direction(), ray.Direction());
+    const real b = glm::dot(oc, ray.Direction());
+    const real c = glm::dot(oc, oc) - radius * radius;
+    const real d = b * b - a * c;
+    if (d > 0) {
+        t = (-b - std::sqrt(b * b - a * c)) / a;
+        if (t < tmax && t > tmin) {
+            return true;
+        }
+        t = (-b + std::sqrt(b * b - a * c)) / a;
+        if (t < tmax && t > tmin) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline LightInfo SphereLightInfo(
+    const vec3 &center, const real radius, const vec3 &emitted)
+{
+    const vec3 r(radius);
+    const real area = 4 * PI * radius * radius;
+    return LightInfo{
+        Box(center - r, center + r), vec3(0, 0, 1), -1,
+        Luminance(emitted) * area};
+}
+
+// ray from o towards a point on the sphere's disk as seen from o
+inline Ray SphereRandomRay(
+    const vec3 &center, const real radius, const vec3 &o)
+{
+    const vec3 dir = center - o;
+    const ONB onb(dir);
+    const vec3 p = center + onb.LocalToWorld(RandomInUnitDisk() * radius);
+    return Ray(o, glm::normalize(p - o));
+}
+
+// solid angle pdf of SphereRandomRay, 0 for rays that miss
+inline real SpherePdf(const vec3 &center, const real radius, const Ray &ray) {
+    real t;
+    if (!IntersectSphere(center, radius, ray, EPS, INF, t)) {
+        return 0;
+    }
+    const real costhetamax = std::sqrt(
+        1 - radius * radius / glm::length2(center - ray.Origin()));
+    const real solidangle = 2 * PI * (1 - costhetamax);
+    return 1 / solidangle;
+}
+
 class Sphere : public Hittable {
 public:
     Sphere(const vec3 &center, const real radius, const P_Material &material) :
@@ -18,52 +76,36 @@ public:
         return m_Material->Emits();
     }
 
+    virtual LightInfo EmitterInfo() const {
+        return SphereLightInfo(
+            m_Center, m_Radius, m_Material->Emitted(0, 0, m_Center));
+    }
+
+    virtual bool BoundingBox(Box &box) const {
+        box = Box(m_Center - vec3(m_Radius), m_Center + vec3(m_Radius));
+        return true;
+    }
+
     virtual bool Hit(
         const Ray &ray, const real tmin, const real tmax, HitInfo &hit) const
     {
-        const vec3 oc = ray.Origin() - m_Center;
-        const real a = glm::dot(ray.Direction(), ray.Direction());
-        const real b = glm::dot(oc, ray.Direction());
-        const real c = glm::dot(oc, oc) - m_Radius * m_Radius;
-        const real d = b * b - a * c;
-        if (d > 0) {
-            real t = (-b - std::sqrt(b * b - a * c)) / a;
-            if (t < tmax && t > tmin) {
-                hit.T = t;
-                hit.Position = ray.At(t);
-                hit.Normal = (hit.Position - m_Center) / m_Radius;
-                hit.Material = m_Material;
-                return true;
-            }
-            t = (-b + std::sqrt(b * b - a * c)) / a;
-            if (t < tmax && t > tmin) {
-                hit.T = t;
-                hit.Position = ray.At(t);
-                hit.Normal = (hit.Position - m_Center) / m_Radius;
-                hit.Material = m_Material;
-                return true;
-            }
+        real t;
+        if (!IntersectSphere(m_Center, m_Radius, ray, tmin, tmax, t)) {
+            return false;
         }
-        return false;
+        hit.T = t;
+        hit.Position = ray.At(t);
+        hit.Normal = (hit.Position - m_Center) / m_Radius;
+        hit.Material = m_Material;
+        return true;
     }
 
     virtual Ray RandomRay(const vec3 &o) const {
-        const vec3 dir = m_Center - o;
-        const ONB onb(dir);
-        const vec3 p = m_Center + onb.LocalToWorld(
-            RandomInUnitDisk() * m_Radius);
-        return Ray(o, glm::normalize(p - o));
+        return SphereRandomRay(m_Center, m_Radius, o);
     }
 
     virtual real Pdf(const Ray &ray) const {
-        HitInfo hit;
-        if (!Hit(ray, EPS, INF, hit)) {
-            return 0;
-        }
-        const real costhetamax = std::sqrt(
-            1 - m_Radius * m_Radius / glm::length2(m_Center - ray.Origin()));
-        const real solidangle = 2 * PI * (1 - costhetamax);
-        return 1 / solidangle;
+        return SpherePdf(m_Center, m_Radius, ray);
     }
 
 private:
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../vendor/json.hpp"
+
+// Ray and path statistics. Counting is compiled in only with TRACER_STATS
+// (make STATS=1); otherwise every STATS(...) statement disappears.
+//
+// Each thread counts into its own RenderStats without synchronization.
+// TotalStats() sums every thread's counters and must only be called while
+// no render is running, e.g. between frames. Totals only grow, so the
+// statistics of a frame are the difference of two totals.
+#ifdef TRACER_STATS
+#define STATS(statement) statement
+const bool StatsEnabled = true;
+#else
+#define STATS(statement)
+const bool StatsEnabled = false;
+#endif
+
+// Cheap timestamp for measuring short spans of work: the CPU's time stamp
+// counter where there is one, otherwise steady clock nanoseconds.
+inline uint64_t CycleCount() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+struct RenderStats {
+    // path lengths of MaxDepth or more share the last bucket
+    static const int MaxDepth = 16;
+
+    uint64_t Paths = 0;
+    uint64_t PrimaryRays = 0;
+    uint64_t SecondaryRays = 0;
+    uint64_t ShadowRays = 0;
+    uint64_t ShadowRaysOccluded = 0;
+    uint64_t RussianRoulette = 0;
+    uint64_t PdfBreaks = 0;
+    uint64_t Depth[MaxDepth] = {};
+
+    uint64_t Rays() const {
+        return PrimaryRays + SecondaryRays + ShadowRays;
+    }
+
+    void AddDepth(const int depth) {
+        Depth[depth < MaxDepth ? depth : MaxDepth - 1]++;
+    }
+
+    RenderStats operator-(const RenderStats &other) const {
+        RenderStats r;
+        r.Paths = Paths - other.Paths;
+        r.PrimaryRays = PrimaryRays - other.PrimaryRays;
+        r.SecondaryRays = SecondaryRays - other.SecondaryRays;
+        r.ShadowRays = ShadowRays - other.ShadowRays;
+        r.ShadowRaysOccluded = ShadowRaysOccluded - other.ShadowRaysOccluded;
+        r.RussianRoulette = RussianRoulette - other.RussianRoulette;
+        r.PdfBreaks = PdfBreaks - other.PdfBreaks;
+        for (int i = 0; i < MaxDepth; i++) {
+            r.Depth[i] = Depth[i] - other.Depth[i];
+        }
+        return r;
+    }
+
+    void Add(const RenderStats &other) {
+        Paths += other.Paths;
+        PrimaryRays += other.PrimaryRays;
+        SecondaryRays += other.SecondaryRays;
+        ShadowRays += other.ShadowRays;
+        ShadowRaysOccluded += other.ShadowRaysOccluded;
+        RussianRoulette += other.RussianRoulette;
+        PdfBreaks += other.PdfBreaks;
+        for (int i = 0; i < MaxDepth; i++) {
+            Depth[i] += other.Depth[i];
+        }
+    }
+
+    double MeanDepth() const {
+        uint64_t n = 0;
+        uint64_t sum = 0;
+        for (int i = 0; i < MaxDepth; i++) {
+            n += Depth[i];
+            sum += Depth[i] * i;
+        }
+        return n ? double(sum) / n : 0;
+    }
+
+    // one line summary; seconds is the time the counted work took
+    void Print(const double seconds) const {
+        printf("  %.2f Mrays/s: %llu primary, %llu secondary, %llu shadow "
+            "(%.1f%% occluded), depth %.2f, %llu rr, %llu pdf\n",
+            Rays() / seconds / 1e6,
+            (unsigned long long)PrimaryRays,
+            (unsigned long long)SecondaryRays,
+            (unsigned long long)ShadowRays,
+            ShadowRays ? 100.0 * ShadowRaysOccluded / ShadowRays : 0.0,
+            MeanDepth(),
+            (unsigned long long)RussianRoulette,
+            (unsigned long long)PdfBreaks);
+    }
+
+    nlohmann::json ToJSON(const double seconds) const {
+        return {
+            {"seconds", seconds},
+            {"paths", Paths},
+            {"rays", Rays()},
+            {"raysPerSecond", seconds > 0 ? Rays() / seconds : 0},
+            {"primaryRays", PrimaryRays},
+            {"secondaryRays", SecondaryRays},
+            {"shadowRays", ShadowRays},
+            {"shadowRaysOccluded", ShadowRaysOccluded},
+            {"russianRoulette", RussianRoulette},
+            {"pdfBreaks", PdfBreaks},
+            {"depth", std::vector<uint64_t>(Depth, Depth + MaxDepth)}};
+    }
+};
+
+// every thread's counters, see ThreadStats
+class StatsRegistry {
+public:
+    // never destroyed, as pool threads exit during static destruction
+    static StatsRegistry &Shared() {
+        static StatsRegistry *registry = new StatsRegistry();
+        return *registry;
+    }
+
+    void Register(const RenderStats *stats) {
+        std::lock_guard<std::mutex> guard(m_Mutex);
+        m_Threads.push_back(stats);
+    }
+
+    // keeps the counts of an exiting thread
+    void Retire(const RenderStats *stats) {
+        std::lock_guard<std::mutex> guard(m_Mutex);
+        m_Retired.Add(*stats);
+        m_Threads.erase(std::find(m_Threads.begin(), m_Threads.end(), stats));
+    }
+
+    RenderStats Total() {
+        std::lock_guard<std::mutex> guard(m_Mutex);
+        RenderStats total = m_Retired;
+        for (const RenderStats *stats : m_Threads) {
+            total.Add(*stats);
+        }
+        return total;
+    }
+
+private:
+    std::mutex m_Mutex;
+    std::vector<const RenderStats *> m_Threads;
+    RenderStats m_Retired;
+};
+
+// the calling thread's counters
+inline RenderStats &ThreadStats() {
+    struct Slot {
+        Slot() {
+            StatsRegistry::Shared().Register(&Stats);
+        }
+        ~Slot() {
+            StatsRegistry::Shared().Retire(&Stats);
+        }
+        RenderStats Stats;
+    };
+    static thread_local Slot slot;
+    return slot.Stats;
+}
+
+// sum of every thread's counters
+inline RenderStats TotalStats() {
+    return StatsRegistry::Shared().Total();
+}
@@ -1,30 +1,112 @@
 #pragma once
 
-#include <boost/interprocess/file_mapping.hpp>
-#include <boost/interprocess/mapped_region.hpp>
+#include <cstdint>
+#include <cstring>
+#include <glm/glm.hpp>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
 #include "config.hpp"
+#include "memory.hpp"
 #include "mesh.hpp"
+#include "parallel.hpp"
+#include "parse.hpp"
+#include "trace.hpp"
 
-using namespace boost::interprocess;
+// Binary STL when the size matches the triangle count at byte 80, which
+// also catches binary files whose header starts with "solid"; otherwise
+// ASCII if it starts with "solid" and has vertices. Anything else of at
+// least a header is read as binary with as many triangles as its size
+// holds, as files with padding or a wrong count in the header are common.
+// ASCII files are parsed in parallel chunks of lines, counting "vertex"
+// lines first so that every chunk knows where its vertices go. Both give
+// an unwelded soup for Mesh to weld.
+MeshData ParseSTL(const char *data, const size_t size, const std::string &path) {
+    TraceSpan span("ParseSTL", "load", "bytes", size);
+    // the unwelded vertices plus the welded mesh at worst
+    const auto require = [&](const int64_t numVertices) {
+        MemoryTracker::Shared().Require(
+            numVertices * sizeof(vec3) * 2 +
+            numVertices / 3 * sizeof(glm::ivec3), path);
+    };
+    const auto binary = [&](const int64_t numTriangles) {
+        require(numTriangles * 3);
+        MeshData result;
+        result.Positions.resize(numTriangles * 3);
+        ParallelFor(numTriangles, 0, [&](const int i) {
+            // each record is a normal, three vertices and two attribute bytes
+            float p[9];
+            memcpy(p, data + 84 + int64_t(i) * 50 + 12, sizeof(p));
+            result.Positions[i * 3 + 0] = vec3(p[0], p[1], p[2]);
+            result.Positions[i * 3 + 1] = vec3(p[3], p[4], p[5]);
+            result.Positions[i * 3 + 2] = vec3(p[6], p[7], p[8]);
+        }, 4096);
+        return result;
+    };
+    uint32_t numTriangles = 0;
+    if (size >= 84) {
+        memcpy(&numTriangles, data + 80, 4);
+        if (84 + uint64_t(numTriangles) * 50 == size) {
+            return binary(numTriangles);
+        }
+    }
+    if (size < 5 || memcmp(data, "solid", 5)) {
+        if (size < 84) {
+            throw std::runtime_error(path + ": not an STL file");
+        }
+        return binary((size - 84) / 50);
+    }
+
+    MeshData result;
+    const std::vector<const char *> bounds = SplitLines(data, data + size);
+    const int numChunks = bounds.size() - 1;
+    // counts[c] becomes the number of vertices before chunk c
+    std::vector<int64_t> counts(numChunks + 1);
+    ParallelFor(numChunks, 0, [&](const int c) {
+        const char *end = bounds[c + 1];
+        for (const char *p = bounds[c]; p < end; SkipLine(p, end)) {
+            SkipSpaces(p, end);
+            counts[c + 1] += MatchWord(p, end, "vertex");
+        }
+    });
+    for (int c = 0; c < numChunks; c++) {
+        counts[c + 1] += counts[c];
+    }
+    if (counts[numChunks] == 0 && size >= 84) {
+        // a binary file whose header starts with "solid"
+        return binary((size - 84) / 50);
+    }
+    if (counts[numChunks] % 3) {
+        throw std::runtime_error(path + ": STL vertices are not triangles");
+    }
+    require(counts[numChunks]);
+    result.Positions.resize(counts[numChunks]);
 
-P_Mesh LoadBinarySTL(std::string path) {
-    file_mapping fm(path.c_str(), read_only);
-    mapped_region mr(fm, read_only);
-    uint8_t *src = (uint8_t *)mr.get_address();
-    const int numBytes = mr.get_size();
-    const int numTriangles = std::max(0, (numBytes - 84) / 50);
-    const int numVertices = numTriangles * 3;
-    std::vector<vec3> vertices(numVertices);
-    src += 96;
-    for (int i = 0; i < numTriangles; i++) {
-        const float *p = (float *)src;
-        vertices[i * 3 + 0] = vec3(p[0], p[1], p[2]);
-        vertices[i * 3 + 1] = vec3(p[3], p[4], p[5]);
-        vertices[i * 3 + 2] = vec3(p[6], p[7], p[8]);
-        src += 50;
+    // the pool cannot throw from its threads, so chunks report failure
+    std::vector<char> malformed(numChunks);
+    ParallelFor(numChunks, 0, [&](const int c) {
+        const char *end = bounds[c + 1];
+        int64_t index = counts[c];
+        for (const char *p = bounds[c]; p < end; SkipLine(p, end)) {
+            SkipSpaces(p, end);
+            if (!MatchWord(p, end, "vertex")) {
+                continue;
+            }
+            p += 6;
+            vec3 &v = result.Positions[index++];
+            if (!ParseReal(p, end, v.x) || !ParseReal(p, end, v.y) ||
+                !ParseReal(p, end, v.z))
+            {
+                malformed[c] = 1;
+                return;
+            }
+        }
+    });
+    for (const char m : malformed) {
+        if (m) {
+            throw std::runtime_error(path + ": malformed STL vertex");
+        }
     }
-    return std::make_shared<Mesh>(vertices);
+    return result;
 }
@@ -0,0 +1,345 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <glm/glm.hpp>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#include "config.hpp"
+#include "image.hpp"
+#include "tonemap.hpp"
+
+// Writers that receive an image as a sequence of horizontal bands (top to
+// bottom) and write each one straight to disk, so that only the current
+// band ever has to be held in memory.
+class StripWriter {
+public:
+    // band holds rows y0 .. y0 + band.Height() - 1 of the output image
+    virtual void Write(const Image &band, const int y0) = 0;
+    virtual void Finish() = 0;
+    virtual ~StripWriter() {}
+};
+
+typedef std::shared_ptr<StripWriter> P_StripWriter;
+
+namespace {
+
+void WriteU32BE(std::ostream &out, const uint32_t value) {
+    const uint8_t bytes[4] = {
+        uint8_t(value >> 24), uint8_t(value >> 16),
+        uint8_t(value >> 8), uint8_t(value)};
+    out.write((const char *)bytes, 4);
+}
+
+template <typename T>
+void WriteLE(std::ostream &out, const T value) {
+    uint8_t bytes[sizeof(T)];
+    for (int i = 0; i < sizeof(T); i++) {
+        bytes[i] = uint8_t(uint64_t(value) >> (i * 8));
+    }
+    out.write((const char *)bytes, sizeof(T));
+}
+
+}
+
+// 8-bit RGB PNG. Rows are Paeth filtered and fed through a single zlib
+// stream whose output is flushed as IDAT chunks.
+class PNGStripWriter : public StripWriter {
+public:
+    PNGStripWriter(
+        const std::string &path, const int width, const int height,
+        const ToneMapOptions &options) :
+        m_Out(path, std::ios::binary),
+        m_Width(width),
+        m_Options(options),
+        m_Previous(width * 3, 0),
+        m_Current(width * 3),
+        m_Filtered(width * 3 + 1),
+        m_Buffer(1 << 16)
+    {
+        if (!m_Out) {
+            throw std::runtime_error("cannot open " + path);
+        }
+        static const uint8_t signature[8] = {
+            0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        m_Out.write((const char *)signature, 8);
+
+        uint8_t ihdr[13] = {0};
+        for (int i = 0; i < 4; i++) {
+            ihdr[i] = uint8_t(width >> (24 - i * 8));
+            ihdr[4 + i] = uint8_t(height >> (24 - i * 8));
+        }
+        ihdr[8] = 8; // bit depth
+        ihdr[9] = 2; // truecolor
+        WriteChunk("IHDR", ihdr, 13);
+
+        m_Stream = z_stream();
+        deflateInit(&m_Stream, Z_DEFAULT_COMPRESSION);
+    }
+
+    virtual void Write(const Image &band, const int y0) {
+        const int n = m_Width * 3;
+        for (int y = 0; y < band.Height(); y++) {
+            band.ToneMapRow(y, m_Options, m_Current.data());
+            m_Filtered[0] = 4; // paeth
+            for (int i = 0; i < n; i++) {
+                const int a = i >= 3 ? m_Current[i - 3] : 0;
+                const int b = m_Previous[i];
+                const int c = i >= 3 ? m_Previous[i - 3] : 0;
+                const int p = a + b - c;
+                const int pa = std::abs(p - a);
+                const int pb = std::abs(p - b);
+                const int pc = std::abs(p - c);
+                const int predictor = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+                m_Filtered[i + 1] = uint8_t(m_Current[i] - predictor);
+            }
+            Deflate(m_Filtered.data(), n + 1, Z_NO_FLUSH);
+            std::swap(m_Previous, m_Current);
+        }
+    }
+
+    virtual void Finish() {
+        Deflate(nullptr, 0, Z_FINISH);
+        deflateEnd(&m_Stream);
+        WriteChunk("IEND", nullptr, 0);
+        m_Out.close();
+    }
+
+private:
+    void Deflate(uint8_t *data, const int size, const int flush) {
+        m_Stream.next_in = data;
+        m_Stream.avail_in = size;
+        while (true) {
+            m_Stream.next_out = m_Buffer.data();
+            m_Stream.avail_out = m_Buffer.size();
+            const int status = deflate(&m_Stream, flush);
+            const int produced = m_Buffer.size() - m_Stream.avail_out;
+            if (produced > 0) {
+                WriteChunk("IDAT", m_Buffer.data(), produced);
+            }
+            if (flush == Z_FINISH ? status == Z_STREAM_END : m_Stream.avail_out != 0) {
+                break;
+            }
+        }
+    }
+
+    void WriteChunk(const char *type, const uint8_t *data, const int size) {
+        WriteU32BE(m_Out, size);
+        m_Out.write(type, 4);
+        if (size > 0) {
+            m_Out.write((const char *)data, size);
+        }
+        uLong crc = crc32(0, (const Bytef *)type, 4);
+        if (size > 0) {
+            crc = crc32(crc, data, size);
+        }
+        WriteU32BE(m_Out, crc);
+    }
+
+    std::ofstream m_Out;
+    int m_Width;
+    ToneMapOptions m_Options;
+    z_stream m_Stream;
+    std::vector<uint8_t> m_Previous;
+    std::vector<uint8_t> m_Current;
+    std::vector<uint8_t> m_Filtered;
+    std::vector<uint8_t> m_Buffer;
+};
+
+// Uncompressed 8-bit RGB baseline TIFF, one strip per row. The IFD goes at
+// the end of the file once all strip offsets are known. Classic TIFF
+// offsets are 32 bits, so files that would pass 4 GiB are written as
+// BigTIFF, whose offsets, counts and value fields are 64 bits.
+class TIFFStripWriter : public StripWriter {
+public:
+    TIFFStripWriter(
+        const std::string &path, const int width, const int height,
+        const ToneMapOptions &options) :
+        m_Out(path, std::ios::binary),
+        m_Width(width),
+        m_Height(height),
+        m_Options(options),
+        m_Row(width * 3)
+    {
+        if (!m_Out) {
+            throw std::runtime_error("cannot open " + path);
+        }
+        // pixels, two tables of a word per strip, and the IFD at worst
+        const uint64_t size = uint64_t(width) * height * 3 +
+            uint64_t(height) * 16 + 1024;
+        m_Big = size > 0xffffffffull;
+        if (m_Big) {
+            m_Out.write("II+\0", 4);
+            WriteLE<uint16_t>(m_Out, 8); // offset size
+            WriteLE<uint16_t>(m_Out, 0);
+        } else {
+            m_Out.write("II*\0", 4);
+        }
+        Offset(0); // IFD offset, patched in Finish
+        m_Offsets.reserve(height);
+    }
+
+    virtual void Write(const Image &band, const int y0) {
+        for (int y = 0; y < band.Height(); y++) {
+            band.ToneMapRow(y, m_Options, m_Row.data());
+            m_Offsets.push_back(m_Out.tellp());
+            m_Out.write((const char *)m_Row.data(), m_Row.size());
+        }
+    }
+
+    virtual void Finish() {
+        const uint32_t rowBytes = m_Width * 3;
+        // LONG or LONG8 strip offsets
+        const uint16_t offsetType = m_Big ? 16 : 4;
+
+        // out-of-line tag values, word aligned
+        Align();
+        const uint64_t bitsOffset = m_Out.tellp();
+        for (int i = 0; i < 3; i++) {
+            WriteLE<uint16_t>(m_Out, 8);
+        }
+        const uint64_t offsetsOffset = m_Out.tellp();
+        for (const uint64_t offset : m_Offsets) {
+            Offset(offset);
+        }
+        const uint64_t countsOffset = m_Out.tellp();
+        for (int i = 0; i < m_Offsets.size(); i++) {
+            WriteLE<uint32_t>(m_Out, rowBytes);
+        }
+
+        Align();
+        const uint64_t ifdOffset = m_Out.tellp();
+        const int numTags = 10;
+        if (m_Big) {
+            WriteLE<uint64_t>(m_Out, numTags);
+        } else {
+            WriteLE<uint16_t>(m_Out, numTags);
+        }
+        Tag(256, 4, 1, m_Width);         // ImageWidth
+        Tag(257, 4, 1, m_Height);        // ImageLength
+        if (m_Big) {
+            // three SHORTs fit in BigTIFF's 8 byte value field
+            Tag(258, 3, 3, 8 | 8 << 16 | uint64_t(8) << 32); // BitsPerSample
+        } else {
+            Tag(258, 3, 3, bitsOffset);  // BitsPerSample
+        }
+        Tag(259, 3, 1, 1);               // Compression: none
+        Tag(262, 3, 1, 2);               // PhotometricInterpretation: RGB
+        Tag(273, offsetType, m_Offsets.size(), offsetsOffset); // StripOffsets
+        Tag(277, 3, 1, 3);               // SamplesPerPixel
+        Tag(278, 4, 1, 1);               // RowsPerStrip
+        Tag(279, 4, m_Offsets.size(), countsOffset); // StripByteCounts
+        Tag(284, 3, 1, 1);               // PlanarConfiguration: chunky
+        Offset(0);
+
+        m_Out.seekp(m_Big ? 8 : 4);
+        Offset(ifdOffset);
+        m_Out.close();
+    }
+
+private:
+    void Align() {
+        if (m_Out.tellp() % 2) {
+            m_Out.put(0);
+        }
+    }
+
+    // an offset, count or value field: 4 bytes, or 8 in BigTIFF
+    void Offset(const uint64_t value) {
+        if (m_Big) {
+            WriteLE<uint64_t>(m_Out, value);
+        } else {
+            WriteLE<uint32_t>(m_Out, value);
+        }
+    }
+
+    // Values are left justified in the value field, which a little endian
+    // write of the whole field does for SHORTs and LONGs alike.
+    void Tag(
+        const uint16_t tag, const uint16_t type, const uint64_t count,
+        const uint64_t value)
+    {
+        WriteLE<uint16_t>(m_Out, tag);
+        WriteLE<uint16_t>(m_Out, type);
+        Offset(count);
+        Offset(value);
+    }
+
+    std::ofstream m_Out;
+    int m_Width;
+    int m_Height;
+    ToneMapOptions m_Options;
+    bool m_Big;
+    std::vector<uint8_t> m_Row;
+    std::vector<uint64_t> m_Offsets;
+};
+
+// Linear float RGB PFM written straight from the accumulators. PFM stores
+// rows bottom to top, so each row is written at its final offset.
+class PFMStripWriter : public StripWriter {
+public:
+    PFMStripWriter(const std::string &path, const int width, const int height) :
+        m_Out(path, std::ios::binary),
+        m_Width(width),
+        m_Height(height),
+        m_Row(width * 3)
+    {
+        if (!m_Out) {
+            throw std::runtime_error("cannot open " + path);
+        }
+        const std::string header =
+            "PF\n" + std::to_string(width) + " " +
+            std::to_string(height) + "\n-1.0\n";
+        m_Out.write(header.data(), header.size());
+        m_DataOffset = header.size();
+    }
+
+    virtual void Write(const Image &band, const int y0) {
+        const size_t rowBytes = m_Row.size() * sizeof(float);
+        for (int y = 0; y < band.Height(); y++) {
+            for (int x = 0; x < m_Width; x++) {
+                const vec3 c = band.Color(x, y);
+                m_Row[x * 3 + 0] = c.r;
+                m_Row[x * 3 + 1] = c.g;
+                m_Row[x * 3 + 2] = c.b;
+            }
+            const int row = m_Height - 1 - (y0 + y);
+            m_Out.seekp(m_DataOffset + row * rowBytes);
+            m_Out.write((const char *)m_Row.data(), rowBytes);
+        }
+    }
+
+    virtual void Finish() {
+        m_Out.close();
+    }
+
+private:
+    std::ofstream m_Out;
+    int m_Width;
+    int m_Height;
+    size_t m_DataOffset;
+    std::vector<float> m_Row;
+};
+
+// picks the writer from the file extension; options apply to 8-bit formats
+P_StripWriter MakeStripWriter(
+    const std::string &path, const int width, const int height,
+    const ToneMapOptions &options = ToneMapOptions())
+{
+    const std::string ext = path.substr(path.find_last_of('.') + 1);
+    if (ext == "png") {
+        return std::make_shared<PNGStripWriter>(path, width, height, options);
+    }
+    if (ext == "tif" || ext == "tiff") {
+        return std::make_shared<TIFFStripWriter>(path, width, height, options);
+    }
+    if (ext == "pfm") {
+        return std::make_shared<PFMStripWriter>(path, width, height);
+    }
+    throw std::runtime_error("unsupported streaming output format: " + path);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "config.hpp"
+
+// Linear radiance to 8-bit display values: scale by 2^Exposure, apply
+// 1 / Gamma and quantize. The default matches the original fixed curve.
+struct ToneMapOptions {
+    real Exposure = 0;
+    real Gamma = 2.2;
+};
+
+namespace {
+
+// Branch free log2 / exp2 approximations (relative error ~1e-5, far below
+// 8-bit quantization) built from plain float and integer ops, so that the
+// loops below auto-vectorize instead of calling pow per element.
+
+inline float FastLog2(const float x) {
+    uint32_t i;
+    memcpy(&i, &x, sizeof(i));
+    // exponent as float via 2^23 + k, again avoiding int conversions
+    const uint32_t k = 0x4b000000 | ((i >> 23) & 0xff);
+    float e;
+    memcpy(&e, &k, sizeof(e));
+    e -= 8388608.f + 127;
+    i = (i & 0x007fffff) | 0x3f800000;
+    float m;
+    memcpy(&m, &i, sizeof(m));
+    // log2(m) for m in [1, 2) via atanh series in t = (m - 1) / (m + 1)
+    const float t = (m - 1) / (m + 1);
+    const float t2 = t * t;
+    const float s = t * (1 + t2 * (1.f / 3 + t2 * (1.f / 5 + t2 * (1.f / 7))));
+    return e + s * 2.88539008f; // 2 / ln(2)
+}
+
+inline float FastExp2(float x) {
+    x = x > -126.f ? x : -126.f;
+    // round x - 0.5 to an integer by adding 1.5 * 2^23, which leaves it in
+    // the low mantissa bits; float to int conversions block vectorization
+    const float magic = 12582912.f;
+    const float t = (x - 0.5f) + magic;
+    const float f = (x - (t - magic)) * 0.693147181f; // ln(2)
+    uint32_t bits;
+    memcpy(&bits, &t, sizeof(bits));
+    const uint32_t i = (bits - 0x4b400000 + 127) << 23;
+    float scale;
+    memcpy(&scale, &i, sizeof(scale));
+    const float p = 1 + f * (1 + f * (1.f / 2 + f * (1.f / 6 + f * (
+        1.f / 24 + f * (1.f / 120 + f * (1.f / 720))))));
+    return scale * p;
+}
+
+}
+
+// Tone maps n pixels given as three planar float rows into interleaved
+// RGB bytes.
+inline void ToneMapPixels(
+    const float *r, const float *g, const float *b, const int n,
+    const ToneMapOptions &options, uint8_t *dst)
+{
+    const float scale = std::exp2(options.Exposure);
+    const float exponent = 1 / options.Gamma;
+    const float *planes[3] = {r, g, b};
+    const int block = 64;
+    float values[block];
+    for (int start = 0; start < n; start += block) {
+        const int count = std::min(block, n - start);
+        for (int c = 0; c < 3; c++) {
+            const float *src = planes[c] + start;
+            for (int i = 0; i < count; i++) {
+                const float x = src[i] * scale;
+                const float v = x > 1e-30f ? x : 1e-30f; // also drops NaN
+                const float e = FastExp2(FastLog2(v) * exponent);
+                values[i] = e * 256 < 255.f ? e * 256 : 255.f;
+            }
+            uint8_t *out = dst + start * 3 + c;
+            for (int i = 0; i < count; i++) {
+                out[i * 3] = uint8_t(values[i]);
+            }
+        }
+    }
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Opt-in timeline of a render session in the Chrome trace event format,
+// viewable in chrome://tracing or ui.perfetto.dev. Nothing is recorded
+// until Tracer::Shared().Start(path) is called; until then a TraceSpan
+// costs one relaxed atomic load.
+//
+// Spans are buffered per thread and appended to the file by Flush(),
+// which is called between frames. The file is written in the array form
+// without its closing bracket, which viewers accept, so a session that is
+// interrupted still leaves a readable trace.
+class Tracer {
+public:
+    // never destroyed, as pool threads may still record during exit
+    static Tracer &Shared() {
+        static Tracer *tracer = new Tracer();
+        return *tracer;
+    }
+
+    // call from the main thread
+    void Start(const std::string &path) {
+        {
+            std::lock_guard<std::mutex> guard(m_Mutex);
+            m_File = fopen(path.c_str(), "w");
+            if (!m_File) {
+                throw std::runtime_error("cannot write " + path);
+            }
+            fprintf(m_File, "[\n");
+            m_Epoch = std::chrono::steady_clock::now();
+            m_Enabled = true;
+        }
+        SetThreadName("main");
+    }
+
+    bool Enabled() const {
+        return m_Enabled.load(std::memory_order_relaxed);
+    }
+
+    // microseconds since Start
+    int64_t Now() const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - m_Epoch).count();
+    }
+
+    // names the calling thread in the timeline; name is not escaped
+    void SetThreadName(const std::string &name) {
+        ThreadBuffer &buffer = LocalBuffer();
+        std::lock_guard<std::mutex> guard(buffer.Mutex);
+        buffer.Name = name;
+        buffer.NameWritten = false;
+    }
+
+    // name, category and argName must be string literals
+    void Record(
+        const char *name, const char *category, const int64_t start,
+        const int64_t end, const char *argName, const int64_t argValue)
+    {
+        ThreadBuffer &buffer = LocalBuffer();
+        std::lock_guard<std::mutex> guard(buffer.Mutex);
+        buffer.Events.push_back(
+            Event{name, category, start, end - start, argName, argValue});
+    }
+
+    void Flush() {
+        if (!Enabled()) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(m_Mutex);
+        for (const auto &buffer : m_Buffers) {
+            std::lock_guard<std::mutex> bufferGuard(buffer->Mutex);
+            if (!buffer->NameWritten) {
+                fprintf(m_File,
+                    "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,"
+                    "\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+                    buffer->ID, buffer->Name.c_str());
+                buffer->NameWritten = true;
+            }
+            for (const Event &e : buffer->Events) {
+                fprintf(m_File,
+                    "{\"ph\":\"X\",\"name\":\"%s\",\"cat\":\"%s\",\"pid\":1,"
+                    "\"tid\":%d,\"ts\":%lld,\"dur\":%lld",
+                    e.Name, e.Category, buffer->ID,
+                    (long long)e.Start, (long long)e.Duration);
+                if (e.ArgName) {
+                    fprintf(m_File, ",\"args\":{\"%s\":%lld}",
+                        e.ArgName, (long long)e.ArgValue);
+                }
+                fprintf(m_File, "},\n");
+            }
+            buffer->Events.clear();
+        }
+        fflush(m_File);
+    }
+
+private:
+    struct Event {
+        const char *Name;
+        const char *Category;
+        int64_t Start;
+        int64_t Duration;
+        const char *ArgName;
+        int64_t ArgValue;
+    };
+
+    struct ThreadBuffer {
+        std::mutex Mutex;
+        int ID;
+        std::string Name;
+        bool NameWritten = false;
+        std::vector<Event> Events;
+    };
+
+    Tracer() : m_Enabled(false), m_File(nullptr) {}
+
+    // buffers outlive their threads so that late events are still written
+    ThreadBuffer &LocalBuffer() {
+        static thread_local ThreadBuffer *local = nullptr;
+        if (!local) {
+            std::lock_guard<std::mutex> guard(m_Mutex);
+            m_Buffers.emplace_back(new ThreadBuffer());
+            local = m_Buffers.back().get();
+            local->ID = m_Buffers.size() - 1;
+            local->Name = "thread " + std::to_string(local->ID);
+        }
+        return *local;
+    }
+
+    std::atomic<bool> m_Enabled;
+    std::mutex m_Mutex;
+    FILE *m_File;
+    std::chrono::steady_clock::time_point m_Epoch;
+    std::vector<std::unique_ptr<ThreadBuffer>> m_Buffers;
+};
+
+// Records the time from construction to destruction as a span on the
+// calling thread, with an optional integer argument.
+class TraceSpan {
+public:
+    TraceSpan(
+        const char *name, const char *category = "render",
+        const char *argName = nullptr, const int64_t argValue = 0) :
+        m_Name(name),
+        m_Category(category),
+        m_ArgName(argName),
+        m_ArgValue(argValue),
+        m_Start(Tracer::Shared().Enabled() ? Tracer::Shared().Now() : -1)
+    {}
+
+    ~TraceSpan() {
+        if (m_Start >= 0) {
+            Tracer &tracer = Tracer::Shared();
+            tracer.Record(
+                m_Name, m_Category, m_Start, tracer.Now(),
+                m_ArgName, m_ArgValue);
+        }
+    }
+
+private:
+    const char *m_Name;
+    const char *m_Category;
+    const char *m_ArgName;
+    int64_t m_ArgValue;
+    int64_t m_Start;
+};
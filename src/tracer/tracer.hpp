@@ -1,25 +1,58 @@
 #pragma once
 
+#include "animation.hpp"
+#include "aov.hpp"
+#include "assets.hpp"
+#include "backend.hpp"
+#include "batch.hpp"
 #include "box.hpp"
+#include "bvh.hpp"
+#include "bvhlist.hpp"
+#include "bvhmesh.hpp"
 #include "camera.hpp"
 #include "colormap.hpp"
 #include "config.hpp"
 #include "cube.hpp"
+#include "daemon.hpp"
+#include "denoise.hpp"
 #include "disney.hpp"
+#include "distribution.hpp"
+#ifndef TRACER_NO_EMBREE
 #include "embreemesh.hpp"
+#include "embreescene.hpp"
 #include "embreespheres.hpp"
+#endif
+#include "half.hpp"
+#include "hdr.hpp"
 #include "hit.hpp"
 #include "image.hpp"
+#include "instance.hpp"
+#include "lightbvh.hpp"
 #include "material.hpp"
+#include "memory.hpp"
 #include "medium.hpp"
 #include "mesh.hpp"
+#include "meshio.hpp"
+#include "meshlight.hpp"
 #include "microfacet.hpp"
+#include "obj.hpp"
 #include "onb.hpp"
+#include "parallel.hpp"
+#include "parse.hpp"
+#include "ply.hpp"
+#include "points.hpp"
+#include "primary.hpp"
 #include "progress.hpp"
 #include "ray.hpp"
 #include "render.hpp"
 #include "sampler.hpp"
+#include "scene.hpp"
 #include "sphere.hpp"
+#include "stats.hpp"
+#include "stream.hpp"
 #include "stl.hpp"
 #include "texture.hpp"
+#include "tonemap.hpp"
+#include "trace.hpp"
 #include "util.hpp"
+#include "volume.hpp"
@@ -2,24 +2,33 @@
 
 #include <chrono>
 #include <cmath>
+#include <cstdint>
 #include <glm/glm.hpp>
 #include <glm/gtx/norm.hpp>
 #include <random>
 
 #include "config.hpp"
 
-inline real Random() {
+// per thread generator behind Random and RandomIntN, seeded from the clock
+inline std::mt19937 &RandomGenerator() {
     static thread_local std::mt19937 gen(
         std::chrono::high_resolution_clock::now().time_since_epoch().count());
+    return gen;
+}
+
+// makes the calling thread's random sequence repeatable
+inline void SeedRandom(const uint32_t seed) {
+    RandomGenerator().seed(seed);
+}
+
+inline real Random() {
     std::uniform_real_distribution<real> dist(0, 1);
-    return dist(gen);
+    return dist(RandomGenerator());
 }
 
 inline int RandomIntN(const int n) {
-    static thread_local std::mt19937 gen(
-        std::chrono::high_resolution_clock::now().time_since_epoch().count());
     std::uniform_int_distribution<int> dist(0, n - 1);
-    return dist(gen);
+    return dist(RandomGenerator());
 }
 
 inline vec3 RandomInUnitSphere() {
@@ -46,6 +55,13 @@ inline vec3 RandomInUnitDisk() {
     }
 }
 
+// uniform point on a triangle
+inline vec3 RandomInTriangle(const vec3 &p1, const vec3 &p2, const vec3 &p3) {
+    const real s = std::sqrt(Random());
+    const real t = Random();
+    return p1 * (1 - s) + p2 * (s * (1 - t)) + p3 * (s * t);
+}
+
 inline vec3 CosineSampleHemisphere() {
     const vec3 d = RandomInUnitDisk();
     const real z = std::sqrt(std::max(real(0), 1 - d.x * d.x - d.y * d.y));
@@ -126,6 +142,10 @@ inline vec3 Kelvin(const real K) {
     return vec3(red, green, blue);
 }
 
+inline real Luminance(const vec3 &c) {
+    return 0.2126 * c.r + 0.7152 * c.g + 0.0722 * c.b;
+}
+
 inline real Clamp(const real value, const real lo, const real hi) {
     if (value <= lo) {
         return lo;
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <algorithm>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <cmath>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "config.hpp"
+#include "memory.hpp"
+
+// Voxel density grid. Samples sit at voxel centers and are trilinearly
+// interpolated; coordinates are normalized to [0, 1] over the whole grid.
+class DensityGrid {
+public:
+    DensityGrid(
+        const int nx, const int ny, const int nz,
+        const std::vector<float> &data) :
+        m_Size(nx, ny, nz), m_Data(data), m_Charge(MemoryVolumes)
+    {
+        m_Charge.Set(m_Data.size() * sizeof(float));
+    }
+
+    const glm::ivec3 &Size() const {
+        return m_Size;
+    }
+
+    real At(const int x, const int y, const int z) const {
+        const int cx = std::min(std::max(x, 0), m_Size.x - 1);
+        const int cy = std::min(std::max(y, 0), m_Size.y - 1);
+        const int cz = std::min(std::max(z, 0), m_Size.z - 1);
+        return m_Data[(cz * m_Size.y + cy) * m_Size.x + cx];
+    }
+
+    real Density(const vec3 &uvw) const {
+        const vec3 p = uvw * vec3(m_Size) - real(0.5);
+        const vec3 f = glm::floor(p);
+        const int x = f.x;
+        const int y = f.y;
+        const int z = f.z;
+        const vec3 d = p - f;
+        const real d00 = glm::mix(At(x, y, z), At(x + 1, y, z), d.x);
+        const real d10 = glm::mix(At(x, y + 1, z), At(x + 1, y + 1, z), d.x);
+        const real d01 = glm::mix(At(x, y, z + 1), At(x + 1, y, z + 1), d.x);
+        const real d11 = glm::mix(At(x, y + 1, z + 1), At(x + 1, y + 1, z + 1), d.x);
+        const real d0 = glm::mix(d00, d10, d.y);
+        const real d1 = glm::mix(d01, d11, d.y);
+        return glm::mix(d0, d1, d.z);
+    }
+
+    // upper bound of Density over the normalized box [lo, hi]
+    real MaxDensity(const vec3 &lo, const vec3 &hi) const {
+        const vec3 a = glm::floor(lo * vec3(m_Size) - real(0.5));
+        const vec3 b = glm::floor(hi * vec3(m_Size) - real(0.5)) + real(1);
+        real result = 0;
+        for (int z = a.z; z <= b.z; z++) {
+            for (int y = a.y; y <= b.y; y++) {
+                for (int x = a.x; x <= b.x; x++) {
+                    result = std::max(result, At(x, y, z));
+                }
+            }
+        }
+        return result;
+    }
+
+private:
+    glm::ivec3 m_Size;
+    std::vector<float> m_Data;
+    MemoryCharge m_Charge;
+};
+
+typedef std::shared_ptr<DensityGrid> P_DensityGrid;
+
+// Loads a headerless x-fastest voxel file of format "uint8" (normalized to
+// [0, 1]) or "float32". Without a format it is inferred from the file size.
+P_DensityGrid LoadRawDensityGrid(
+    const std::string &path, const int nx, const int ny, const int nz,
+    const std::string &format = "")
+{
+    if (!format.empty() && format != "uint8" && format != "float32") {
+        throw std::runtime_error("unknown voxel format " + format + ": " + path);
+    }
+    using namespace boost::interprocess;
+    file_mapping fm(path.c_str(), read_only);
+    mapped_region mr(fm, read_only);
+    const uint8_t *src = (const uint8_t *)mr.get_address();
+    const size_t numBytes = mr.get_size();
+    const size_t numVoxels = size_t(nx) * ny * nz;
+    // the loaded samples and the grid's copy
+    MemoryTracker::Shared().Require(numVoxels * sizeof(float) * 2, path);
+    std::vector<float> data(numVoxels);
+    if (numBytes == numVoxels * sizeof(float) && format != "uint8") {
+        const float *p = (const float *)src;
+        std::copy(p, p + numVoxels, data.begin());
+    } else if (numBytes == numVoxels && format != "float32") {
+        for (size_t i = 0; i < numVoxels; i++) {
+            data[i] = src[i] / 255.f;
+        }
+    } else {
+        throw std::runtime_error(
+            "unexpected size for " + std::to_string(nx) + "x" +
+            std::to_string(ny) + "x" + std::to_string(nz) +
+            " volume: " + path);
+    }
+    return std::make_shared<DensityGrid>(nx, ny, nz, data);
+}